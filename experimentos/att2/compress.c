@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "compress.h"
+
+int codec_available(uint32_t codec)
+{
+    switch (codec)
+    {
+        case CODEC_NONE:
+            return 1;
+#ifdef HAVE_LZ4
+        case CODEC_LZ4:
+            return 1;
+#endif
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+int parse_codec(const char *arg, uint32_t *codec, int *level)
+{
+    *level = DEFAULT_ZSTD_LEVEL;
+    if (!strcasecmp(arg, "lz4"))
+    {
+        *codec = CODEC_LZ4;
+        return codec_available(CODEC_LZ4) ? 0 : -1;
+    }
+    if (strncasecmp(arg, "zstd", 4) || (arg[4] != '\0' && arg[4] != ':'))
+        return -1;
+
+    *codec = CODEC_ZSTD;
+#ifdef HAVE_ZSTD
+    if (arg[4] == ':')
+    {
+        char *end;
+
+        *level = strtol(arg + 5, &end, 0);
+        if (end == arg + 5 || *end != '\0' || *level < ZSTD_minCLevel() || *level > ZSTD_maxCLevel())
+            return -1;
+    }
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+const char *codec_name(uint32_t codec)
+{
+    switch (codec)
+    {
+        case CODEC_LZ4:
+            return "lz4";
+        case CODEC_ZSTD:
+            return "zstd";
+        default:
+            return "none";
+    }
+}
+
+// Takes items until the batch runs out, called and returns with the lock held
+static void pool_drain(struct worker_pool *pool, int worker)
+{
+    while (pool->next < pool->nitems)
+    {
+        uint32_t item = pool->next++;
+
+        pthread_mutex_unlock(&pool->lock);
+        int err = pool->fn(pool->arg, item, worker);
+        pthread_mutex_lock(&pool->lock);
+
+        if (err)
+            pool->failed = 1;
+        if (++pool->finished == pool->nitems)
+            pthread_cond_broadcast(&pool->idle);
+    }
+}
+
+static void *pool_thread(void *data)
+{
+    struct pool_thread *thread = data;
+    struct worker_pool *pool = thread->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop)
+    {
+        if (pool->next < pool->nitems)
+            pool_drain(pool, thread->index);
+        else
+            pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int compressor_init(struct compressor *comp, uint32_t codec, int level, int workers,
+    uint32_t chunk_size, int decompress)
+{
+    struct worker_pool *pool = &comp->pool;
+
+    memset(comp, 0, sizeof(*comp));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    if (!codec_available(codec))
+        return -1;
+    if (codec == CODEC_NONE)
+        workers = 1;
+    comp->codec = codec;
+    comp->level = level;
+    comp->workers = workers;
+    comp->decompress = decompress;
+
+    // Every worker compresses with contexts and a chunk of its own
+    if (codec != CODEC_NONE)
+    {
+        comp->zctx = calloc(workers, sizeof(void *));
+        comp->scratch = calloc(workers, sizeof(char *));
+        if (!comp->zctx || !comp->scratch)
+            return -1;
+        for (int i = 0; i < workers; i++)
+        {
+            comp->scratch[i] = malloc(chunk_size);
+            if (!comp->scratch[i])
+                return -1;
+#ifdef HAVE_ZSTD
+            if (codec != CODEC_ZSTD)
+                continue;
+            comp->zctx[i] = decompress ? (void *)ZSTD_createDCtx() : (void *)ZSTD_createCCtx();
+            if (!comp->zctx[i])
+                return -1;
+#endif
+        }
+    }
+
+    // The caller is the last worker, the pool only starts the others
+    pool->threads = calloc(workers, sizeof(struct pool_thread));
+    if (!pool->threads)
+        return -1;
+    for (int i = 0; i < workers - 1; i++)
+    {
+        pool->threads[i].pool = pool;
+        pool->threads[i].index = i;
+        if (pthread_create(&pool->threads[i].thread, NULL, pool_thread, &pool->threads[i]))
+        {
+            perror("Error starting a worker thread");
+            return -1;
+        }
+        pool->nthreads++;
+    }
+
+    return 0;
+}
+
+int compressor_run(struct compressor *comp, pool_fn fn, void *arg, uint32_t nitems)
+{
+    struct worker_pool *pool = &comp->pool;
+    int failed;
+
+    if (nitems == 0)
+        return 0;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->nitems = nitems;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->failed = 0;
+    pthread_cond_broadcast(&pool->wake);
+
+    pool_drain(pool, pool->nthreads);
+    while (pool->finished < pool->nitems)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+
+    // Nothing is left for the threads to take until the next batch
+    failed = pool->failed;
+    pool->nitems = 0;
+    pool->next = 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    return failed ? -1 : 0;
+}
+
+uint32_t compress_chunk(struct compressor *comp, int worker, const char *src, uint32_t length,
+    char *dst, uint32_t capacity)
+{
+    if (length == 0 || capacity == 0)
+        return 0;
+
+    // Both give up once the output would not fit in capacity
+#ifdef HAVE_LZ4
+    if (comp->codec == CODEC_LZ4)
+        return LZ4_compress_default(src, dst, length, capacity);
+#endif
+#ifdef HAVE_ZSTD
+    if (comp->codec == CODEC_ZSTD)
+    {
+        size_t compressed = ZSTD_compressCCtx(comp->zctx[worker], dst, capacity, src, length, comp->level);
+        if (ZSTD_isError(compressed))
+            return 0;
+
+        return compressed;
+    }
+#endif
+
+    return 0;
+}
+
+int decompress_chunk(struct compressor *comp, int worker, const char *src, uint32_t length,
+    char *dst, uint32_t raw_length)
+{
+#ifdef HAVE_LZ4
+    if (comp->codec == CODEC_LZ4)
+        return LZ4_decompress_safe(src, dst, length, raw_length) == (int)raw_length ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+    if (comp->codec == CODEC_ZSTD)
+    {
+        size_t decompressed = ZSTD_decompressDCtx(comp->zctx[worker], dst, raw_length, src, length);
+        if (ZSTD_isError(decompressed) || decompressed != raw_length)
+            return -1;
+
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
+void compressor_destroy(struct compressor *comp)
+{
+    struct worker_pool *pool = &comp->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i].thread, NULL);
+    free(pool->threads);
+
+    for (int i = 0; comp->codec != CODEC_NONE && i < comp->workers; i++)
+    {
+        if (comp->scratch)
+            free(comp->scratch[i]);
+#ifdef HAVE_ZSTD
+        if (comp->zctx && comp->zctx[i] && comp->decompress)
+            ZSTD_freeDCtx(comp->zctx[i]);
+        else if (comp->zctx && comp->zctx[i])
+            ZSTD_freeCCtx(comp->zctx[i]);
+#endif
+    }
+    free(comp->zctx);
+    free(comp->scratch);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+}
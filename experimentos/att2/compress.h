@@ -0,0 +1,141 @@
+/*
+    Optional compression stage of the transfer, see -z on the client
+
+    The client reads, compresses and checksums the chunks it is about to post
+    on a pool of worker threads, so a batch of chunks is compressed in
+    parallel while the NIC is still busy with the ones before it, and the
+    server checks, decompresses and writes the chunks of one poll the same
+    way. A chunk that does not shrink by at least 1/COMPRESS_MIN_GAIN goes as
+    it is and CHUNK_COMPRESSED, in the length of its header, tells the server
+    which one it got.
+
+    Without a codec the pool has no threads and runs everything on the caller.
+*/
+#ifndef __RDMA_COMPRESS__
+#define __RDMA_COMPRESS__
+#include <stdint.h>
+#include <pthread.h>
+
+/* codecs, in cdata */
+#define CODEC_NONE          0
+#define CODEC_LZ4           1
+#define CODEC_ZSTD          2
+
+#define DEFAULT_ZSTD_LEVEL  1
+#define DEFAULT_WORKERS     4
+#define MAX_WORKERS         64
+#define COMPRESS_MIN_GAIN   16
+
+/* work on one item of a batch, worker is the index of the thread running it */
+typedef int (*pool_fn)(void *arg, uint32_t item, int worker);
+
+struct pool_thread {
+    struct worker_pool  *pool;
+    pthread_t           thread;
+    int                 index;
+};
+
+struct worker_pool {
+    struct pool_thread  *threads;
+    int                 nthreads;   // threads besides the caller of compressor_run
+    pthread_mutex_t     lock;
+    pthread_cond_t      wake;       // a batch is ready or the pool stops
+    pthread_cond_t      idle;       // the last item of the batch is done
+    pool_fn             fn;
+    void                *arg;
+    uint32_t            nitems;
+    uint32_t            next;       // first item nobody took yet
+    uint32_t            finished;
+    int                 failed;
+    int                 stop;
+};
+
+struct compressor {
+    struct worker_pool  pool;
+    uint32_t            codec;
+    int                 level;
+    int                 workers;    // pool threads plus the caller
+    int                 decompress;
+    void                **zctx;     // ZSTD_CCtx or ZSTD_DCtx of every worker
+    char                **scratch;  // one chunk for every worker
+};
+
+/**
+ * @brief whether a codec is built in, each library is optional (HAVE_LZ4,
+ * HAVE_ZSTD)
+ * @param codec CODEC_NONE, CODEC_LZ4 or CODEC_ZSTD
+ * @return 1 if chunks can be compressed and decompressed with it, 0 otherwise
+ */
+int codec_available(uint32_t codec);
+
+/**
+ * @brief parses the argument of -z
+ * @param arg "lz4", "zstd" or "zstd:level"
+ * @param codec set to CODEC_LZ4 or CODEC_ZSTD
+ * @param level set to the zstd level, DEFAULT_ZSTD_LEVEL if not given
+ * @return 0, or -1 if arg is not one of them or the codec is not built in
+ */
+int parse_codec(const char *arg, uint32_t *codec, int *level);
+
+/**
+ * @brief name of a codec, for the reports
+ */
+const char *codec_name(uint32_t codec);
+
+/**
+ * @brief starts the worker threads and sets up what every worker needs
+ * @param comp the compressor
+ * @param codec CODEC_NONE, CODEC_LZ4 or CODEC_ZSTD
+ * @param level zstd level, unused otherwise
+ * @param workers threads working on a batch, the caller included
+ * @param chunk_size size of the scratch chunk of every worker
+ * @param decompress 1 on the server, 0 on the client
+ * @return 0 or -1
+ */
+int compressor_init(struct compressor *comp, uint32_t codec, int level, int workers,
+    uint32_t chunk_size, int decompress);
+
+/**
+ * @brief runs fn on items 0 to nitems - 1 on every worker and the caller,
+ * returns once all of them are done
+ * @param comp the compressor
+ * @param fn work on one item
+ * @param arg passed to fn
+ * @param nitems number of items
+ * @return 0, or -1 if fn failed on any item
+ */
+int compressor_run(struct compressor *comp, pool_fn fn, void *arg, uint32_t nitems);
+
+/**
+ * @brief compresses a chunk, only if it pays
+ * @param comp the compressor
+ * @param worker index of the calling worker
+ * @param src the chunk
+ * @param length its length
+ * @param dst where the compressed chunk goes
+ * @param capacity room in dst, the chunk is only worth compressing below it
+ * @return compressed length, or 0 if the chunk has to go as it is
+ */
+uint32_t compress_chunk(struct compressor *comp, int worker, const char *src, uint32_t length,
+    char *dst, uint32_t capacity);
+
+/**
+ * @brief decompresses a chunk
+ * @param comp the compressor
+ * @param worker index of the calling worker
+ * @param src the compressed chunk
+ * @param length its length
+ * @param dst where the chunk goes
+ * @param raw_length length the chunk must have
+ * @return 0, or -1 if src is not a chunk of raw_length bytes
+ */
+int decompress_chunk(struct compressor *comp, int worker, const char *src, uint32_t length,
+    char *dst, uint32_t raw_length);
+
+/**
+ * @brief stops the worker threads and frees what compressor_init allocated
+ * @param comp the compressor
+ */
+void compressor_destroy(struct compressor *comp);
+
+#endif //__RDMA_COMPRESS__
@@ -6,111 +6,492 @@
 #include <errno.h>
 #include <sys/queue.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <byteswap.h>
 #include <rdma/rdma_cma.h>
 #include "utils.h"
+#include "transfer.h"
+#include "compress.h"
 
 enum { 
     RESOLVE_TIMEOUT_MS = 500, 
-    BUFSIZE = DEFAULT_BUF_SIZE,
 }; 
 
-struct pdata { 
-    uint64_t	buf_va; 
-    uint32_t	buf_rkey;
+// A slot of the staging region is free again once both bits are cleared
+enum {
+    SLOT_SENDING = 1,       // RDMA write not completed locally yet
+    SLOT_WAITING_ACK = 2,   // server did not give the slot back yet
 };
 
-int prepare_send_notify_after_rdma_write(struct rdma_cm_id *cm_id, struct ibv_pd *pd)
+// Registered piece of the mmap'd source file, see -m
+struct map_window {
+    struct ibv_mr           *mr;
+    uint32_t                pending;    // chunks posted from it and not completed yet
+};
+
+// One connection of the transfer, see -s
+struct stripe {
+    struct rdma_cm_id       *cm_id;
+    char                    *buf;       // its slots in the staging buffer
+    struct chunk_hdr        *hdrs;      // headers of its slots, see PDATA_FRAMED
+    uint8_t                 *slot_state;
+    uint64_t                *slot_seq;
+    uint64_t                posted;     // chunks posted on it, the next one takes slot posted % depth
+    uint64_t                completed;  // writes completed locally, in the order they were posted
+    uint64_t                acked;      // chunks acknowledged, in the order they were posted
+    struct ibv_send_wr      wr[2 * MAX_DEPTH];  // requests queued for the next doorbell, two per chunk in a file sink
+    struct sg_frame         frames[2 * MAX_DEPTH];
+    uint32_t                queued;
+    uint64_t                remote_va;
+    uint32_t                remote_rkey;
+};
+
+// A chunk that has its slot and waits to be read, compressed and posted
+struct chunk_job {
+    struct stripe           *stripe;
+    uint64_t                seq;
+    uint64_t                position;   // index of the chunk on its stripe
+    char                    *data;      // what goes on the wire
+    struct ibv_mr           *mr;
+    uint32_t                length;
+    int                     compressed;
+};
+
+struct client_ctx {
+    struct stripe           *stripes;
+    uint32_t                nstripes;
+    struct ibv_pd           *pd;
+    struct ibv_comp_channel *comp_chan;
+    struct ibv_cq           *cq;
+    struct ibv_mr           *mr;
+    char                    *buf;
+    struct ibv_mr           *hdr_mr;
+    struct chunk_hdr        *hdrs;
+    char                    *map;       // whole file when sending with -m, NULL otherwise
+    struct map_window       *windows;
+    uint64_t                window_size;
+    uint64_t                next;       // first chunk not posted yet
+    uint64_t                *resend;    // chunks the server found corrupted, sent again first
+    uint32_t                nresend;
+    uint64_t                resent;
+    struct chunk_job        *jobs;      // chunks claimed since the last doorbell
+    uint32_t                njobs;
+    struct compressor       comp;
+    uint64_t                wire_bytes; // payload bytes posted, compressed or not
+    int                     fd;
+    uint8_t                 *saved;     // chunks the server kept from an earlier attempt, see -r
+    uint64_t                nsaved;
+    uint64_t                saved_va;
+    uint32_t                saved_rkey;
+    uint32_t                remote_flags;
+    uint32_t                chunk_size;
+    uint32_t                slot_size;  // chunk_size plus the header if the server wants one
+    uint32_t                depth;
+    uint32_t                signal_every;
+    int                     max_send_sge;
+};
+
+int post_ack_recv(struct stripe *stripe)
 {
-    struct ibv_sge sge; 
-    struct ibv_send_wr send_wr = { }; 
-    struct ibv_send_wr *bad_send_wr; 
+    // The server acknowledges with a zero byte SEND_WITH_IMM, no buffer needed
+    struct ibv_recv_wr recv_wr = { };
+    struct ibv_recv_wr *bad_recv_wr;
 
-    uint8_t *buf = calloc(1, sizeof(uint8_t));
-    struct ibv_mr *mr = ibv_reg_mr(pd, buf, sizeof(uint8_t), IBV_ACCESS_LOCAL_WRITE); 
-    if (!mr) 
+    if (ibv_post_recv(stripe->cm_id->qp, &recv_wr, &bad_recv_wr))
         return 1;
-    
-    sge.addr = (uintptr_t)buf; 
-    sge.length = sizeof(uint8_t); 
-    sge.lkey = mr->lkey;
-    
-    memset(&send_wr, 0, sizeof(send_wr));
-    send_wr.wr_id = 2;
-    send_wr.opcode = IBV_WR_SEND;
-    send_wr.sg_list = &sge;
-    send_wr.num_sge = 1;
-
-    if (ibv_post_send(cm_id->qp, &send_wr, &bad_send_wr)) 
+
+    return 0;
+}
+
+struct stripe *find_stripe(struct client_ctx *ctx, uint32_t qp_num)
+{
+    for (uint32_t i = 0; i < ctx->nstripes; i++)
+    {
+        if (ctx->stripes[i].cm_id->qp->qp_num == qp_num)
+            return &ctx->stripes[i];
+    }
+
+    return NULL;
+}
+
+struct ibv_mr *map_window_get(struct client_ctx *ctx, uint64_t file_size, uint64_t offset)
+{
+    struct map_window *window = &ctx->windows[offset / ctx->window_size];
+
+    // Windows are registered on first use, pinning only what is being sent
+    if (!window->mr)
+    {
+        uint64_t start = offset - offset % ctx->window_size;
+        uint64_t length = file_size - start < ctx->window_size ? file_size - start : ctx->window_size;
+
+        madvise(ctx->map + start, length, MADV_WILLNEED);
+        window->mr = ibv_reg_mr(ctx->pd, ctx->map + start, length, 0);
+        if (!window->mr)
+        {
+            perror("Error registering file window");
+            return NULL;
+        }
+    }
+    window->pending++;
+
+    return window->mr;
+}
+
+void map_window_put(struct client_ctx *ctx, uint64_t file_size, uint64_t seq)
+{
+    uint64_t offset = seq * ctx->chunk_size;
+    uint64_t index = offset / ctx->window_size;
+    uint64_t end = (index + 1) * ctx->window_size < file_size ? (index + 1) * ctx->window_size : file_size;
+    struct map_window *window = &ctx->windows[index];
+
+    // Unpin once every chunk of the window has been posted and completed
+    window->pending--;
+    if (window->pending == 0 && ctx->next * ctx->chunk_size >= end)
+    {
+        ibv_dereg_mr(window->mr);
+        window->mr = NULL;
+    }
+}
+
+int claim_chunk(struct client_ctx *ctx, struct stripe *stripe, uint64_t file_size, uint64_t seq)
+{
+    struct chunk_job *job = &ctx->jobs[ctx->njobs++];
+    uint32_t slot = stripe->posted % ctx->depth;
+
+    job->stripe = stripe;
+    job->seq = seq;
+    job->position = stripe->posted;
+    job->length = chunk_length(file_size, ctx->chunk_size, seq);
+    job->compressed = 0;
+    job->mr = ctx->mr;
+    if (ctx->map)
+    {
+        // The NIC reads the chunk straight from the page cache
+        job->data = ctx->map + seq * ctx->chunk_size;
+        if (job->length && !(job->mr = map_window_get(ctx, file_size, seq * ctx->chunk_size)))
+            return 1;
+    }
+    else
+        job->data = stripe->buf + (uint64_t)slot * ctx->chunk_size;
+
+    stripe->slot_state[slot] = SLOT_SENDING | SLOT_WAITING_ACK;
+    stripe->slot_seq[slot] = seq;
+    stripe->posted++;
+
+    return 0;
+}
+
+int load_chunk(void *arg, uint32_t item, int worker)
+{
+    struct client_ctx *ctx = arg;
+    struct chunk_job *job = &ctx->jobs[item];
+    struct chunk_hdr *hdr = &job->stripe->hdrs[job->position % ctx->depth];
+    uint32_t length = job->length;
+    char *raw = ctx->comp.codec != CODEC_NONE ? ctx->comp.scratch[worker] : job->data;
+
+    // Read by offset, a chunk may have to be sent again
+    if (!ctx->map && pread(ctx->fd, raw, length, job->seq * ctx->chunk_size) != (ssize_t)length)
+    {
+        perror("Error reading file");
         return 1;
+    }
+
+    // Compressed into the slot if that saves enough, copied there otherwise
+    if (ctx->comp.codec != CODEC_NONE)
+    {
+        job->length = compress_chunk(&ctx->comp, worker, raw, length, job->data,
+            length - length / COMPRESS_MIN_GAIN);
+        job->compressed = job->length > 0;
+        if (!job->compressed)
+        {
+            memcpy(job->data, raw, length);
+            job->length = length;
+        }
+    }
+
+    // Checksummed while the NIC is still busy with the chunks before it
+    hdr->offset = bswap_64(job->seq * ctx->chunk_size);
+    hdr->length = htonl(job->length | (job->compressed ? CHUNK_COMPRESSED : 0));
+    hdr->crc = htonl(crc32c(0, job->data, job->length));
 
     return 0;
 }
 
-int main(int argc, char *argv[]) 
+int queue_chunk(struct client_ctx *ctx, struct chunk_job *job)
 {
-    struct pdata server_pdata;
-    struct rdma_event_channel *cm_channel; 
-    struct rdma_cm_id *cm_id; 
-    struct rdma_cm_event *event;  
-    struct rdma_conn_param conn_param = { };
-    struct ibv_pd *pd; 
-    struct ibv_comp_channel *comp_chan; 
-    struct ibv_cq *cq; 
-    struct ibv_cq *evt_cq; 
-    struct ibv_mr *mr; 
-    struct ibv_qp_init_attr qp_attr = { }; 
-    struct ibv_sge sge; 
-    struct ibv_send_wr send_wr = { }; 
-    struct ibv_send_wr *bad_send_wr; 
-    struct ibv_recv_wr recv_wr = { }; 
-    struct ibv_recv_wr *bad_recv_wr; 
-    struct ibv_wc wc; 
-    void *cq_context; 
-    struct addrinfo *res, *t; 
-    struct addrinfo hints = { 
-        .ai_family    = AF_INET,
-        .ai_socktype  = SOCK_STREAM
+    struct stripe *stripe = job->stripe;
+    struct sg_frame *frame = &stripe->frames[stripe->queued];
+    struct ibv_send_wr *send_wr = &stripe->wr[stripe->queued];
+    struct ibv_send_wr *hdr_wr = NULL;
+    uint32_t slot = job->position % ctx->depth;
+    struct chunk_hdr *hdr = &stripe->hdrs[slot];
+    uint64_t seq = job->seq;
+
+    // The header goes from its own buffer and the payload from wherever it is,
+    // the NIC gathers both into the slot
+    if (ctx->remote_flags & PDATA_FRAMED)
+        frame_init(frame, hdr, sizeof(*hdr), ctx->hdr_mr, ctx->max_send_sge);
+    else
+        frame_init(frame, NULL, 0, NULL, ctx->max_send_sge);
+    if (frame_add(frame, job->data, job->length, job->mr))
+    {
+        printf("Chunk %lu does not fit in %d scatter/gather elements\n", seq, ctx->max_send_sge);
+        return 1;
+    }
+
+    // The immediate consumes a receive on the server and tells it which chunk landed.
+    // The wr_id keeps the low bits of the position of the write on its stripe
+    memset(send_wr, 0, sizeof(*send_wr));
+    send_wr->wr_id = (uint64_t)(stripe - ctx->stripes) << 32 | (uint32_t)job->position;
+    send_wr->opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    send_wr->imm_data = htonl(seq);
+    frame_attach(frame, send_wr);
+    send_wr->wr.rdma.rkey = stripe->remote_rkey;
+    send_wr->wr.rdma.remote_addr = stripe->remote_va + (uint64_t)slot * ctx->slot_size;
+    if (ctx->remote_flags & PDATA_FILE_SINK)
+    {
+        // The file only takes the payload, the header follows in a SEND that
+        // carries the immediate and lands after the data
+        send_wr->wr.rdma.remote_addr = stripe->remote_va + seq * ctx->chunk_size;
+        send_wr->opcode = IBV_WR_RDMA_WRITE;
+        hdr_wr = &stripe->wr[stripe->queued + 1];
+        memset(hdr_wr, 0, sizeof(*hdr_wr));
+        hdr_wr->wr_id = send_wr->wr_id;
+        hdr_wr->opcode = IBV_WR_SEND_WITH_IMM;
+        hdr_wr->imm_data = htonl(seq);
+        frame_init(&stripe->frames[stripe->queued + 1], hdr, sizeof(*hdr), ctx->hdr_mr, ctx->max_send_sge);
+        frame_attach(&stripe->frames[stripe->queued + 1], hdr_wr);
+        send_wr->next = hdr_wr;
+    }
+    // Only the last request of a chunk is ever signaled
+    if ((job->position + 1) % ctx->signal_every == 0)
+        (hdr_wr ? hdr_wr : send_wr)->send_flags = IBV_SEND_SIGNALED;
+    if (stripe->queued > 0)
+        stripe->wr[stripe->queued - 1].next = send_wr;
+
+    stripe->queued += hdr_wr ? 2 : 1;
+    ctx->wire_bytes += job->length;
+
+    return 0;
+}
+
+int post_queued(struct stripe *stripe)
+{
+    struct ibv_send_wr *bad_send_wr;
+
+    if (stripe->queued == 0)
+        return 0;
+
+    // One doorbell for everything queued, the last write is always signaled
+    // so the ones before it are known complete without waiting for more
+    stripe->wr[stripe->queued - 1].send_flags = IBV_SEND_SIGNALED;
+    stripe->queued = 0;
+    if (ibv_post_send(stripe->cm_id->qp, stripe->wr, &bad_send_wr))
+        return 1;
+
+    return 0;
+}
+
+void complete_writes(struct client_ctx *ctx, struct stripe *stripe, uint64_t file_size, uint32_t wr_index)
+{
+    // A QP completes its writes in order, a signaled one completes the unsignaled ones before it
+    uint64_t last = stripe->completed + (uint32_t)(wr_index - (uint32_t)stripe->completed);
+
+    for (; stripe->completed <= last; stripe->completed++)
+    {
+        uint32_t slot = stripe->completed % ctx->depth;
+
+        stripe->slot_state[slot] &= ~SLOT_SENDING;
+        if (ctx->map && chunk_length(file_size, ctx->chunk_size, stripe->slot_seq[slot]))
+            map_window_put(ctx, file_size, stripe->slot_seq[slot]);
+    }
+}
+
+void skip_saved(struct client_ctx *ctx, uint64_t total)
+{
+    while (ctx->saved && ctx->next < total && (ctx->saved[ctx->next / 8] >> ctx->next % 8) & 1)
+        ctx->next++;
+}
+
+int fetch_saved(struct client_ctx *ctx, uint64_t file_size)
+{
+    struct ibv_wc wc;
+    struct ibv_send_wr *bad_send_wr;
+    uint64_t total = chunk_count(file_size, ctx->chunk_size);
+    size_t nbytes = (total + 7) / 8;
+    struct ibv_mr *mr;
+
+    ctx->saved = calloc(1, nbytes);
+    if (!ctx->saved)
+        return 1;
+    mr = ibv_reg_mr(ctx->pd, ctx->saved, nbytes, IBV_ACCESS_LOCAL_WRITE);
+    if (!mr)
+        return 1;
+
+    // One round trip for the bitmap, before any chunk is sent
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)ctx->saved,
+        .length = nbytes,
+        .lkey = mr->lkey,
     };
-    int n; 
-    uint32_t *buf; 
-    int err;
+    struct ibv_send_wr send_wr = {
+        .sg_list = &sge,
+        .num_sge = 1,
+        .opcode = IBV_WR_RDMA_READ,
+        .send_flags = IBV_SEND_SIGNALED,
+        .wr.rdma.remote_addr = ctx->saved_va,
+        .wr.rdma.rkey = ctx->saved_rkey,
+    };
+    if (ibv_post_send(ctx->stripes[0].cm_id->qp, &send_wr, &bad_send_wr))
+        return 1;
+    if (poll_completions(ctx->comp_chan, ctx->cq, &wc, 1) < 0)
+        return 1;
+    if (wc.status != IBV_WC_SUCCESS || wc.opcode != IBV_WC_RDMA_READ)
+    {
+        printf("Reading the bitmap of the server failed: %s\n", ibv_wc_status_str(wc.status));
+        return 1;
+    }
+    ibv_dereg_mr(mr);
+
+    // Counted here, the server only says whether there is anything to read
+    ctx->nsaved = 0;
+    for (uint64_t seq = 0; seq < total; seq++)
+        ctx->nsaved += (ctx->saved[seq / 8] >> seq % 8) & 1;
 
-    if (argc != 3)
+    return 0;
+}
+
+int send_file(struct client_ctx *ctx, uint64_t file_size)
+{
+    struct ibv_wc wc[2 * MAX_DEPTH];
+    uint64_t total = chunk_count(file_size, ctx->chunk_size);
+    uint64_t done = ctx->nsaved;
+    struct stripe *stripe;
+    int posted;
+
+    skip_saved(ctx, total);
+    while (done < total)
     {
-        printf("Usage: %s [server_address] [file]\n", argv[0]);
-        exit(1);
-    } 
+        // Keep every free slot busy before waiting, the stripes take the next chunks in turn
+        ctx->njobs = 0;
+        do
+        {
+            posted = 0;
+            for (uint32_t s = 0; s < ctx->nstripes && (ctx->nresend || ctx->next < total); s++)
+            {
+                stripe = &ctx->stripes[s];
+                if (stripe->slot_state[stripe->posted % ctx->depth] != 0)
+                    continue;
+                // Corrupted chunks go out again before any new one
+                uint64_t seq = ctx->nresend ? ctx->resend[--ctx->nresend] : ctx->next++;
+                skip_saved(ctx, total);
+                if (claim_chunk(ctx, stripe, file_size, seq))
+                {
+                    printf("Posting chunk %lu failed\n", seq);
+                    return 1;
+                }
+                posted = 1;
+            }
+        } while (posted);
 
-    // Create event channel
-    cm_channel = rdma_create_event_channel(); 
-    if (!cm_channel)
-    {  
-        puts("Failed to create completion channel.");
-        return 1; 
+        // The new chunks are read, compressed and checksummed on every worker, then queued in order
+        if (compressor_run(&ctx->comp, load_chunk, ctx, ctx->njobs))
+        {
+            printf("Loading chunks failed\n");
+            return 1;
+        }
+        for (uint32_t j = 0; j < ctx->njobs; j++)
+        {
+            if (queue_chunk(ctx, &ctx->jobs[j]))
+            {
+                printf("Posting chunk %lu failed\n", ctx->jobs[j].seq);
+                return 1;
+            }
+        }
+
+        for (uint32_t s = 0; s < ctx->nstripes; s++)
+        {
+            if (post_queued(&ctx->stripes[s]))
+            {
+                printf("Posting chunks on stripe %u failed\n", s);
+                return 1;
+            }
+        }
+
+        int n = poll_completions(ctx->comp_chan, ctx->cq, wc, 2 * ctx->depth);
+        if (n < 0)
+            return 1;
+
+        for (int i = 0; i < n; i++)
+        {
+            uint32_t slot, ack;
+
+            if (wc[i].status != IBV_WC_SUCCESS)
+            {
+                printf("wc received is not success: %s\n", ibv_wc_status_str(wc[i].status));
+                return 1;
+            }
+
+            switch (wc[i].opcode)
+            {
+                case IBV_WC_RECV:
+                    // Acknowledgements of a stripe come back in the order its chunks were posted
+                    stripe = find_stripe(ctx, wc[i].qp_num);
+                    slot = stripe->acked % ctx->depth;
+                    ack = ntohl(wc[i].imm_data);
+                    if (stripe->slot_seq[slot] != (ack & ~ACK_CORRUPT))
+                    {
+                        printf("Chunk %u acknowledged out of order\n", ack & ~ACK_CORRUPT);
+                        return 1;
+                    }
+                    stripe->slot_state[slot] &= ~SLOT_WAITING_ACK;
+                    stripe->acked++;
+                    if (ack & ACK_CORRUPT)
+                    {
+                        // The slot is free again, only this chunk has to go again
+                        printf("Chunk at offset %lu arrived corrupted, sending it again\n",
+                            stripe->slot_seq[slot] * ctx->chunk_size);
+                        ctx->resend[ctx->nresend++] = stripe->slot_seq[slot];
+                        ctx->resent++;
+                    }
+                    else
+                        done++;
+                    if (post_ack_recv(stripe))
+                        return 1;
+                    break;
+
+                case IBV_WC_RDMA_WRITE:
+                case IBV_WC_SEND:
+                    complete_writes(ctx, &ctx->stripes[wc[i].wr_id >> 32], file_size, (uint32_t)wc[i].wr_id);
+                    break;
+
+                default:
+                    break;
+            }
+        }
     }
 
+    return 0;
+}
+
+int resolve_stripe(struct rdma_event_channel *cm_channel, struct addrinfo *res, struct rdma_cm_id **cm_id)
+{
+    struct rdma_cm_event *event;
+    int err;
+
     // Create rdma_cm_id
-    err = rdma_create_id(cm_channel, &cm_id, NULL, RDMA_PS_TCP);
+    err = rdma_create_id(cm_channel, cm_id, NULL, RDMA_PS_TCP);
     if (err)
     {
         puts("Failed to acquire rdmacm id. Quitting.");
         return err;
     }
 
-    // Resolve address
-    n = getaddrinfo(argv[1], "9191", &hints, &res);
-    if (n < 0)
-    {
-        printf("TCP port specified is being used. quitting.\n");
-        return 1;
-    }
-
-
-    err = rdma_resolve_addr(cm_id, NULL, res->ai_addr, RESOLVE_TIMEOUT_MS);
+    err = rdma_resolve_addr(*cm_id, NULL, res->ai_addr, RESOLVE_TIMEOUT_MS);
     if (err)
     {
         puts("Could not resolve address.");
@@ -132,10 +513,10 @@ int main(int argc, char *argv[])
     }
     rdma_ack_cm_event(event);
 
-    err = rdma_resolve_route(cm_id, RESOLVE_TIMEOUT_MS);
+    err = rdma_resolve_route(*cm_id, RESOLVE_TIMEOUT_MS);
     if (err)
         return err;
-    
+
     err = rdma_get_cm_event(cm_channel, &event);
     if (err)
         return err;
@@ -143,51 +524,57 @@ int main(int argc, char *argv[])
         return 1; 
     rdma_ack_cm_event(event);
 
-    // Allocate protection domain and create completion queue
-    pd = ibv_alloc_pd(cm_id->verbs); 
-    if (!pd) 
-        return 1;
-
-    comp_chan = ibv_create_comp_channel(cm_id->verbs);
-    if (!comp_chan) 
-        return 1;
-
-    cq = ibv_create_cq(cm_id->verbs, 2, NULL, comp_chan, 0); 
-    if (!cq) 
-        return 1;
-
-    if (ibv_req_notify_cq(cq, 0))
-        return 1;
+    return 0;
+}
 
-    // Allocate memory for BUFSIZE elements
-    buf = calloc(BUFSIZE, sizeof(uint32_t)); 
-    
-    if (!buf) 
-        return 1;
+int connect_stripe(struct client_ctx *ctx, struct rdma_event_channel *cm_channel,
+    struct stripe *stripe, struct cdata *client_cdata, uint32_t chunk_size, uint32_t depth)
+{
+    struct pdata server_pdata;
+    struct rdma_cm_event *event;  
+    struct rdma_conn_param conn_param = { };
+    struct ibv_qp_init_attr qp_attr = { }; 
+    struct ibv_device_attr dev_attr;
+    uint32_t server_chunk_size, server_depth, server_flags;
+    int err;
 
-    // Register memory region for BUFSIZE elements
-    mr = ibv_reg_mr(pd, buf, BUFSIZE * sizeof(uint32_t), IBV_ACCESS_LOCAL_WRITE); 
-    if (!mr) 
+    // A framed chunk needs one element for its header and one for its payload
+    if (ibv_query_device(stripe->cm_id->verbs, &dev_attr))
+    {
+        puts("Failed to query the device.");
         return 1;
+    }
 
-    // Initialize Queue Pair attributes
-    qp_attr.cap.max_send_wr = 4; 
-    qp_attr.cap.max_send_sge = 1;
-    qp_attr.cap.max_recv_wr = 1; 
+    // Initialize Queue Pair attributes, every stripe shares the completion queue.
+    // A chunk takes two requests when it goes to a file sink
+    qp_attr.cap.max_send_wr = 2 * depth;
+    qp_attr.cap.max_send_sge = dev_attr.max_sge < MAX_FRAME_SGE ? dev_attr.max_sge : MAX_FRAME_SGE;
+    qp_attr.cap.max_recv_wr = depth;
     qp_attr.cap.max_recv_sge = 1; 
-    qp_attr.send_cq = cq;
-    qp_attr.recv_cq = cq;
+    qp_attr.send_cq = ctx->cq;
+    qp_attr.recv_cq = ctx->cq;
     qp_attr.qp_type = IBV_QPT_RC;
 
     // Create Queue Pair
-    err = rdma_create_qp(cm_id, pd, &qp_attr);
+    err = rdma_create_qp(stripe->cm_id, ctx->pd, &qp_attr);
     if (err)
         return err;
+    if (stripe == ctx->stripes || (int)qp_attr.cap.max_send_sge < ctx->max_send_sge)
+        ctx->max_send_sge = qp_attr.cap.max_send_sge;
+
+    // Acknowledgements may arrive as soon as the first chunk lands
+    for (uint32_t i = 0; i < depth; i++)
+    {
+        if (post_ack_recv(stripe))
+            return 1;
+    }
 
     // Set connection parameters and establish the connection
     conn_param.initiator_depth = 1;
     conn_param.retry_count = 7;
-    err = rdma_connect(cm_id, &conn_param);
+    conn_param.private_data = client_cdata;
+    conn_param.private_data_len = sizeof(*client_cdata);
+    err = rdma_connect(stripe->cm_id, &conn_param);
     if (err)
         return err;
 
@@ -210,123 +597,349 @@ int main(int argc, char *argv[])
     memcpy(&server_pdata, event->param.conn.private_data, sizeof(server_pdata));
     rdma_ack_cm_event(event);
 
-    int sentinel = 1;
-    long int a;
-    printf("0 0 to quit!\n");
+    stripe->remote_va = bswap_64(server_pdata.buf_va);
+    stripe->remote_rkey = ntohl(server_pdata.buf_rkey);
+    server_chunk_size = ntohl(server_pdata.chunk_size);
+    server_depth = ntohl(server_pdata.depth);
+    server_flags = ntohl(server_pdata.flags);
 
-    printf("Enter the first number: ");
-    scanf("%ld", &a);
-    if (a == -1)
+    // The first stripe learns the layout, the others must get the same
+    if (stripe == ctx->stripes)
     {
-        sentinel = 0;
+        ctx->chunk_size = server_chunk_size;
+        ctx->depth = server_depth;
+        ctx->remote_flags = server_flags;
+        ctx->slot_size = server_chunk_size + (server_flags & PDATA_FRAMED ? sizeof(struct chunk_hdr) : 0);
+        ctx->nsaved = bswap_64(server_pdata.saved);
+        ctx->saved_va = bswap_64(server_pdata.saved_va);
+        ctx->saved_rkey = ntohl(server_pdata.saved_rkey);
     }
-    else
+    if (ctx->chunk_size == 0 || ctx->chunk_size > chunk_size || ctx->depth == 0 || ctx->depth > depth ||
+        server_chunk_size != ctx->chunk_size || server_depth != ctx->depth || server_flags != ctx->remote_flags)
+    {
+        printf("Server answered with an invalid staging region\n");
+        return 1;
+    }
+    if (ntohl(client_cdata->codec) != CODEC_NONE && !(ctx->remote_flags & PDATA_COMPRESSED))
     {
-        // Open the file in binary mode
-        FILE *file = fopen(argv[2], "rb");
-        if (!file) 
+        printf("The server does not take compressed chunks\n");
+        return 1;
+    }
+    if ((ctx->remote_flags & PDATA_FRAMED) && ctx->max_send_sge < 2)
+    {
+        printf("The server wants chunk headers but the QP only gathers %d element\n", ctx->max_send_sge);
+        return 1;
+    }
+    stripe->slot_state = calloc(ctx->depth, sizeof(uint8_t));
+    stripe->slot_seq = calloc(ctx->depth, sizeof(uint64_t));
+    if (!stripe->slot_state || !stripe->slot_seq)
+        return 1;
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) 
+{
+    struct client_ctx ctx = { };
+    struct cdata client_cdata;
+    struct rdma_event_channel *cm_channel; 
+    struct rdma_cm_event *event;  
+    struct ibv_pd *pd; 
+    struct ibv_comp_channel *comp_chan; 
+    struct ibv_cq *cq; 
+    struct ibv_mr *mr; 
+    struct addrinfo *res;
+    struct addrinfo hints = { 
+        .ai_family    = AF_INET,
+        .ai_socktype  = SOCK_STREAM
+    };
+    struct stat st;
+    uint32_t chunk_size = DEFAULT_CHUNK_SIZE;
+    uint32_t depth = DEFAULT_DEPTH;
+    uint32_t stripes = 1;
+    uint32_t signal_every = DEFAULT_SIGNAL_EVERY;
+    uint64_t window_size = DEFAULT_WINDOW_SIZE;
+    uint64_t huge_page = 0;
+    uint64_t buf_mapped = 0;
+    uint32_t codec = CODEC_NONE;
+    int level = 0;
+    int workers = DEFAULT_WORKERS;
+    uint64_t transfer_id = 0;
+    int use_mmap = 0;
+    int n; 
+    int option;
+    char *buf;
+    int err;
+
+    while ((option = getopt(argc, argv, "c:d:mw:H:s:u:z:t:r:")) != -1)
+    {
+        switch (option)
         {
-            perror("Error opening file");
-            return 1;
+            case 'c':
+                chunk_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                depth = strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                use_mmap = 1;
+                break;
+            case 'w':
+                window_size = strtoull(optarg, NULL, 0);
+                break;
+            case 'H':
+                huge_page = parse_huge_page(optarg);
+                if (huge_page == 0)
+                    argc = 0;
+                break;
+            case 's':
+                stripes = strtoul(optarg, NULL, 0);
+                break;
+            case 'u':
+                signal_every = strtoul(optarg, NULL, 0);
+                break;
+            case 'z':
+                if (parse_codec(optarg, &codec, &level))
+                    argc = 0;
+                break;
+            case 't':
+                workers = strtol(optarg, NULL, 0);
+                break;
+            case 'r':
+                transfer_id = strtoull(optarg, NULL, 0);
+                if (transfer_id == 0)
+                    argc = 0;
+                break;
+            default:
+                argc = 0;
+                break;
         }
+    }
 
-        // Seek to the end to get the size of the file
-        fseek(file, 0, SEEK_END);
-        long int file_size = ftell(file);
-        fseek(file, 0, SEEK_SET);  // Reset the file pointer to the start
+    if (argc - optind != 2 || chunk_size == 0 || chunk_size > MAX_CHUNK_SIZE ||
+        depth == 0 || depth > MAX_DEPTH || window_size == 0 || stripes == 0 || stripes > MAX_STRIPES || signal_every == 0 ||
+        workers <= 0 || workers > MAX_WORKERS || (use_mmap && codec != CODEC_NONE))
+    {
+        printf("Usage: %s [-c chunk_bytes] [-d depth] [-s stripes] [-u signal_every] [-m [-w window_bytes]] [-H 2m|1g] [-z lz4|zstd[:level] [-t workers]] [-r transfer_id] [server_address] [file]\n", argv[0]);
+        printf("(chunk up to %d bytes, default %d; depth up to %d, default %d)\n",
+            MAX_CHUNK_SIZE, DEFAULT_CHUNK_SIZE, MAX_DEPTH, DEFAULT_DEPTH);
+        printf("-s stripes the file over up to %d connections, each with depth chunks in flight\n", MAX_STRIPES);
+        printf("-u signals one write out of signal_every (default %d), the writes posted\n"
+            "   together always share one doorbell\n", DEFAULT_SIGNAL_EVERY);
+        printf("-m sends straight from the mmap'd file, registering it in windows of\n"
+            "   window_bytes (default %d)\n", DEFAULT_WINDOW_SIZE);
+        printf("-H puts the staging slots on 2 MB or 1 GB huge pages\n");
+        printf("-z compresses the chunks with lz4 or zstd (level %d by default) on workers\n"
+            "   threads (default %d, up to %d), not with -m\n", DEFAULT_ZSTD_LEVEL, DEFAULT_WORKERS, MAX_WORKERS);
+        printf("-r makes the transfer resumable, running it again with the same non-zero\n"
+            "   transfer_id only sends the chunks the server does not have yet\n");
+        exit(1);
+    }
+
+    // Open the file in binary mode
+    FILE *file = fopen(argv[optind + 1], "rb");
+    if (!file)
+    {
+        perror("Error opening file");
+        return 1;
+    }
+    if (fstat(fileno(file), &st))
+    {
+        perror("Error reading file size");
+        return 1;
+    } 
 
-        buf[0] = htonl(file_size);
-        size_t bytes_read = fread(buf + 1, 1, file_size, file);
-        for (int i = 0; i < 10; i++)
+    // Map the file instead of reading it, empty files have nothing to map
+    if (use_mmap && st.st_size > 0)
+    {
+        ctx.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+        if (ctx.map == MAP_FAILED)
         {
-            printf("%d -> %d\n", i+1, htonl(buf[i]));
+            perror("Error mapping file");
+            return 1;
         }
+        madvise(ctx.map, st.st_size, MADV_SEQUENTIAL);
+    }
 
-        // Prepare the RDMA write operation
-        sge.addr = (uintptr_t)buf; 
-        sge.length = BUFSIZE * sizeof(uint32_t);
-        sge.lkey = mr->lkey;
+    ctx.stripes = calloc(stripes, sizeof(struct stripe));
+    if (!ctx.stripes)
+        return 1;
+    ctx.nstripes = stripes;
+    ctx.signal_every = signal_every;
 
-        send_wr.wr_id = 1;
-        send_wr.opcode = IBV_WR_RDMA_WRITE;
-        send_wr.send_flags = IBV_SEND_SIGNALED;
-        send_wr.sg_list = &sge;
-        send_wr.num_sge = 1;
-        send_wr.wr.rdma.rkey = ntohl(server_pdata.buf_rkey);
-        send_wr.wr.rdma.remote_addr = bswap_64(server_pdata.buf_va);
+    // Create event channel
+    cm_channel = rdma_create_event_channel(); 
+    if (!cm_channel)
+    {  
+        puts("Failed to create completion channel.");
+        return 1; 
+    }
 
-        if (ibv_post_send(cm_id->qp, &send_wr, &bad_send_wr))
-            return 1;
+    // Resolve address
+    n = getaddrinfo(argv[optind], "9191", &hints, &res);
+    if (n < 0)
+    {
+        printf("TCP port specified is being used. quitting.\n");
+        return 1;
+    }
+
+    // Tell the server what is coming
+    client_cdata.file_size = bswap_64(st.st_size);
+    client_cdata.chunk_size = htonl(chunk_size);
+    client_cdata.depth = htonl(depth);
+    client_cdata.stripes = htonl(stripes);
+    client_cdata.codec = htonl(codec);
+    client_cdata.transfer_id = bswap_64(transfer_id);
+
+    for (uint32_t s = 0; s < stripes; s++)
+    {
+        struct stripe *stripe = &ctx.stripes[s];
 
-        // Wait for work completion
-        int end_loop = 0;
-        while (!end_loop)
+        err = resolve_stripe(cm_channel, res, &stripe->cm_id);
+        if (err)
+            return err;
+
+        if (s == 0)
         {
-            if (ibv_get_cq_event(comp_chan, &evt_cq, &cq_context))
-            {
-                puts("Failed to get cq event.");
+            // Allocate protection domain and create completion queue
+            pd = ibv_alloc_pd(stripe->cm_id->verbs); 
+            if (!pd) 
                 return 1;
-            }
 
-            if (ibv_req_notify_cq(cq, 0))
-            {
-                puts("Failed to get the notification.");
+            comp_chan = ibv_create_comp_channel(stripe->cm_id->verbs);
+            if (!comp_chan) 
                 return 1;
-            }
 
-            if (ibv_poll_cq(cq, 1, &wc) != 1)
-            {
-                puts("failed to pull the wc");
+            // One completion per write and one per acknowledgement for every slot of every stripe
+            cq = ibv_create_cq(stripe->cm_id->verbs, 2 * depth * stripes, NULL, comp_chan, 0);
+            if (!cq) 
                 return 1;
-            }
 
-            if (wc.status != IBV_WC_SUCCESS)
-            {
-                puts("wc received is not success.");
+            if (ibv_req_notify_cq(cq, 0))
+                return 1;
+
+            // Allocate the staging slots, the server may only shrink them
+            buf = ctx.map ? NULL : alloc_buffer((uint64_t)stripes * depth * chunk_size, huge_page, &buf_mapped);
+            if (!ctx.map && !buf)
                 return 1;
-            }
 
-            switch (wc.wr_id)
+            mr = NULL;
+            if (buf)
             {
-                case 0:
-                    printf("All good!\n");
-                    end_loop = 1;
-                    break;
+                mr = ibv_reg_mr(pd, buf, (size_t)stripes * depth * chunk_size, IBV_ACCESS_LOCAL_WRITE);
+                if (!mr) 
+                    return 1;
+            }
 
-                case 1:
-                    // Send notification after RDMA write is done
-                    if (prepare_send_notify_after_rdma_write(cm_id, pd))
-                    {
-                        printf("Sending notification failed\n");
-                        return 1;
-                    }
-                    break;
+            // Chunk headers of every slot, sent ahead of the payload without touching it
+            ctx.hdrs = calloc((size_t)stripes * depth, sizeof(struct chunk_hdr));
+            if (!ctx.hdrs)
+                return 1;
+            ctx.hdr_mr = ibv_reg_mr(pd, ctx.hdrs, (size_t)stripes * depth * sizeof(struct chunk_hdr),
+                IBV_ACCESS_LOCAL_WRITE);
+            if (!ctx.hdr_mr)
+                return 1;
 
-                default:
-                    printf("Ending loop\n");
-                    end_loop = 1;
-                    break;
-            }
+            ctx.pd = pd;
+            ctx.comp_chan = comp_chan;
+            ctx.cq = cq;
+            ctx.mr = mr;
+            ctx.buf = buf;
         }
-        ibv_ack_cq_events(cq, 2);
+
+        stripe->buf = buf ? buf + (uint64_t)s * depth * chunk_size : NULL;
+        stripe->hdrs = ctx.hdrs + (uint64_t)s * depth;
+        client_cdata.stripe = htonl(s);
+        err = connect_stripe(&ctx, cm_channel, stripe, &client_cdata, chunk_size, depth);
+        if (err)
+            return err;
     }
 
+    if (ctx.map)
+    {
+        // A chunk never straddles two windows
+        ctx.window_size = (window_size + ctx.chunk_size - 1) / ctx.chunk_size * ctx.chunk_size;
+        ctx.windows = calloc((st.st_size + ctx.window_size - 1) / ctx.window_size, sizeof(struct map_window));
+        if (!ctx.windows)
+            return 1;
+    }
+
+    // At most one resend per slot can be pending
+    ctx.resend = calloc((size_t)stripes * ctx.depth, sizeof(uint64_t));
+    ctx.jobs = calloc((size_t)stripes * ctx.depth, sizeof(struct chunk_job));
+    if (!ctx.resend || !ctx.jobs)
+        return 1;
+    if (compressor_init(&ctx.comp, codec, level, workers, ctx.chunk_size, 0))
+    {
+        printf("Could not start the compression workers\n");
+        return 1;
+    }
+    ctx.fd = fileno(file);
+
+    // Only a server that kept chunks of an earlier attempt has a bitmap worth reading
+    if ((ctx.remote_flags & PDATA_RESUME) && ctx.nsaved > 0)
+    {
+        if (fetch_saved(&ctx, st.st_size))
+            return 1;
+        printf("Resuming transfer %lu, the server already has %lu of %lu chunks\n",
+            transfer_id, ctx.nsaved, chunk_count(st.st_size, ctx.chunk_size));
+    }
+    else
+        ctx.nsaved = 0;
+
+    printf("Sending %ld bytes in chunks of %u bytes, %u in flight on each of %u stripes%s%s%s\n",
+        (long)st.st_size, ctx.chunk_size, ctx.depth, stripes, ctx.map ? ", zero-copy" : "",
+        codec != CODEC_NONE ? ", compressed with " : "", codec != CODEC_NONE ? codec_name(codec) : "");
+
+    double start = now_seconds();
+    if (send_file(&ctx, st.st_size))
+    {
+        printf("Sending the file failed\n");
+        return 1;
+    }
+    double elapsed = now_seconds() - start;
+    // Effective counts the bytes of the file, wire the bytes that actually travelled
+    printf("All good! %.2f MB/s effective, %.2f MB/s on the wire over %u stripes, %lu chunks sent again\n",
+        st.st_size / elapsed / 1e6, ctx.wire_bytes / elapsed / 1e6, stripes, ctx.resent);
+    fclose(file);
+
     // Clean up and disconnect
-    rdma_disconnect(cm_id);
-    err = rdma_get_cm_event(cm_channel, &event);
-    if (err)
-        return err;
+    for (uint32_t s = 0; s < stripes; s++)
+    {
+        rdma_disconnect(ctx.stripes[s].cm_id);
+        err = rdma_get_cm_event(cm_channel, &event);
+        if (err)
+            return err;
+        rdma_ack_cm_event(event);
+    }
 
-    rdma_ack_cm_event(event);
-    rdma_destroy_qp(cm_id);
-    ibv_dereg_mr(mr);
-    free(buf);
-    err = rdma_destroy_id(cm_id);
-    if (err)  
+    for (uint32_t s = 0; s < stripes; s++)
     {
-        perror("rdma_destroy_id");
-        return err;
+        rdma_destroy_qp(ctx.stripes[s].cm_id);
+        free(ctx.stripes[s].slot_state);
+        free(ctx.stripes[s].slot_seq);
+        err = rdma_destroy_id(ctx.stripes[s].cm_id);
+        if (err)  
+        {
+            perror("rdma_destroy_id");
+            return err;
+        }
     }
+    if (mr)
+        ibv_dereg_mr(mr);
+    ibv_dereg_mr(ctx.hdr_mr);
+    free(ctx.hdrs);
+    if (ctx.map)
+        munmap(ctx.map, st.st_size);
+    if (buf)
+        free_buffer(buf, buf_mapped);
+    free(ctx.windows);
+    free(ctx.resend);
+    free(ctx.jobs);
+    free(ctx.saved);
+    compressor_destroy(&ctx.comp);
+    free(ctx.stripes);
+    freeaddrinfo(res);
     rdma_destroy_event_channel(cm_channel);
     return 0;
 }
@@ -1,206 +1,773 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
 #include <byteswap.h>
 #include <rdma/rdma_cma.h> 
 #include "utils.h"
+#include "transfer.h"
+#include "compress.h"
 
 enum { 
     RESOLVE_TIMEOUT_MS = 5000,
-    BUFSIZE = DEFAULT_BUF_SIZE, 
+    TRANSFER_INTERRUPTED = 2,   // receive_file: the client went away, it may come back
 };
 
-struct pdata { 
-    uint64_t buf_va; 
-    uint32_t buf_rkey; 
+// One connection of the transfer, see -s on the client
+struct server_stripe {
+    struct rdma_cm_id       *cm_id;
+    uint64_t                received;   // chunks landed on it, the next one is in slot received % depth
+    uint64_t                landed;     // end of the last chunk that landed on it
+    struct chunk_hdr        *hdrs;      // file sink: headers of its chunks, one receive each
+    struct ibv_send_wr      acks[MAX_DEPTH];    // acknowledgements for the next doorbell
+    uint32_t                queued;
 };
 
-int prepare_recv_notify_before_using_rdma_write(struct rdma_cm_id *cm_id, struct ibv_pd *pd)
+// A chunk of the last poll, checked, decompressed and written on the workers
+struct chunk_job {
+    struct server_stripe    *stripe;
+    struct chunk_hdr        *hdr;
+    char                    *data;
+    uint64_t                offset;
+    uint32_t                seq;
+    uint32_t                length;     // bytes that came
+    uint32_t                raw_length; // bytes the chunk has in the file
+    int                     compressed;
+    int                     corrupt;
+};
+
+// Head of transfer_<id>.bitmap, the bitmap of the chunks in output_file follows
+struct progress_hdr {
+    uint64_t                transfer_id;
+    uint64_t                inode;      // of the output_file the bitmap describes
+    uint64_t                file_size;
+    uint32_t                chunk_size;
+    uint32_t                reserved;
+};
+
+struct server_ctx {
+    struct rdma_event_channel   *cm_channel;
+    struct rdma_cm_event    *request;   // connect request that came during the last transfer
+    struct server_stripe    *stripes;
+    uint32_t                nstripes;
+    uint32_t                accepted;
+    struct ibv_pd           *pd;
+    struct ibv_comp_channel *comp_chan;
+    struct ibv_cq           *cq;
+    struct ibv_mr           *mr;
+    char                    *buf;
+    uint64_t                buf_mapped;
+    struct ibv_mr           *hdr_mr;
+    struct chunk_hdr        *hdrs;
+    uint64_t                corrupted;  // chunks that failed their checksum
+    char                    *map;       // mmap'd output_file when receiving with -m
+    uint64_t                file_size;
+    uint64_t                synced;     // output_file is durable up to here
+    uint32_t                chunk_size;
+    uint32_t                slot_size;  // chunk_size plus the header in front of it
+    uint32_t                depth;
+    int                     fd;
+    struct chunk_job        jobs[2 * MAX_DEPTH];
+    struct compressor       comp;
+    uint64_t                transfer_id;    // 0 unless the client may resume the transfer
+    uint8_t                 *progress;      // chunks persisted, one bit each
+    struct ibv_mr           *progress_mr;
+    uint64_t                saved;          // chunks there from an earlier attempt
+    uint64_t                unsaved;        // bytes persisted since the last checkpoint
+    int                     progress_fd;
+};
+
+int post_chunk_recv(struct server_ctx *ctx, struct server_stripe *stripe, uint32_t index)
 {   
-    uint8_t *buf = calloc(1, sizeof(uint8_t));
-	struct ibv_mr *mr = ibv_reg_mr(pd, buf, sizeof(uint8_t), IBV_ACCESS_LOCAL_WRITE); 
-	if (!mr) 
-		return 1;
-
-    struct ibv_sge notify_sge = {
-        .addr = (uintptr_t)buf,
-        .length = sizeof(uint32_t),
-        .lkey = mr->lkey,
+    // Consumed by the client's RDMA_WRITE_WITH_IMM, the data goes to the region.
+    // In a file sink it takes the SEND with the header of the chunk instead
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)(stripe->hdrs + index),
+        .length = sizeof(struct chunk_hdr),
+        .lkey = ctx->hdr_mr ? ctx->hdr_mr->lkey : 0,
     };
-
-    struct ibv_recv_wr notify_wr = {
-        .wr_id = 0,
-        .sg_list = &notify_sge,
-        .num_sge = 1,
+    struct ibv_recv_wr recv_wr = {
+        .wr_id = index,
+        .sg_list = ctx->map ? &sge : NULL,
+        .num_sge = ctx->map ? 1 : 0,
         .next = NULL,
     };
 
     struct ibv_recv_wr *bad_recv_wr;
-    if (ibv_post_recv(cm_id->qp,&notify_wr,&bad_recv_wr))
-		return 1;
+    if (ibv_post_recv(stripe->cm_id->qp, &recv_wr, &bad_recv_wr))
+        return 1;
 
     return 0;
 }
 
-int check_notify_before_using_rdma_write(struct ibv_comp_channel *comp_chan, struct ibv_cq *cq)
+void queue_chunk_ack(struct server_stripe *stripe, uint32_t seq)
 {
-    struct ibv_wc           wc;
-    struct ibv_cq           *evt_cq;
-    void                    *cq_context;
-	
-    if (ibv_get_cq_event(comp_chan,&evt_cq,&cq_context))
+    // Zero byte SEND, the immediate tells the client which slot is free again
+    struct ibv_send_wr *send_wr = &stripe->acks[stripe->queued];
+
+    memset(send_wr, 0, sizeof(*send_wr));
+    send_wr->opcode = IBV_WR_SEND_WITH_IMM;
+    send_wr->imm_data = htonl(seq);
+    if (stripe->queued > 0)
+        stripe->acks[stripe->queued - 1].next = send_wr;
+    stripe->queued++;
+}
+
+int post_chunk_acks(struct server_stripe *stripe)
+{
+    struct ibv_send_wr *bad_send_wr;
+
+    if (stripe->queued == 0)
+        return 0;
+
+    // One doorbell for the acknowledgements of a poll, nobody waits for their
+    // completions, only the last one is signaled to free the send queue
+    stripe->acks[stripe->queued - 1].send_flags = IBV_SEND_SIGNALED;
+    stripe->queued = 0;
+    if (ibv_post_send(stripe->cm_id->qp, stripe->acks, &bad_send_wr))
+        return 1;
+
+    return 0;
+}
+
+struct server_stripe *find_stripe(struct server_ctx *ctx, uint32_t qp_num)
+{
+    for (uint32_t i = 0; i < ctx->nstripes; i++)
     {
-        printf("failed to get cq event\n");
-		return 1;
+        if (ctx->stripes[i].cm_id->qp->qp_num == qp_num)
+            return &ctx->stripes[i];
     }
-	if (ibv_req_notify_cq(cq,0))
+
+    return NULL;
+}
+
+int sync_mapped(struct server_ctx *ctx)
+{
+    // Each stripe lands its chunks in increasing order, so everything below
+    // the last chunk of the slowest one is in the file already
+    uint64_t landed = ctx->file_size;
+    for (uint32_t i = 0; i < ctx->nstripes; i++)
     {
-        printf("failed to get notification\n");
-		return 1;
+        if (ctx->stripes[i].landed < landed)
+            landed = ctx->stripes[i].landed;
     }
-	if (ibv_poll_cq(cq,1,&wc) != 1)
+
+    if (landed <= ctx->synced || (landed - ctx->synced < SYNC_BYTES && landed < ctx->file_size))
+        return 0;
+
+    uint64_t start = ctx->synced - ctx->synced % sysconf(_SC_PAGESIZE);
+    if (msync(ctx->map + start, landed - start, MS_SYNC))
     {
-        printf("failed to pool completion request\n");
-		return 1;
+        perror("Error syncing file");
+        return 1;
     }
-	if (wc.status != IBV_WC_SUCCESS)
+    ctx->synced = landed;
+
+    return 0;
+}
+
+int load_progress(struct server_ctx *ctx)
+{
+    struct progress_hdr hdr;
+    struct stat st;
+    uint64_t total = chunk_count(ctx->file_size, ctx->chunk_size);
+    size_t nbytes = (total + 7) / 8;
+    char path[64];
+
+    snprintf(path, sizeof(path), "transfer_%lu.bitmap", ctx->transfer_id);
+    ctx->progress = calloc(1, nbytes);
+    if (!ctx->progress)
+        return 1;
+    ctx->progress_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (ctx->progress_fd < 0)
+    {
+        perror("Error opening the transfer bitmap");
+        return 1;
+    }
+
+    // A bitmap of another file, or of chunks of another size, is worth nothing,
+    // and so is one of an output_file that was replaced since
+    if (pread(ctx->progress_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.transfer_id != ctx->transfer_id ||
+        hdr.file_size != ctx->file_size || hdr.chunk_size != ctx->chunk_size ||
+        pread(ctx->progress_fd, ctx->progress, nbytes, sizeof(hdr)) != (ssize_t)nbytes ||
+        stat("output_file", &st) || hdr.inode != st.st_ino)
     {
-        printf("wc is not success\n");
-		return 1;
+        memset(ctx->progress, 0, nbytes);
+        return 0;
     }
 
+    for (uint64_t seq = 0; seq < total; seq++)
+        ctx->saved += (ctx->progress[seq / 8] >> seq % 8) & 1;
+
     return 0;
 }
 
-int main(int argc, char *argv[]) 
-{ 
-    struct pdata                rep_pdata;
+// Only one transfer at a time owns output_file, the bitmaps of the others
+// describe data that is being overwritten
+int remove_stale_progress(struct server_ctx *ctx)
+{
+    DIR             *dir = opendir(".");
+    struct dirent   *entry;
+    uint64_t        transfer_id;
+    int             end;
 
-    struct rdma_event_channel   *cm_channel;
-    struct rdma_cm_id           *listen_id; 
-    struct rdma_cm_id           *cm_id; 
-    struct rdma_cm_event        *event; 
-    struct rdma_conn_param      conn_param = { };
+    if (!dir)
+    {
+        perror("Error listing the transfer bitmaps");
+        return 1;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        end = 0;
+        if (sscanf(entry->d_name, "transfer_%lu.bitmap%n", &transfer_id, &end) != 1 ||
+            end == 0 || entry->d_name[end] != '\0')
+            continue;
+        if (ctx->progress && transfer_id == ctx->transfer_id)
+            continue;
+        if (unlink(entry->d_name))
+            perror("Error removing a stale transfer bitmap");
+    }
+    closedir(dir);
 
-    struct ibv_pd               *pd; 
-    struct ibv_comp_channel     *comp_chan; 
-    struct ibv_cq               *cq;
-    struct ibv_cq               *evt_cq;
-    struct ibv_mr               *mr; 
-    struct ibv_qp_init_attr     qp_attr = { };
-    struct ibv_sge              sge; 
-    struct ibv_send_wr          send_wr = { };
-    struct ibv_send_wr          *bad_send_wr; 
-    struct ibv_wc               wc;
-    void                        *cq_context;
-    struct sockaddr_in          sin;
-    uint32_t                    *buf;
-    int                         err;
+    return 0;
+}
 
-    /* We use rdmacm lib to establish rdma connection and ibv lib to write, read, send, receive data here. */
+int save_progress(struct server_ctx *ctx)
+{
+    struct progress_hdr hdr = {
+        .transfer_id = ctx->transfer_id,
+        .file_size = ctx->file_size,
+        .chunk_size = ctx->chunk_size,
+    };
+    size_t nbytes = (chunk_count(ctx->file_size, ctx->chunk_size) + 7) / 8;
+    struct stat st;
 
-    cm_channel = rdma_create_event_channel();
-    if (!cm_channel) 
+    // The chunks reach the disk before the bits that say they are there
+    if (ctx->map ? msync(ctx->map, ctx->file_size, MS_SYNC) : fdatasync(ctx->fd))
     {
-        puts("Could not create event channel. You may not have the necessary RDMA set.");
+        perror("Error syncing file");
+        return 1;
+    }
+    if (fstat(ctx->fd, &st))
+    {
+        perror("Error looking at output_file");
+        return 1;
+    }
+    hdr.inode = st.st_ino;
+    if (pwrite(ctx->progress_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        pwrite(ctx->progress_fd, ctx->progress, nbytes, sizeof(hdr)) != (ssize_t)nbytes ||
+        fdatasync(ctx->progress_fd))
+    {
+        perror("Error saving the transfer bitmap");
         return 1;
     }
+    ctx->unsaved = 0;
 
-    err = rdma_create_id(cm_channel,&listen_id,NULL,RDMA_PS_TCP); 
-    if (err) 
+    return 0;
+}
+
+int check_chunk(struct server_ctx *ctx, struct server_stripe *stripe, uint32_t seq, uint32_t length,
+    struct chunk_job *job)
+{
+    uint32_t index = stripe->received % ctx->depth;
+    uint64_t slot = (stripe - ctx->stripes) * (uint64_t)ctx->depth + index;
+    char *data = ctx->buf + slot * ctx->slot_size;
+    struct chunk_hdr *hdr = (struct chunk_hdr *)data;
+
+    job->stripe = stripe;
+    job->seq = seq;
+    job->offset = (uint64_t)seq * ctx->chunk_size;
+    job->raw_length = chunk_length(ctx->file_size, ctx->chunk_size, seq);
+
+    // A chunk in a slot comes behind its header, a chunk in the file got its
+    // header in the SEND that followed it
+    if (ctx->map)
     {
-        puts("error while acquiring rdmacm id.");
-        return err;
+        hdr = &stripe->hdrs[index];
+        data = ctx->map + job->offset;
+        length = length == sizeof(*hdr) ? ntohl(hdr->length) & ~CHUNK_COMPRESSED : UINT32_MAX;
     }
-    sin.sin_family = AF_INET; 
-    sin.sin_port = htons(9191);
-    sin.sin_addr.s_addr = INADDR_ANY;
+    else if (length >= sizeof(*hdr))
+    {
+        data += sizeof(*hdr);
+        length -= sizeof(*hdr);
+    }
+    else
+        length = UINT32_MAX;
+    job->hdr = hdr;
+    job->data = data;
+    job->length = length;
+    job->compressed = (ntohl(hdr->length) & CHUNK_COMPRESSED) != 0;
 
-    printf("waiting for connection.\n");
-    err = rdma_bind_addr(listen_id,(struct sockaddr *)&sin);
-    if (err) 
+    // The header must agree with the immediate and the bytes that came
+    if (length == UINT32_MAX || (ntohl(hdr->length) & ~CHUNK_COMPRESSED) != length ||
+        bswap_64(hdr->offset) != job->offset || (job->compressed && ctx->comp.codec == CODEC_NONE))
     {
+        printf("Chunk %u came with a bad header\n", seq);
         return 1;
-    } 
-    err = rdma_listen(listen_id,1);
-    if (err)
+    }
+    if (seq >= chunk_count(ctx->file_size, ctx->chunk_size) ||
+        (job->compressed ? length >= job->raw_length : length != job->raw_length))
+    {
+        printf("Chunk %u is out of bounds\n", seq);
         return 1;
+    }
+    stripe->received++;
 
-    err = rdma_get_cm_event(cm_channel,&event);
-    if (err)
+    return 0;
+}
+
+int persist_chunk(void *arg, uint32_t item, int worker)
+{
+    struct server_ctx *ctx = arg;
+    struct chunk_job *job = &ctx->jobs[item];
+    char *data = job->data;
+    uint64_t offset = job->offset;
+    uint32_t length = job->length;
+
+    // Only chunks that check out are persisted, the client sends the others again
+    job->corrupt = crc32c(0, data, length) != ntohl(job->hdr->crc);
+    if (job->corrupt)
+        return 0;
+
+    if (job->compressed)
     {
-        printf("error while getting rdma_get_cm_event: %d", err);
-        return err;
+        data = ctx->comp.scratch[worker];
+        length = job->raw_length;
+        if (decompress_chunk(&ctx->comp, worker, job->data, job->length, data, length))
+        {
+            printf("Chunk %u does not decompress\n", job->seq);
+            return 1;
+        }
+    }
+
+    // The NIC already placed the data in the file, it only has to reach the disk
+    if (ctx->map)
+        return 0;
+
+    while (length > 0)
+    {
+        ssize_t written = pwrite(ctx->fd, data, length, offset);
+        if (written < 0)
+        {
+            perror("Error writing file");
+            return 1;
+        }
+        data += written;
+        offset += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+// A connection manager event during the transfer, 1 once the client is gone
+int transfer_event(struct server_ctx *ctx)
+{
+    struct rdma_cm_event    *event;
+    struct rdma_cm_id       *cm_id;
+    struct cdata            req_cdata;
+
+    if (rdma_get_cm_event(ctx->cm_channel, &event))
+    {
+        perror("error while getting rdma_get_cm_event");
+        return -1;
+    }
+
+    switch (event->event)
+    {
+        case RDMA_CM_EVENT_DISCONNECTED:
+        case RDMA_CM_EVENT_TIMEWAIT_EXIT:
+            rdma_ack_cm_event(event);
+            return 1;
+        case RDMA_CM_EVENT_CONNECT_REQUEST:
+            // The client resuming before we noticed its old connections died,
+            // the request is answered once they are torn down
+            if (ctx->transfer_id && event->param.conn.private_data_len >= sizeof(req_cdata))
+            {
+                memcpy(&req_cdata, event->param.conn.private_data, sizeof(req_cdata));
+                if (bswap_64(req_cdata.transfer_id) == ctx->transfer_id)
+                {
+                    ctx->request = event;
+                    return 1;
+                }
+            }
+            printf("Rejecting a connection request, a transfer is running\n");
+            cm_id = event->id;
+            rdma_reject(cm_id, NULL, 0);
+            rdma_ack_cm_event(event);
+            rdma_destroy_id(cm_id);
+            return 0;
+        default:
+            printf("Ignoring event %s during the transfer\n", get_rdma_event(event->event));
+            rdma_ack_cm_event(event);
+            return 0;
     }
-    if (event->event != RDMA_CM_EVENT_CONNECT_REQUEST)
+}
+
+// Same as poll_completions, but it sleeps on the CM channel too: a client that
+// goes away is only reported there, the posted receives would wait for ever.
+// Returns the number of work completions, 0 once the client is gone or -1
+int wait_completions(struct server_ctx *ctx, struct ibv_wc *wc, int max_wc)
+{
+    struct pollfd   fds[2] = {
+        { .fd = ctx->comp_chan->fd, .events = POLLIN },
+        { .fd = ctx->cm_channel->fd, .events = POLLIN },
+    };
+    struct ibv_cq   *evt_cq;
+    void            *cq_context;
+    int             n;
+
+    while (1)
     {
-        printf("not an connection request.\n");
+        // Reap whatever is already there before sleeping on the channels,
+        // chunks that landed before a disconnect still count
+        n = ibv_poll_cq(ctx->cq, max_wc, wc);
+        if (n != 0)
+        {
+            if (n < 0)
+                puts("failed to poll the completion queue");
+            return n < 0 ? -1 : n;
+        }
+
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Error waiting for completions");
+            return -1;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            if (ibv_get_cq_event(ctx->comp_chan, &evt_cq, &cq_context))
+            {
+                puts("Failed to get cq event.");
+                return -1;
+            }
+            ibv_ack_cq_events(evt_cq, 1);
+
+            if (ibv_req_notify_cq(ctx->cq, 0))
+            {
+                puts("Failed to get the notification.");
+                return -1;
+            }
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            n = transfer_event(ctx);
+            if (n != 0)
+                return n < 0 ? -1 : 0;
+        }
+    }
+}
+
+int receive_file(struct server_ctx *ctx)
+{
+    struct ibv_wc wc[2 * MAX_DEPTH];
+    uint64_t total = chunk_count(ctx->file_size, ctx->chunk_size);
+    uint64_t done = ctx->saved;
+
+    while (done < total)
+    {
+        uint32_t njobs = 0;
+        int n = wait_completions(ctx, wc, 2 * ctx->depth);
+        if (n < 0)
+            return 1;
+        if (n == 0)
+            return TRANSFER_INTERRUPTED;
+
+        for (int i = 0; i < n; i++)
+        {
+            // A stripe whose QP went to error lost its client, the CM event
+            // that says so may still be on its way
+            if (wc[i].status != IBV_WC_SUCCESS)
+            {
+                printf("wc is not success: %s\n", ibv_wc_status_str(wc[i].status));
+                return TRANSFER_INTERRUPTED;
+            }
+            if (wc[i].opcode != IBV_WC_RECV_RDMA_WITH_IMM && wc[i].opcode != IBV_WC_RECV)
+                continue;
+
+            // The immediate is the chunk sequence number, byte_len its length
+            struct server_stripe *stripe = find_stripe(ctx, wc[i].qp_num);
+            uint32_t seq = ntohl(wc[i].imm_data);
+            uint32_t index = stripe->received % ctx->depth;
+            if (check_chunk(ctx, stripe, seq, wc[i].byte_len, &ctx->jobs[njobs++]))
+                return 1;
+            // The slot is only written again once the chunk is acknowledged
+            if (post_chunk_recv(ctx, stripe, index))
+                return 1;
+        }
+
+        // Every worker takes chunks of the poll, the acknowledgements wait for all of them
+        if (compressor_run(&ctx->comp, persist_chunk, ctx, njobs))
+            return 1;
+
+        for (uint32_t j = 0; j < njobs; j++)
+        {
+            struct chunk_job *job = &ctx->jobs[j];
+
+            queue_chunk_ack(job->stripe, job->corrupt ? job->seq | ACK_CORRUPT : job->seq);
+            if (job->corrupt)
+            {
+                printf("Chunk at offset %lu failed its checksum, asking for it again\n", job->offset);
+                ctx->corrupted++;
+                continue;
+            }
+            job->stripe->landed = job->offset + job->raw_length;
+            if (ctx->progress)
+            {
+                // A chunk sent again after a restart is only counted once
+                if (ctx->progress[job->seq / 8] & (1 << job->seq % 8))
+                    continue;
+                ctx->progress[job->seq / 8] |= 1 << job->seq % 8;
+                ctx->unsaved += job->raw_length;
+            }
+            done++;
+        }
+        if (ctx->map && sync_mapped(ctx))
+            return 1;
+        if (ctx->progress && ctx->unsaved >= SYNC_BYTES && save_progress(ctx))
+            return 1;
+
+        for (uint32_t s = 0; s < ctx->nstripes; s++)
+        {
+            if (post_chunk_acks(&ctx->stripes[s]))
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+int setup_transfer(struct server_ctx *ctx, struct rdma_cm_id *cm_id, struct cdata *req_cdata,
+    int use_mmap, uint64_t huge_page, int workers)
+{
+    uint32_t chunk_size, depth, stripes, codec;
+    uint64_t region_size;
+    int err;
+
+    // Honour the client up to our own limits, it adapts to smaller values
+    ctx->file_size = bswap_64(req_cdata->file_size);
+    chunk_size = ntohl(req_cdata->chunk_size);
+    depth = ntohl(req_cdata->depth);
+    stripes = ntohl(req_cdata->stripes);
+    codec = ntohl(req_cdata->codec);
+    ctx->transfer_id = bswap_64(req_cdata->transfer_id);
+    if (chunk_size == 0 || chunk_size > MAX_CHUNK_SIZE)
+        chunk_size = DEFAULT_CHUNK_SIZE;
+    if (depth == 0 || depth > MAX_DEPTH)
+        depth = DEFAULT_DEPTH;
+    if (stripes == 0 || stripes > MAX_STRIPES)
+    {
+        printf("connection request asks for %u stripes, at most %d are supported.\n", stripes, MAX_STRIPES);
+        return 1;
+    }
+    if (codec > CODEC_ZSTD)
+    {
+        printf("connection request asks for unknown codec %u.\n", codec);
+        return 1;
+    }
+    if (!codec_available(codec))
+    {
+        printf("connection request asks for codec %s, this server is built without it.\n", codec_name(codec));
+        return 1;
+    }
+    if (compressor_init(&ctx->comp, codec, 0, workers, chunk_size, 1))
+    {
+        puts("could not start the decompression workers. quitting");
         return 1;
     }
 
-    cm_id = event->id;
-    rdma_ack_cm_event(event);
+    ctx->stripes = calloc(stripes, sizeof(struct server_stripe));
+    if (!ctx->stripes)
+        return 1;
+    ctx->nstripes = stripes;
+    ctx->chunk_size = chunk_size;
+    ctx->slot_size = chunk_size;
+    ctx->depth = depth;
 
-    pd = ibv_alloc_pd(cm_id->verbs);
-    if (!pd) 
+    ctx->pd = ibv_alloc_pd(cm_id->verbs);
+    if (!ctx->pd) 
     {
         puts("error when allocating protection domain. quitting");
         return 1;
     }
 
-    comp_chan = ibv_create_comp_channel(cm_id->verbs);
-    if (!comp_chan)
+    ctx->comp_chan = ibv_create_comp_channel(cm_id->verbs);
+    if (!ctx->comp_chan)
     {
         puts("Error while creating completion channel.");
         return 1;
     }
 
-    cq = ibv_create_cq(cm_id->verbs,1,NULL,comp_chan,0); 
-    if (!cq)
+    // One completion per received chunk and one per acknowledgement, on every stripe
+    ctx->cq = ibv_create_cq(cm_id->verbs,2*depth*stripes,NULL,ctx->comp_chan,0);
+    if (!ctx->cq)
     {
         puts("Erro while creating completion queue");
         return 1;
     }
-    if (ibv_req_notify_cq(cq,0))
+    if (ibv_req_notify_cq(ctx->cq,0))
     {
         puts("could not fetch notifications on the completion queue, quitting.");
         return 1;
     }
 
-    buf = calloc(BUFSIZE, sizeof(uint32_t)); // Receive BUFSIZE elements
-    if (!buf) 
+    // What an earlier attempt of the transfer left in output_file is kept
+    if (ctx->transfer_id && load_progress(ctx))
         return 1;
+    if (ctx->saved)
+        printf("Resuming transfer %lu, %lu of %lu chunks are already there\n",
+            ctx->transfer_id, ctx->saved, chunk_count(ctx->file_size, chunk_size));
+
+    ctx->fd = open("output_file", O_RDWR | O_CREAT | (ctx->saved ? 0 : O_TRUNC), 0644);
+    if (ctx->fd < 0)
+    {
+        perror("Error opening file");
+        return 1;
+    }
+    if (remove_stale_progress(ctx))
+        return 1;
+
+    // Compressed chunks have to be decompressed on their way to the file
+    if (use_mmap && codec != CODEC_NONE)
+        printf("The chunks come compressed, receiving them in staging slots instead of the mmap'd file\n");
+    if (use_mmap && ctx->file_size > 0 && codec == CODEC_NONE)
+    {
+        // The file itself is the region the client writes into
+        err = posix_fallocate(ctx->fd, 0, ctx->file_size);
+        if (err)
+        {
+            printf("Could not allocate %lu bytes for output_file: %s\n", ctx->file_size, strerror(err));
+            return 1;
+        }
+        ctx->map = mmap(NULL, ctx->file_size, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->fd, 0);
+        if (ctx->map == MAP_FAILED)
+        {
+            perror("Error mapping file");
+            return 1;
+        }
+        ctx->buf = ctx->map;
+        region_size = ctx->file_size;
 
-    mr = ibv_reg_mr(pd,buf,BUFSIZE*sizeof(uint32_t), 
+        // The headers come in SENDs of their own, one receive buffer per slot
+        ctx->hdrs = calloc((size_t)stripes * depth, sizeof(struct chunk_hdr));
+        if (!ctx->hdrs)
+            return 1;
+        ctx->hdr_mr = ibv_reg_mr(ctx->pd, ctx->hdrs, (size_t)stripes * depth * sizeof(struct chunk_hdr),
+            IBV_ACCESS_LOCAL_WRITE);
+        if (!ctx->hdr_mr)
+        {
+            puts("header buffers could not be registered. quitting");
+            return 1;
+        }
+    }
+    else
+    {
+        ctx->map = NULL;
+        // Staging region, one slot per chunk in flight on every stripe, with room for its header
+        ctx->slot_size = chunk_size + sizeof(struct chunk_hdr);
+        region_size = (uint64_t)stripes * depth * ctx->slot_size;
+        ctx->buf = alloc_buffer(region_size, huge_page, &ctx->buf_mapped);
+    }
+    if (!ctx->buf)
+        return 1;
+
+    ctx->mr = ibv_reg_mr(ctx->pd,ctx->buf,region_size,
         IBV_ACCESS_LOCAL_WRITE | 
         IBV_ACCESS_REMOTE_READ | 
         IBV_ACCESS_REMOTE_WRITE); 
-    if (!mr) 
+    if (!ctx->mr) 
     {
         puts("memory region could not be registered. quitting");
         return 1;
     } 
 
+    // The client reads the bitmap to learn what it can skip
+    if (ctx->progress)
+    {
+        ctx->progress_mr = ibv_reg_mr(ctx->pd, ctx->progress, (chunk_count(ctx->file_size, chunk_size) + 7) / 8,
+            IBV_ACCESS_REMOTE_READ);
+        if (!ctx->progress_mr)
+        {
+            puts("transfer bitmap could not be registered. quitting");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int accept_stripe(struct server_ctx *ctx, struct rdma_cm_id *cm_id, struct cdata *req_cdata)
+{
+    struct server_stripe        *stripe;
+    struct pdata                rep_pdata;
+    struct rdma_conn_param      conn_param = { };
+    struct ibv_qp_init_attr     qp_attr = { };
+    uint32_t                    index = ntohl(req_cdata->stripe);
+    int                         err;
+
+    if (index >= ctx->nstripes || ctx->stripes[index].cm_id ||
+        ntohl(req_cdata->stripes) != ctx->nstripes || bswap_64(req_cdata->file_size) != ctx->file_size)
+    {
+        printf("connection request for stripe %u does not belong to the transfer.\n", index);
+        return 1;
+    }
+    stripe = &ctx->stripes[index];
+
     memset(&qp_attr,0,sizeof(qp_attr));
-    qp_attr.cap.max_send_wr = 1;
+    qp_attr.cap.max_send_wr = ctx->depth;
     qp_attr.cap.max_send_sge = 1;
-    qp_attr.cap.max_recv_wr = 1;
+    qp_attr.cap.max_recv_wr = ctx->depth;
     qp_attr.cap.max_recv_sge = 1;
-    qp_attr.send_cq = cq;
-    qp_attr.recv_cq = cq;
+    qp_attr.send_cq = ctx->cq;
+    qp_attr.recv_cq = ctx->cq;
     qp_attr.qp_type = IBV_QPT_RC;
 
-    err = rdma_create_qp(cm_id,pd,&qp_attr); 
+    err = rdma_create_qp(cm_id,ctx->pd,&qp_attr); 
     if (err) {
 	    perror("rdma cm create qp error");
         return err;
 	}
+    stripe->cm_id = cm_id;
+    stripe->hdrs = ctx->hdrs ? ctx->hdrs + (uint64_t)index * ctx->depth : NULL;
+
+    // Every chunk in flight needs a receive for its immediate
+    for (uint32_t i = 0; i < ctx->depth; i++)
+    {
+        if (post_chunk_recv(ctx, stripe, i))
+        {
+            printf("Crashed\n");
+            return 1;
+        }
+    }
 
-    rep_pdata.buf_va = bswap_64((uintptr_t)buf); 
-    rep_pdata.buf_rkey = htonl(mr->rkey); 
+    // Each stripe gets its own slots, the file sink is shared
+    rep_pdata.buf_va = bswap_64((uintptr_t)ctx->buf +
+        (ctx->map ? 0 : (uint64_t)index * ctx->depth * ctx->slot_size));
+    rep_pdata.buf_rkey = htonl(ctx->mr->rkey); 
+    rep_pdata.chunk_size = htonl(ctx->chunk_size);
+    rep_pdata.depth = htonl(ctx->depth);
+    rep_pdata.flags = htonl((ctx->map ? PDATA_FILE_SINK : PDATA_FRAMED) |
+        (ctx->comp.codec != CODEC_NONE ? PDATA_COMPRESSED : 0) |
+        (ctx->progress ? PDATA_RESUME : 0));
+    rep_pdata.saved = bswap_64(ctx->saved);
+    rep_pdata.saved_va = bswap_64((uintptr_t)ctx->progress);
+    rep_pdata.saved_rkey = htonl(ctx->progress_mr ? ctx->progress_mr->rkey : 0);
     conn_param.responder_resources = 1;  
     conn_param.private_data = &rep_pdata; 
     conn_param.private_data_len = sizeof(rep_pdata);
@@ -208,107 +775,254 @@ int main(int argc, char *argv[])
     err = rdma_accept(cm_id,&conn_param); 
     if (err) 
         return 1;
+    ctx->accepted++;
 
-    err = rdma_get_cm_event(cm_channel,&event);
-    if (err) 
-        return err;
-    if (event->event != RDMA_CM_EVENT_ESTABLISHED)
+    return 0;
+}
+
+int accept_transfer(struct server_ctx *ctx, int use_mmap, uint64_t huge_page, int workers)
+{
+    struct rdma_cm_event        *event;
+    struct rdma_cm_id           *cm_id;
+    struct cdata                req_cdata;
+    uint32_t                    established = 0;
+    int                         err;
+
+    // The first request describes the transfer, every stripe of it then connects
+    while (ctx->stripes == NULL || established < ctx->nstripes)
     {
-        printf("Expected event: %s, got: %s\n",
-        get_rdma_event(RDMA_CM_EVENT_ESTABLISHED),
-        get_rdma_event(event->event));
+        // A request that came during the last transfer goes first
+        event = ctx->request;
+        ctx->request = NULL;
+        if (!event)
+        {
+            err = rdma_get_cm_event(ctx->cm_channel,&event);
+            if (err)
+            {
+                printf("error while getting rdma_get_cm_event: %d", err);
+                return 1;
+            }
+        }
 
-        return 1;
+        if (event->event == RDMA_CM_EVENT_ESTABLISHED)
+        {
+            established++;
+            rdma_ack_cm_event(event);
+            continue;
+        }
+        if (event->event != RDMA_CM_EVENT_CONNECT_REQUEST)
+        {
+            printf("Expected event: %s, got: %s\n",
+            get_rdma_event(RDMA_CM_EVENT_ESTABLISHED),
+            get_rdma_event(event->event));
+
+            return 1;
+        }
+        if (event->param.conn.private_data_len < sizeof(req_cdata))
+        {
+            printf("connection request does not describe a file.\n");
+            return 1;
+        }
+
+        // The private data is freed together with the event
+        cm_id = event->id;
+        memcpy(&req_cdata, event->param.conn.private_data, sizeof(req_cdata));
+        rdma_ack_cm_event(event);
+
+        if (ctx->stripes == NULL && setup_transfer(ctx, cm_id, &req_cdata, use_mmap, huge_page, workers))
+            return 1;
+        if (accept_stripe(ctx, cm_id, &req_cdata))
+            return 1;
     }
-    rdma_ack_cm_event(event);
 
+    return 0;
+}
+
+void teardown_transfer(struct server_ctx *ctx)
+{
+    struct rdma_event_channel   *cm_channel = ctx->cm_channel;
+    struct rdma_cm_event        *request = ctx->request;
 
-    if (prepare_recv_notify_before_using_rdma_write(cm_id, pd))
+    for (uint32_t i = 0; i < ctx->nstripes; i++)
     {
-        printf("Crashed\n");
-        return 1;
+        struct rdma_cm_id *cm_id = ctx->stripes[i].cm_id;
+
+        if (!cm_id)
+            continue;
+        // Fails harmlessly on a stripe the client disconnected already
+        rdma_disconnect(cm_id);
+        rdma_destroy_qp(cm_id);
+        if (rdma_destroy_id(cm_id) != 0)
+            perror("destroy cm id fail.");
     }
-    if (check_notify_before_using_rdma_write(comp_chan, cq))
+    if (ctx->mr)
+        ibv_dereg_mr(ctx->mr);
+    if (ctx->hdr_mr)
+        ibv_dereg_mr(ctx->hdr_mr);
+    free(ctx->hdrs);
+    if (ctx->progress_mr)
+        ibv_dereg_mr(ctx->progress_mr);
+    if (ctx->progress)
+        close(ctx->progress_fd);
+    free(ctx->progress);
+    if (ctx->map)
+        munmap(ctx->map, ctx->file_size);
+    else if (ctx->buf)
+        free_buffer(ctx->buf, ctx->buf_mapped);
+    close(ctx->fd);
+    if (ctx->cq)
+        ibv_destroy_cq(ctx->cq);
+    if (ctx->comp_chan)
+        ibv_destroy_comp_channel(ctx->comp_chan);
+    if (ctx->pd)
+        ibv_dealloc_pd(ctx->pd);
+    free(ctx->stripes);
+    compressor_destroy(&ctx->comp);
+
+    // Ready for the next transfer, the channel and a request for it stay
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->cm_channel = cm_channel;
+    ctx->request = request;
+}
+
+int main(int argc, char *argv[]) 
+{ 
+    struct server_ctx           ctx = { };
+
+    struct rdma_event_channel   *cm_channel;
+    struct rdma_cm_id           *listen_id; 
+    struct rdma_cm_event        *event; 
+    struct sockaddr_in          sin;
+    uint64_t                    huge_page = 0;
+    uint32_t                    disconnected = 0;
+    int                         use_mmap = 0;
+    int                         workers = DEFAULT_WORKERS;
+    int                         option;
+    int                         err;
+    double                      start, elapsed;
+
+    while ((option = getopt(argc, argv, "mH:t:")) != -1)
     {
-        printf("Crashed 2\n");
-        return 1;
+        switch (option)
+        {
+            case 'm':
+                use_mmap = 1;
+                break;
+            case 'H':
+                huge_page = parse_huge_page(optarg);
+                if (huge_page == 0)
+                    argc = 0;
+                break;
+            case 't':
+                workers = strtol(optarg, NULL, 0);
+                break;
+            default:
+                argc = 0;
+                break;
+        }
     }
 
-    // Now receive all BUFSIZE elements
-    printf("Received the file with %d bytes!\n", ntohl(buf[0]));
-    for (int i = 0; i < 10; i++)
+    if (argc == 0 || workers <= 0 || workers > MAX_WORKERS)
     {
-        printf("%d -> %d\n", i+1, htonl(buf[i]));
+        printf("Usage: %s [-m] [-H 2m|1g] [-t workers]\n", argv[0]);
+        printf("-m lands the chunks directly in the mmap'd output_file\n");
+        printf("-H puts the staging region on 2 MB or 1 GB huge pages\n");
+        printf("-t decompresses compressed chunks on workers threads (default %d, up to %d)\n",
+            DEFAULT_WORKERS, MAX_WORKERS);
+        exit(1);
     }
 
-    FILE *file = fopen("output_file", "wb");
-    if (!file) 
+    /* We use rdmacm lib to establish rdma connection and ibv lib to write, read, send, receive data here. */
+
+    cm_channel = rdma_create_event_channel();
+    if (!cm_channel) 
     {
-        perror("Error opening file");
+        puts("Could not create event channel. You may not have the necessary RDMA set.");
         return 1;
     }
-    long int file_size = ntohl(buf[0]); 
-    // Write the file contents from the buffer to the file
-    // Start writing from buf[1] onward (the actual file content)
-    fwrite(buf+1, sizeof(uint32_t), file_size, file);
- 
-
-    // Close the file after writing
-    fclose(file);
-    /*
-    FILE* write_file = fopen("send_file.bin", "wb");
-    if (!write_file)
-    {
-        printf("Could not write file, aborting.\n");
-        exit(0);
-    }
-    */
-    // Post send operation
-    sge.addr = (uintptr_t)buf; 
-    sge.length = sizeof(uint32_t); 
-    sge.lkey = mr->lkey;
-    
-    send_wr.opcode = IBV_WR_SEND;
-    send_wr.send_flags = IBV_SEND_SIGNALED;
-    send_wr.sg_list = &sge;
-    send_wr.num_sge = 1;
-
-    if (ibv_post_send(cm_id->qp, &send_wr, &bad_send_wr)) 
-        return 1;
 
-    // Check for completion event
-	if (ibv_get_cq_event(comp_chan, &evt_cq, &cq_context))
-		return 1;
-	ibv_ack_cq_events(cq, 1);
-	if (ibv_req_notify_cq(cq, 0))
-		return 1;
-	if (ibv_poll_cq(cq, 1, &wc) != 1)
-		return 1;
-	if (wc.status != IBV_WC_SUCCESS)
-    {
-        puts("Work completion was not successful.");
-		return 1;
-    }
-    printf("Status of event: %d\n", wc.status);
-    
-    // Clean up on disconnection
-    err = rdma_get_cm_event(cm_channel,&event);
-    if (err)
+    err = rdma_create_id(cm_channel,&listen_id,NULL,RDMA_PS_TCP); 
+    if (err) 
+    {
+        puts("error while acquiring rdmacm id.");
         return err;
+    }
+    sin.sin_family = AF_INET; 
+    sin.sin_port = htons(9191);
+    sin.sin_addr.s_addr = INADDR_ANY;
+
+    printf("waiting for connection.\n");
+    err = rdma_bind_addr(listen_id,(struct sockaddr *)&sin);
+    if (err) 
+    {
+        return 1;
+    } 
+    // A striped transfer connects once per stripe
+    err = rdma_listen(listen_id,MAX_STRIPES);
+    if (err)
+        return 1;
+
+    // A transfer that is interrupted is torn down, its client may connect again
+    // and resume it from the bitmap without the server restarting
+    ctx.cm_channel = cm_channel;
+    while (1)
+    {
+        if (accept_transfer(&ctx, use_mmap, huge_page, workers))
+            return 1;
+
+        printf("Receiving a file with %lu bytes in chunks of %u bytes, %u in flight on each of %u stripes, codec %s\n",
+            ctx.file_size, ctx.chunk_size, ctx.depth, ctx.nstripes, codec_name(ctx.comp.codec));
+
+        // Chunks are written to output_file as they land
+        start = now_seconds();
+        err = receive_file(&ctx);
+        if (err == 0)
+            break;
+
+        // Whatever made it to the file is not sent again next time
+        if (ctx.progress && save_progress(&ctx) == 0)
+            printf("Transfer %lu interrupted, %s\n", ctx.transfer_id,
+                err == TRANSFER_INTERRUPTED ? "the client can resume it" : "run it again to resume");
+        if (err != TRANSFER_INTERRUPTED)
+        {
+            printf("Crashed 2\n");
+            return 1;
+        }
+        teardown_transfer(&ctx);
+        printf("waiting for connection.\n");
+    }
+    elapsed = now_seconds() - start;
+    printf("Received the file with %lu bytes! %.2f MB/s over %u stripes, %lu chunks failed their checksum\n",
+        ctx.file_size, ctx.file_size / elapsed / 1e6, ctx.nstripes, ctx.corrupted);
 
-    rdma_ack_cm_event(event);
+    // The size set by fallocate has to be durable too
+    if (fdatasync(ctx.fd))
+        perror("Error syncing file");
 
-    if (event->event == RDMA_CM_EVENT_DISCONNECTED) 
+    // A complete transfer has nothing left to resume
+    if (ctx.progress)
     {
-        printf("End communication!\n");
-        rdma_destroy_qp(cm_id);
-        ibv_dereg_mr(mr);
-        free(buf);
-        err = rdma_destroy_id(cm_id);
-        if (err != 0)
-            perror("destroy cm id fail.");
+        char path[64];
+
+        snprintf(path, sizeof(path), "transfer_%lu.bitmap", ctx.transfer_id);
+        unlink(path);
+    }
+
+    // Clean up once every stripe is disconnected
+    while (disconnected < ctx.nstripes)
+    {
+        err = rdma_get_cm_event(cm_channel,&event);
+        if (err)
+            return err;
+
+        if (event->event == RDMA_CM_EVENT_DISCONNECTED)
+            disconnected++;
+        rdma_ack_cm_event(event);
     }
 
+    printf("End communication!\n");
+    teardown_transfer(&ctx);
+
     rdma_destroy_event_channel(cm_channel);
     return 0;
 }
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include "transfer.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78u
+
+static uint32_t crc32c_table[256];
+static int crc32c_hw;
+// The first checksums are computed on several workers at once
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[i] = c;
+    }
+#if defined(__x86_64__)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#else
+    crc32c_hw = 0;
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t length)
+{
+    while (length--)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t length)
+{
+    uint64_t crc64;
+
+    // Byte steps up to an 8 byte boundary, then 8 bytes per instruction
+    for (; length && ((uintptr_t)p & 7); length--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    crc64 = crc;
+    for (; length >= 8; length -= 8, p += 8)
+        crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+    crc = crc64;
+
+    for (; length; length--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32c_hw)
+        return ~crc32c_sse42(crc, data, length);
+#endif
+    return ~crc32c_sw(crc, data, length);
+}
+
+uint64_t chunk_count(uint64_t file_size, uint32_t chunk_size)
+{
+    if (file_size == 0)
+        return 1;
+
+    return (file_size + chunk_size - 1) / chunk_size;
+}
+
+uint32_t chunk_length(uint64_t file_size, uint32_t chunk_size, uint64_t seq)
+{
+    uint64_t offset = seq * chunk_size;
+
+    if (offset >= file_size)
+        return 0;
+    if (file_size - offset < chunk_size)
+        return file_size - offset;
+
+    return chunk_size;
+}
+
+int poll_completions(struct ibv_comp_channel *comp_chan, struct ibv_cq *cq,
+    struct ibv_wc *wc, int max_wc)
+{
+    struct ibv_cq   *evt_cq;
+    void            *cq_context;
+    int             n;
+
+    while (1)
+    {
+        // Reap whatever is already there before sleeping on the channel
+        n = ibv_poll_cq(cq, max_wc, wc);
+        if (n != 0)
+        {
+            if (n < 0)
+                puts("failed to poll the completion queue");
+            return n < 0 ? -1 : n;
+        }
+
+        if (ibv_get_cq_event(comp_chan, &evt_cq, &cq_context))
+        {
+            puts("Failed to get cq event.");
+            return -1;
+        }
+        ibv_ack_cq_events(evt_cq, 1);
+
+        if (ibv_req_notify_cq(cq, 0))
+        {
+            puts("Failed to get the notification.");
+            return -1;
+        }
+    }
+}
+
+void frame_init(struct sg_frame *frame, void *hdr, uint32_t hdr_length,
+    struct ibv_mr *mr, int max_sge)
+{
+    frame->num_sge = 0;
+    frame->max_sge = max_sge < MAX_FRAME_SGE ? max_sge : MAX_FRAME_SGE;
+    if (hdr_length)
+        frame_add(frame, hdr, hdr_length, mr);
+}
+
+int frame_add(struct sg_frame *frame, void *addr, uint32_t length, struct ibv_mr *mr)
+{
+    struct ibv_sge *sge;
+
+    if (length == 0)
+        return 0;
+    if (frame->num_sge == frame->max_sge)
+        return -1;
+
+    sge = &frame->sge[frame->num_sge++];
+    sge->addr = (uintptr_t)addr;
+    sge->length = length;
+    sge->lkey = mr->lkey;
+
+    return 0;
+}
+
+void frame_attach(struct sg_frame *frame, struct ibv_send_wr *send_wr)
+{
+    send_wr->sg_list = frame->sge;
+    send_wr->num_sge = frame->num_sge;
+}
+
+uint64_t parse_huge_page(const char *arg)
+{
+    if (!strcasecmp(arg, "2m"))
+        return HUGE_PAGE_2MB;
+    if (!strcasecmp(arg, "1g"))
+        return HUGE_PAGE_1GB;
+
+    return 0;
+}
+
+void *alloc_buffer(uint64_t size, uint64_t huge_page, uint64_t *mapped)
+{
+    uint64_t length;
+    char *buf, *aligned;
+
+    *mapped = 0;
+    if (huge_page == 0)
+        return calloc(1, size);
+
+    length = (size + huge_page - 1) & ~(huge_page - 1);
+
+    // Reserved hugetlbfs pages, MAP_POPULATE faults them all in
+    buf = mmap(NULL, length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE |
+        (huge_page == HUGE_PAGE_1GB ? MAP_HUGE_1GB : MAP_HUGE_2MB), -1, 0);
+    if (buf == MAP_FAILED)
+    {
+        // Transparent huge pages instead, mapped with room to cut a 2 MB aligned range
+        printf("No %s hugetlbfs pages reserved, using transparent huge pages\n",
+            huge_page == HUGE_PAGE_1GB ? "1 GB" : "2 MB");
+        length = (size + HUGE_PAGE_2MB - 1) & ~(HUGE_PAGE_2MB - 1);
+        buf = mmap(NULL, length + HUGE_PAGE_2MB, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED)
+        {
+            perror("Error mapping the buffer");
+            return NULL;
+        }
+        aligned = (char *)(((uintptr_t)buf + HUGE_PAGE_2MB - 1) & ~(HUGE_PAGE_2MB - 1));
+        if (aligned != buf)
+            munmap(buf, aligned - buf);
+        munmap(aligned + length, buf + HUGE_PAGE_2MB - aligned);
+        buf = aligned;
+        if (madvise(buf, length, MADV_HUGEPAGE))
+            perror("Transparent huge pages are not available");
+
+        // Fault it in now rather than during the transfer
+        for (uint64_t i = 0; i < length; i += sysconf(_SC_PAGESIZE))
+            buf[i] = 0;
+    }
+
+    // The registration pins it anyway, locking it up front keeps it from moving
+    if (mlock(buf, length))
+        perror("Could not mlock the buffer");
+    *mapped = length;
+
+    return buf;
+}
+
+void free_buffer(void *buf, uint64_t mapped)
+{
+    if (mapped)
+        munmap(buf, mapped);
+    else
+        free(buf);
+}
+
+double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,222 @@
+/*
+    Wire protocol shared by rdma_write_client and rdma_write_server
+
+    The client announces the file it wants to push in the private data of
+    rdma_connect (struct cdata). The server answers in the private data of
+    rdma_accept (struct pdata) with a staging region made of `depth` slots of
+    `chunk_size` bytes each. The file is then streamed chunk by chunk: chunk
+    `seq` is written into slot `seq % depth` with an RDMA_WRITE_WITH_IMM whose
+    immediate is `seq`, so the server learns about the chunk, and its length
+    from byte_len, in the same receive completion. Once the server has
+    persisted the chunk it gives the slot back with a zero byte SEND_WITH_IMM
+    carrying the same sequence number, so the client never has more than
+    `depth` chunks in flight per connection.
+
+    When the server answers with PDATA_FRAMED every slot is `chunk_size` plus
+    the size of a struct chunk_hdr long and a chunk lands in it behind its
+    header. The client sends the header from a buffer of its own and the
+    payload from wherever it is, as separate scatter/gather elements of the
+    same write, so neither is copied next to the other.
+
+    When the server answers with PDATA_FILE_SINK the region is not a ring of
+    slots but the destination file itself, mmap'd and registered, and chunk
+    `seq` is written at offset `seq * chunk_size` of it. The write carries no
+    immediate; the header follows it in a SEND_WITH_IMM of its own, which
+    lands after the data since a QP executes its requests in order.
+
+    The header carries the CRC32C of the payload, computed by the client
+    right before posting the chunk, and checked by the server as the chunk
+    lands. A chunk that fails the check is not persisted, and its
+    acknowledgement has ACK_CORRUPT set in the immediate. The client then
+    sends only that chunk again.
+
+    When the client asks for a `codec` the server answers with
+    PDATA_COMPRESSED and always uses staging slots, as a compressed chunk
+    cannot land in the file. The client compresses every chunk into its slot
+    and sets CHUNK_COMPRESSED in the length of the header when it did, the
+    length being the bytes that travel; the CRC covers those bytes too. The
+    server knows the length the chunk had from its sequence number.
+
+    A client that gives a `transfer_id` can resume the transfer after it
+    died. The server answers with PDATA_RESUME and keeps a bitmap of the
+    chunks it has persisted, checkpointed to disk together with the file.
+    When a new connection finds chunks of the same file there, the pdata
+    carries how many, along with the address and rkey of the bitmap. The
+    client reads the bitmap with a single RDMA_READ and sends only the
+    chunks that are missing.
+
+    A transfer may be striped over several connections between the same
+    hosts: each one sends the same cdata with its own `stripe` index and the
+    number of `stripes`, and gets a staging region of its own. The client
+    hands the next chunk to whichever stripe has a free slot. A stripe uses
+    its slots in turn, the k-th chunk it carries goes to slot `k % depth`,
+    and as a QP completes in order the server and the client both find the
+    slot by counting. The immediate is still the chunk sequence number, so
+    chunks are placed by offset whatever connection they came from.
+
+    Every multi-byte field travels in network byte order.
+*/
+#ifndef __RDMA_TRANSFER__
+#define __RDMA_TRANSFER__
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+#define DEFAULT_CHUNK_SIZE  (1 << 20)
+#define DEFAULT_DEPTH       16
+#define MAX_CHUNK_SIZE      (64 << 20)
+#define MAX_DEPTH           128
+#define MAX_STRIPES         16
+#define DEFAULT_SIGNAL_EVERY 8
+#define DEFAULT_WINDOW_SIZE (64 << 20)
+#define SYNC_BYTES          (64 << 20)
+#define HUGE_PAGE_2MB       (2UL << 20)
+#define HUGE_PAGE_1GB       (1UL << 30)
+#define MAX_FRAME_SGE       4
+
+/* pdata flags */
+#define PDATA_FILE_SINK     0x1
+#define PDATA_FRAMED        0x2
+#define PDATA_COMPRESSED    0x4
+#define PDATA_RESUME        0x8
+
+/* set in the immediate of an acknowledgement, the chunk must be sent again */
+#define ACK_CORRUPT         0x80000000u
+
+/* set in the length of a header, the payload is compressed with the codec of the transfer */
+#define CHUNK_COMPRESSED    0x80000000u
+
+/* client -> server, rdma_connect private data */
+struct __attribute__((packed)) cdata {
+    uint64_t    file_size;
+    uint32_t    chunk_size;
+    uint32_t    depth;
+    uint32_t    stripe;     // index of this connection
+    uint32_t    stripes;    // connections of the transfer
+    uint32_t    codec;      // CODEC_NONE, CODEC_LZ4 or CODEC_ZSTD, see compress.h
+    uint64_t    transfer_id;    // 0 for a transfer that cannot be resumed
+};
+
+/* server -> client, rdma_accept private data */
+struct __attribute__((packed)) pdata {
+    uint64_t    buf_va;
+    uint32_t    buf_rkey;
+    uint32_t    chunk_size;
+    uint32_t    depth;
+    uint32_t    flags;
+    uint64_t    saved;      // chunks the server already has, see PDATA_RESUME
+    uint64_t    saved_va;   // bitmap of those chunks, bit seq % 8 of byte seq / 8
+    uint32_t    saved_rkey;
+};
+
+/* in front of every chunk written into a slot, see PDATA_FRAMED */
+struct __attribute__((packed)) chunk_hdr {
+    uint64_t    offset;     // where the payload goes in the file
+    uint32_t    length;     // payload bytes behind the header
+    uint32_t    crc;        // CRC32C of the payload
+};
+
+/* scatter/gather list of a framed message, a header then payload regions */
+struct sg_frame {
+    struct ibv_sge  sge[MAX_FRAME_SGE];
+    int             num_sge;
+    int             max_sge;
+};
+
+/**
+ * @brief starts a framed message with its header
+ * @param frame the frame
+ * @param hdr header, in registered memory
+ * @param hdr_length header length, 0 for a message without header
+ * @param mr registration of hdr
+ * @param max_sge max_send_sge of the QP, at most MAX_FRAME_SGE
+ */
+void frame_init(struct sg_frame *frame, void *hdr, uint32_t hdr_length,
+    struct ibv_mr *mr, int max_sge);
+
+/**
+ * @brief appends a payload region as it is, without copying it
+ * @param frame the frame
+ * @param addr start of the region, in registered memory
+ * @param length length of the region, empty regions are left out
+ * @param mr registration of the region
+ * @return 0, or -1 if the frame already has max_sge regions
+ */
+int frame_add(struct sg_frame *frame, void *addr, uint32_t length, struct ibv_mr *mr);
+
+/**
+ * @brief makes a send work request carry the frame
+ * @param frame the frame, must live until the request completes
+ * @param send_wr the work request
+ */
+void frame_attach(struct sg_frame *frame, struct ibv_send_wr *send_wr);
+
+/**
+ * @brief number of chunks needed to carry a file
+ * @param file_size size of the file in bytes
+ * @param chunk_size size of every chunk but the last one
+ * @return number of chunks, at least one so empty files still complete
+ */
+uint64_t chunk_count(uint64_t file_size, uint32_t chunk_size);
+
+/**
+ * @brief length of a given chunk, only the last one may be shorter
+ * @param file_size size of the file in bytes
+ * @param chunk_size size of every chunk but the last one
+ * @param seq chunk sequence number
+ * @return length in bytes
+ */
+uint32_t chunk_length(uint64_t file_size, uint32_t chunk_size, uint64_t seq);
+
+/**
+ * @brief CRC32C (Castagnoli) of a buffer, with the SSE4.2 crc32 instruction
+ * when the CPU has it and a table otherwise, safe to call from any thread
+ * @param crc CRC of the data before this buffer, 0 to start
+ * @param data the buffer
+ * @param length its length in bytes
+ * @return CRC of everything so far
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+/**
+ * @brief waits until the completion queue has work completions and reaps them
+ * @param comp_chan completion channel the cq was created with
+ * @param cq completion queue, must already be armed with ibv_req_notify_cq
+ * @param wc array receiving the work completions
+ * @param max_wc size of wc
+ * @return number of work completions (> 0) or -1 on error
+ */
+int poll_completions(struct ibv_comp_channel *comp_chan, struct ibv_cq *cq,
+    struct ibv_wc *wc, int max_wc);
+
+/**
+ * @brief parses the argument of -H
+ * @param arg "2m" or "1g"
+ * @return HUGE_PAGE_2MB, HUGE_PAGE_1GB or 0 if arg is not one of them
+ */
+uint64_t parse_huge_page(const char *arg);
+
+/**
+ * @brief allocates a zeroed staging buffer. With a huge page size it comes
+ * from the hugetlbfs pool (MAP_HUGETLB) if pages of that size are reserved,
+ * from 2 MB aligned transparent huge pages otherwise, and is faulted in and
+ * mlock'ed before it is registered.
+ * @param size size of the buffer in bytes
+ * @param huge_page 0 for regular pages, HUGE_PAGE_2MB or HUGE_PAGE_1GB
+ * @param mapped set to the length to pass to free_buffer, 0 for calloc
+ * @return the buffer or NULL
+ */
+void *alloc_buffer(uint64_t size, uint64_t huge_page, uint64_t *mapped);
+
+/**
+ * @brief frees a buffer of alloc_buffer
+ * @param buf the buffer
+ * @param mapped the length alloc_buffer returned
+ */
+void free_buffer(void *buf, uint64_t mapped);
+
+/**
+ * @brief current time in seconds, used to report the throughput
+ */
+double now_seconds(void);
+
+#endif //__RDMA_TRANSFER__
@@ -0,0 +1,678 @@
+/*
+ * perftest style microbenchmark for RDMA WRITE, READ and SEND.
+ *
+ * The same binary is the server (without -a) and the client (with -a). The
+ * server registers a buffer, advertises it in the private data of
+ * rdma_accept() and keeps receives posted into it until the client is done.
+ * The client sweeps opcodes, message sizes and queue depths, keeping up to
+ * `depth` work requests in flight, and prints one CSV line per
+ * point with the bandwidth, the message rate and the latency percentiles.
+ *
+ * The latency of an operation is the time from its ibv_post_send() to its
+ * work completion at the client. At depth 1 this is the round trip latency,
+ * at larger depths it includes the time spent queued behind other requests.
+ *
+ * Whatever fits in the window is posted with one ibv_post_send(). With -u only
+ * one request out of n is signaled, the others complete with the next
+ * signaled one and get its completion time.
+ */
+
+#include <time.h>
+
+#include "rdma_common.h"
+
+/* Largest number of requests in flight the QPs ask for, the device may take fewer */
+#define BENCH_MAX_DEPTH (128)
+/* Default size of the buffers, also the largest message of the sweep */
+#define BENCH_MAX_SIZE (8 << 20)
+/* Default number of measured operations per point */
+#define BENCH_ITERS (1000)
+/* Operations posted before measuring, they warm up caches and the ATs */
+#define BENCH_WARMUP (16)
+/* Bytes moved per point after which the iterations are cut down */
+#define BENCH_POINT_BYTES (1UL << 30)
+/* Work completions reaped per ibv_poll_cq call */
+#define BENCH_POLL_BATCH (16)
+
+enum bench_op {
+	BENCH_WRITE = 0,
+	BENCH_READ,
+	BENCH_SEND,
+	BENCH_OPS
+};
+
+static const char *bench_op_names[BENCH_OPS] = { "write", "read", "send" };
+
+static struct rdma_event_channel *cm_event_channel = NULL;
+static struct rdma_cm_id *cm_listen_id = NULL, *cm_id = NULL;
+static struct ibv_pd *pd = NULL;
+static struct ibv_comp_channel *io_completion_channel = NULL;
+static struct ibv_cq *cq = NULL;
+static struct ibv_qp *qp = NULL;
+/* queue sizes, as far as the device takes them */
+static struct rdma_queue_caps caps;
+static struct rdma_poller poller;
+/* benchmarks spin by default, like perftest does */
+static enum rdma_poll_mode poll_mode = RDMA_POLL_BUSY;
+static uint32_t spin_usec = DEFAULT_SPIN_USEC;
+static struct ibv_mr *buffer_mr = NULL;
+/* client: requests go through it, signaled one out of signal_every */
+static struct rdma_post_batch batch;
+static uint32_t signal_every = 1;
+/* client: the server buffer, from the private data of rdma_accept() */
+static struct rdma_buffer_attr remote_attr;
+
+static uint64_t now_nsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of a sorted array, in microseconds */
+static double percentile_usec(uint64_t *sorted, uint64_t n, double q)
+{
+	uint64_t rank = (uint64_t) (q * n + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	if (rank > n)
+		rank = n;
+	return sorted[rank - 1] / 1000.0;
+}
+
+/* Creates the PD, CQ and QP of a connection id, both sides use the same sizes */
+static int setup_qp(struct rdma_cm_id *id)
+{
+	struct ibv_qp_init_attr qp_init_attr;
+	int ret;
+	pd = ibv_alloc_pd(id->verbs);
+	if (!pd) {
+		rdma_error("Failed to allocate a protection domain errno: %d\n",
+				-errno);
+		return -errno;
+	}
+	io_completion_channel = ibv_create_comp_channel(id->verbs);
+	if (!io_completion_channel) {
+		rdma_error("Failed to create an I/O completion event channel, %d\n",
+				-errno);
+		return -errno;
+	}
+	ret = rdma_queue_caps_probe(id->verbs, id->port_num, BENCH_MAX_DEPTH + 1, 1,
+			&caps);
+	if (ret)
+		return ret;
+	cq = ibv_create_cq(id->verbs, caps.cq_entries, NULL,
+			io_completion_channel, 0);
+	if (!cq) {
+		rdma_error("Failed to create a completion queue (cq), errno: %d\n",
+				-errno);
+		return -errno;
+	}
+	ret = ibv_req_notify_cq(cq, 0);
+	if (ret) {
+		rdma_error("Failed to request notifications on CQ errno: %d \n",
+				-errno);
+		return -errno;
+	}
+	rdma_poller_init(&poller, io_completion_channel, cq, poll_mode, spin_usec);
+	bzero(&qp_init_attr, sizeof qp_init_attr);
+	rdma_queue_caps_qp_attr(&caps, &qp_init_attr);
+	qp_init_attr.qp_type = IBV_QPT_RC;
+	qp_init_attr.recv_cq = cq;
+	qp_init_attr.send_cq = cq;
+	ret = rdma_create_qp(id, pd, &qp_init_attr);
+	if (ret) {
+		rdma_error("Failed to create QP due to errno: %d\n", -errno);
+		return -errno;
+	}
+	qp = id->qp;
+	return 0;
+}
+
+/* Allows as many outstanding READs as the device does */
+static int setup_conn_param(struct rdma_cm_id *id,
+		struct rdma_conn_param *conn_param)
+{
+	bzero(conn_param, sizeof(*conn_param));
+	conn_param->initiator_depth = caps.initiator_depth;
+	conn_param->responder_resources = caps.responder_resources;
+	conn_param->retry_count = 7;
+	/* SEND runs ahead of the server reposting its receives */
+	conn_param->rnr_retry_count = 7;
+	return 0;
+}
+
+static int post_recv()
+{
+	struct ibv_recv_wr recv_wr, *bad_recv_wr = NULL;
+	struct ibv_sge sge;
+	int ret;
+	/* every receive lands on the same buffer, the payload is not looked at */
+	sge.addr = (uint64_t) buffer_mr->addr;
+	sge.length = buffer_mr->length;
+	sge.lkey = buffer_mr->lkey;
+	bzero(&recv_wr, sizeof(recv_wr));
+	recv_wr.sg_list = &sge;
+	recv_wr.num_sge = 1;
+	ret = ibv_post_recv(qp, &recv_wr, &bad_recv_wr);
+	if (ret) {
+		rdma_error("Failed to post a receive, errno: %d \n", ret);
+		return -ret;
+	}
+	return 0;
+}
+
+/* Queues an operation on the batch, returns its number or a negative errno */
+static int64_t post_op(enum bench_op op, uint32_t size, int imm)
+{
+	struct ibv_send_wr send_wr;
+	struct ibv_sge sge;
+	int64_t ret;
+	sge.addr = (uint64_t) buffer_mr->addr;
+	sge.length = size;
+	sge.lkey = buffer_mr->lkey;
+	bzero(&send_wr, sizeof(send_wr));
+	send_wr.sg_list = &sge;
+	send_wr.num_sge = size ? 1 : 0;
+	switch (op) {
+		case BENCH_WRITE:
+			send_wr.opcode = IBV_WR_RDMA_WRITE;
+			break;
+		case BENCH_READ:
+			send_wr.opcode = IBV_WR_RDMA_READ;
+			break;
+		default:
+			send_wr.opcode = imm ? IBV_WR_SEND_WITH_IMM : IBV_WR_SEND;
+			break;
+	}
+	send_wr.wr.rdma.rkey = remote_attr.stag.remote_stag;
+	send_wr.wr.rdma.remote_addr = remote_attr.address;
+	ret = rdma_post_batch_add(&batch, &send_wr);
+	if (ret < 0)
+		rdma_error("Failed to queue a %s, errno: %ld \n",
+				bench_op_names[op], -ret);
+	return ret;
+}
+
+/* Runs one point of the sweep and prints its CSV line */
+static int run_point(enum bench_op op, uint32_t size, uint32_t depth,
+		uint64_t iters)
+{
+	struct ibv_wc wc[BENCH_POLL_BATCH];
+	uint64_t total = BENCH_WARMUP + iters, posted = 0, completed = 0;
+	uint64_t *posted_at, *latency, start = 0, end = 0, i, j, first;
+	int64_t queued;
+	double elapsed;
+	int n, ret = 0;
+	if (depth >= caps.send_wr) {
+		rdma_error("Depth %u does not fit the %u work requests the device takes, skipped \n",
+				depth, caps.send_wr);
+		return 0;
+	}
+	posted_at = calloc(total, sizeof(uint64_t));
+	latency = calloc(iters, sizeof(uint64_t));
+	if (!posted_at || !latency) {
+		rdma_error("Failed to allocate the latency samples, -ENOMEM\n");
+		free(posted_at);
+		free(latency);
+		return -ENOMEM;
+	}
+	while (completed < total) {
+		while (posted < total && posted - completed < depth) {
+			if (posted == BENCH_WARMUP)
+				start = now_nsec();
+			posted_at[posted] = now_nsec();
+			queued = post_op(op, size, 0);
+			if (queued < 0) {
+				ret = queued;
+				goto out;
+			}
+			posted++;
+		}
+		/* one doorbell for the whole window */
+		ret = rdma_post_batch_flush(&batch);
+		if (ret)
+			goto out;
+		n = ibv_poll_cq(cq, BENCH_POLL_BATCH, wc);
+		if (n < 0) {
+			rdma_error("Failed to poll cq for wc due to %d \n", n);
+			ret = n;
+			goto out;
+		}
+		if (n == 0) {
+			ret = rdma_poller_idle(&poller);
+			if (ret)
+				goto out;
+			continue;
+		}
+		poller.spin_start = 0;
+		end = now_nsec();
+		for (i = 0; i < n; i++) {
+			if (wc[i].status != IBV_WC_SUCCESS) {
+				rdma_error("Work completion (WC) has error status: %s at index %lu",
+						ibv_wc_status_str(wc[i].status), i);
+				ret = -(wc[i].status);
+				goto out;
+			}
+			/* it completes the unsignaled requests before it too */
+			first = completed;
+			completed += rdma_post_batch_complete(&batch, &wc[i]);
+			for (j = first; j < completed; j++)
+				if (j >= BENCH_WARMUP)
+					latency[j - BENCH_WARMUP] = end - posted_at[j];
+		}
+	}
+	elapsed = (end - start) / 1e9;
+	qsort(latency, iters, sizeof(uint64_t), cmp_u64);
+	printf("%s,%u,%u,%u,%lu,%.2f,%.4f,%.3f,%.3f,%.3f\n",
+			bench_op_names[op], size, depth, signal_every, iters,
+			(double) size * iters / elapsed / 1e6,
+			iters / elapsed / 1e6,
+			percentile_usec(latency, iters, 0.50),
+			percentile_usec(latency, iters, 0.99),
+			percentile_usec(latency, iters, 0.999));
+	fflush(stdout);
+out:
+	free(posted_at);
+	free(latency);
+	return ret;
+}
+
+static int run_server(struct sockaddr_in *addr, uint32_t buffer_size)
+{
+	struct rdma_cm_event *cm_event = NULL;
+	struct rdma_conn_param conn_param;
+	struct rdma_buffer_attr attr;
+	struct ibv_wc wc[BENCH_POLL_BATCH];
+	int i, n, done = 0, ret;
+	uint64_t recvs = 0;
+	ret = rdma_create_id(cm_event_channel, &cm_listen_id, NULL, RDMA_PS_TCP);
+	if (ret) {
+		rdma_error("Creating server cm id failed with errno: %d ", -errno);
+		return -errno;
+	}
+	ret = rdma_bind_addr(cm_listen_id, (struct sockaddr*) addr);
+	if (ret) {
+		rdma_error("Failed to bind server address, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = rdma_listen(cm_listen_id, 1);
+	if (ret) {
+		rdma_error("rdma_listen failed to listen on server address, errno: %d ",
+				-errno);
+		return -errno;
+	}
+	fprintf(stderr, "Benchmark server is listening at: %s , port: %d \n",
+			inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+	ret = process_rdma_cm_event(cm_event_channel,
+			RDMA_CM_EVENT_CONNECT_REQUEST, &cm_event);
+	if (ret) {
+		rdma_error("Failed to get cm event, ret = %d \n" , ret);
+		return ret;
+	}
+	cm_id = cm_event->id;
+	rdma_ack_cm_event(cm_event);
+	ret = setup_qp(cm_id);
+	if (ret)
+		return ret;
+	buffer_mr = rdma_buffer_alloc(pd, buffer_size,
+			(IBV_ACCESS_LOCAL_WRITE|
+			 IBV_ACCESS_REMOTE_READ|
+			 IBV_ACCESS_REMOTE_WRITE));
+	if (!buffer_mr) {
+		rdma_error("Failed to allocate the benchmark buffer, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	for (i = 0; i < caps.recv_wr; i++) {
+		ret = post_recv();
+		if (ret)
+			return ret;
+	}
+	attr.address = (uint64_t) buffer_mr->addr;
+	attr.length = buffer_mr->length;
+	attr.stag.local_stag = buffer_mr->rkey;
+	ret = setup_conn_param(cm_id, &conn_param);
+	if (ret)
+		return ret;
+	conn_param.private_data = &attr;
+	conn_param.private_data_len = sizeof(attr);
+	ret = rdma_accept(cm_id, &conn_param);
+	if (ret) {
+		rdma_error("Failed to accept the connection, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = process_rdma_cm_event(cm_event_channel,
+			RDMA_CM_EVENT_ESTABLISHED, &cm_event);
+	if (ret) {
+		rdma_error("Failed to get the cm event, ret = %d \n", ret);
+		return ret;
+	}
+	rdma_ack_cm_event(cm_event);
+	/* WRITE and READ never show up here, SENDs consume receives that we
+	 * give back right away, and a SEND_WITH_IMM ends the run */
+	while (!done) {
+		n = ibv_poll_cq(cq, BENCH_POLL_BATCH, wc);
+		if (n < 0) {
+			rdma_error("Failed to poll cq for wc due to %d \n", n);
+			return n;
+		}
+		if (n == 0) {
+			ret = rdma_poller_idle(&poller);
+			if (ret)
+				return ret;
+			continue;
+		}
+		poller.spin_start = 0;
+		for (i = 0; i < n; i++) {
+			if (wc[i].status != IBV_WC_SUCCESS) {
+				rdma_error("Work completion (WC) has error status: %s at index %d",
+						ibv_wc_status_str(wc[i].status), i);
+				return -(wc[i].status);
+			}
+			if (wc[i].wc_flags & IBV_WC_WITH_IMM) {
+				done = 1;
+				continue;
+			}
+			recvs++;
+			ret = post_recv();
+			if (ret)
+				return ret;
+		}
+	}
+	fprintf(stderr, "Client is done after %lu SENDs \n", recvs);
+	ret = process_rdma_cm_event(cm_event_channel,
+			RDMA_CM_EVENT_DISCONNECTED, &cm_event);
+	if (ret) {
+		rdma_error("Failed to get disconnect event, ret = %d \n", ret);
+		return ret;
+	}
+	rdma_ack_cm_event(cm_event);
+	return 0;
+}
+
+static int connect_client(struct sockaddr_in *addr)
+{
+	struct rdma_cm_event *cm_event = NULL;
+	struct rdma_conn_param conn_param;
+	int ret;
+	ret = rdma_create_id(cm_event_channel, &cm_id, NULL, RDMA_PS_TCP);
+	if (ret) {
+		rdma_error("Creating cm id failed with errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = rdma_resolve_addr(cm_id, NULL, (struct sockaddr*) addr, 2000);
+	if (ret) {
+		rdma_error("Failed to resolve address, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = process_rdma_cm_event(cm_event_channel,
+			RDMA_CM_EVENT_ADDR_RESOLVED, &cm_event);
+	if (ret) {
+		rdma_error("Failed to receive a valid event, ret = %d \n", ret);
+		return ret;
+	}
+	rdma_ack_cm_event(cm_event);
+	ret = rdma_resolve_route(cm_id, 2000);
+	if (ret) {
+		rdma_error("Failed to resolve route, erno: %d \n", -errno);
+		return -errno;
+	}
+	ret = process_rdma_cm_event(cm_event_channel,
+			RDMA_CM_EVENT_ROUTE_RESOLVED, &cm_event);
+	if (ret) {
+		rdma_error("Failed to receive a valid event, ret = %d \n", ret);
+		return ret;
+	}
+	rdma_ack_cm_event(cm_event);
+	ret = setup_qp(cm_id);
+	if (ret)
+		return ret;
+	ret = setup_conn_param(cm_id, &conn_param);
+	if (ret)
+		return ret;
+	ret = rdma_connect(cm_id, &conn_param);
+	if (ret) {
+		rdma_error("Failed to connect to remote host , errno: %d\n", -errno);
+		return -errno;
+	}
+	ret = process_rdma_cm_event(cm_event_channel,
+			RDMA_CM_EVENT_ESTABLISHED, &cm_event);
+	if (ret) {
+		rdma_error("Failed to get cm event, ret = %d \n", ret);
+		return ret;
+	}
+	if (cm_event->param.conn.private_data_len < sizeof(remote_attr)) {
+		rdma_error("The server did not advertise its buffer \n");
+		rdma_ack_cm_event(cm_event);
+		return -EINVAL;
+	}
+	memcpy(&remote_attr, cm_event->param.conn.private_data,
+			sizeof(remote_attr));
+	rdma_ack_cm_event(cm_event);
+	return 0;
+}
+
+static int run_client(struct sockaddr_in *addr, uint32_t buffer_size,
+		int ops, uint32_t min_size, uint32_t max_size,
+		uint32_t *depths, int n_depths, uint64_t iters)
+{
+	struct rdma_cm_event *cm_event = NULL;
+	struct ibv_wc wc;
+	uint64_t point_iters;
+	uint32_t size;
+	int op, d, ret;
+	ret = connect_client(addr);
+	if (ret)
+		return ret;
+	if (max_size > remote_attr.length || max_size > buffer_size) {
+		rdma_error("Messages of %u bytes do not fit the buffers (local %u, remote %u) \n",
+				max_size, buffer_size, remote_attr.length);
+		return -EINVAL;
+	}
+	buffer_mr = rdma_buffer_alloc(pd, buffer_size, IBV_ACCESS_LOCAL_WRITE);
+	if (!buffer_mr) {
+		rdma_error("Failed to allocate the benchmark buffer, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	rdma_post_batch_init(&batch, qp, signal_every);
+	printf("opcode,size,depth,signal,iters,bw_MBps,msg_rate_Mops,lat_p50_us,lat_p99_us,lat_p999_us\n");
+	for (op = 0; op < BENCH_OPS; op++) {
+		if (!(ops & (1 << op)))
+			continue;
+		for (d = 0; d < n_depths; d++) {
+			for (size = min_size; size && size <= max_size; size *= 2) {
+				point_iters = iters;
+				if ((uint64_t) size * iters > BENCH_POINT_BYTES)
+					point_iters = BENCH_POINT_BYTES / size;
+				if (point_iters < 100)
+					point_iters = iters < 100 ? iters : 100;
+				ret = run_point(op, size, depths[d], point_iters);
+				if (ret)
+					return ret;
+			}
+		}
+	}
+	/* tell the server we are done */
+	ret = post_op(BENCH_SEND, 0, 1) < 0 ? -EIO : rdma_post_batch_flush(&batch);
+	if (!ret)
+		ret = rdma_poller_wait(&poller, &wc, 1) == 1 ? 0 : -EIO;
+	if (ret)
+		return ret;
+	ret = rdma_disconnect(cm_id);
+	if (ret) {
+		rdma_error("Failed to disconnect, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = process_rdma_cm_event(cm_event_channel,
+			RDMA_CM_EVENT_DISCONNECTED, &cm_event);
+	if (ret) {
+		rdma_error("Failed to get RDMA_CM_EVENT_DISCONNECTED event, ret = %d\n",
+				ret);
+		return ret;
+	}
+	rdma_ack_cm_event(cm_event);
+	return 0;
+}
+
+static void cleanup()
+{
+	if (qp)
+		rdma_destroy_qp(cm_id);
+	if (buffer_mr)
+		rdma_buffer_free(buffer_mr);
+	if (cq)
+		ibv_destroy_cq(cq);
+	if (io_completion_channel)
+		ibv_destroy_comp_channel(io_completion_channel);
+	if (pd)
+		ibv_dealloc_pd(pd);
+	if (cm_id)
+		rdma_destroy_id(cm_id);
+	if (cm_listen_id)
+		rdma_destroy_id(cm_listen_id);
+	rdma_destroy_event_channel(cm_event_channel);
+}
+
+/* Parses a comma separated list of opcodes into a bit mask */
+static int parse_ops(char *arg)
+{
+	char *name;
+	int op, ops = 0;
+	for (name = strtok(arg, ","); name; name = strtok(NULL, ",")) {
+		for (op = 0; op < BENCH_OPS; op++)
+			if (!strcmp(name, bench_op_names[op]))
+				break;
+		if (op == BENCH_OPS)
+			return 0;
+		ops |= 1 << op;
+	}
+	return ops;
+}
+
+/* Parses a comma separated list of queue depths */
+static int parse_depths(char *arg, uint32_t *depths, int max)
+{
+	char *value;
+	int n = 0;
+	for (value = strtok(arg, ","); value && n < max; value = strtok(NULL, ",")) {
+		depths[n] = strtoul(value, NULL, 0);
+		if (depths[n] < 1 || depths[n] > BENCH_MAX_DEPTH)
+			return 0;
+		n++;
+	}
+	return n;
+}
+
+void usage()
+{
+	printf("Usage:\n");
+	printf("rdma_bench: [-a <server_addr>] [-p <port>] [-m <buffer_bytes>] [-P <poll_mode>]\n");
+	printf("            [-o <ops>] [-s <min>:<max>] [-d <depths>] [-n <iters>] [-u <n>] [-H <pages>]\n");
+	printf("Runs the server without -a and the client with it, the client prints CSV.\n");
+	printf("-m size of the buffer on both sides (default %d)\n", BENCH_MAX_SIZE);
+	printf("-P blocking, busy (default) or adaptive[:spin_usec]\n");
+	printf("-o opcodes, any of write,read,send (default all)\n");
+	printf("-s message sizes, powers of two from min to max (default 8:%d)\n",
+			BENCH_MAX_SIZE);
+	printf("-d queue depths, up to %d (default 1,16,64)\n", BENCH_MAX_DEPTH);
+	printf("-n measured operations per point (default %d, fewer for large messages)\n",
+			BENCH_ITERS);
+	printf("-u signals one request out of n (default 1, all of them)\n");
+	printf("-H puts the buffer on huge pages: none (default), 2m or 1g\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in sockaddr;
+	uint32_t buffer_size = BENCH_MAX_SIZE, min_size = 8, max_size = BENCH_MAX_SIZE;
+	uint32_t depths[16] = { 1, 16, 64 };
+	int n_depths = 3, ops = (1 << BENCH_OPS) - 1, client = 0;
+	uint64_t iters = BENCH_ITERS;
+	enum rdma_huge_pages huge = RDMA_HUGE_NONE;
+	char *sep;
+	int ret, option;
+	bzero(&sockaddr, sizeof sockaddr);
+	sockaddr.sin_family = AF_INET;
+	sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	while ((option = getopt(argc, argv, "a:p:m:P:o:s:d:n:u:H:")) != -1) {
+		switch (option) {
+			case 'a':
+				ret = get_addr(optarg, (struct sockaddr*) &sockaddr);
+				if (ret) {
+					rdma_error("Invalid IP \n");
+					return ret;
+				}
+				client = 1;
+				break;
+			case 'p':
+				sockaddr.sin_port = htons(strtol(optarg, NULL, 0));
+				break;
+			case 'm':
+				buffer_size = strtoul(optarg, NULL, 0);
+				break;
+			case 'P':
+				if (rdma_poll_mode_parse(optarg, &poll_mode, &spin_usec))
+					usage();
+				break;
+			case 'o':
+				ops = parse_ops(optarg);
+				if (!ops)
+					usage();
+				break;
+			case 's':
+				min_size = strtoul(optarg, &sep, 0);
+				max_size = *sep == ':' ? strtoul(sep + 1, NULL, 0) : min_size;
+				if (!min_size || min_size > max_size)
+					usage();
+				break;
+			case 'd':
+				n_depths = parse_depths(optarg, depths, 16);
+				if (!n_depths)
+					usage();
+				break;
+			case 'n':
+				iters = strtoul(optarg, NULL, 0);
+				if (!iters)
+					usage();
+				break;
+			case 'u':
+				signal_every = strtoul(optarg, NULL, 0);
+				if (!signal_every || signal_every > BENCH_MAX_DEPTH)
+					usage();
+				break;
+			case 'H':
+				if (rdma_huge_pages_parse(optarg, &huge))
+					usage();
+				break;
+			default:
+				usage();
+				break;
+		}
+	}
+	if (!sockaddr.sin_port)
+		sockaddr.sin_port = htons(DEFAULT_RDMA_PORT);
+	if (max_size > buffer_size)
+		buffer_size = max_size;
+	rdma_buffer_set_huge_pages(huge);
+	cm_event_channel = rdma_create_event_channel();
+	if (!cm_event_channel) {
+		rdma_error("Creating cm event channel failed with errno : (%d)", -errno);
+		return -errno;
+	}
+	if (client)
+		ret = run_client(&sockaddr, buffer_size, ops, min_size, max_size,
+				depths, n_depths, iters);
+	else
+		ret = run_server(&sockaddr, buffer_size);
+	if (ret)
+		rdma_error("Benchmark failed, ret = %d \n", ret);
+	cleanup();
+	return ret;
+}
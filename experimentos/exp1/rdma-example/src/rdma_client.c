@@ -3,8 +3,15 @@
  * Modified by				 			Claudinei Aparecido
  */
 #include <unistd.h>
-#include "rdma_common.h"
+#include <time.h>
+#include "rdma_conn.h"
+#include "rdma_ring.h"
+#include "rdma_rpc.h"
 
+/* Inline data asked for when creating the QP, the device may give less */
+#define CHAT_INLINE_WANTED (256)
+/* Payload of the echo requests of -r */
+#define RPC_BENCH_SIZE (32)
 
 /* These are basic RDMA resources */
 /* These are RDMA connection related resources */
@@ -12,24 +19,36 @@
 // Estrutura usado para receber eventos 
 static struct rdma_event_channel *cm_event_channel = NULL;
 
-// cm_client_id = rdma_create_id() -> Ib, IWARP ou RoCE vai atribuir um identificador para cada conexão
-static struct rdma_cm_id *cm_client_id = NULL;
 static struct ibv_pd *pd = NULL;
-static struct ibv_comp_channel *io_completion_channel = NULL;
-static struct ibv_cq *client_cq = NULL;
-static struct ibv_qp_init_attr qp_init_attr;
-static struct ibv_qp *client_qp;
+/* The connection: its id, QP and CQ, and the queue sizes the device gave us.
+ * Its id is rdma_create_id() -> Ib, IWARP ou RoCE vai atribuir um
+ * identificador para cada conexão */
+static struct rdma_conn conn;
+/* How we wait for the work completions of the connection, see -P */
+static enum rdma_poll_mode poll_mode = RDMA_POLL_BLOCKING;
+static uint32_t spin_usec = DEFAULT_SPIN_USEC;
+/* Chat messages too long to go inline are sent from here, registered on first use */
+static char chat_buf[DEFAULT_BUFF_SIZE];
+static struct ibv_mr *chat_mr = NULL;
 /* These are memory buffers related resources */
 static struct ibv_mr *client_metadata_mr = NULL, 
 		     *client_src_mr = NULL, 
 		     *client_dst_mr = NULL, 
 		     *server_metadata_mr = NULL;
 static struct rdma_buffer_attr client_metadata_attr, server_metadata_attr;
-static struct ibv_send_wr client_send_wr, *bad_client_send_wr = NULL;
-static struct ibv_recv_wr server_recv_wr, *bad_server_recv_wr = NULL;
-static struct ibv_sge client_send_sge, server_recv_sge;
+/* Handles of the operations of the metadata exchange and of the remote
+ * memory ops, complete once their work completion is in */
+static struct rdma_op client_send_op, server_recv_op, write_op, read_op;
 /* Source and Destination buffers, where RDMA operations source and sink */
 static char *src = NULL, *dst = NULL; 
+/* src and dst are registered through the cache, repeated transfers reuse them */
+static struct rdma_mr_cache mr_cache;
+/* Ring buffer channel used to stream stdin with -R, capacity 0 means disabled */
+static struct rdma_ring ring;
+static uint32_t ring_capacity = 0;
+/* RPC endpoint of -r, and how many echo requests to make, 0 means disabled */
+static struct rdma_rpc rpc;
+static uint64_t rpc_calls = 0;
 
 /* This is our testing function */
 static int check_src_dst() 
@@ -40,7 +59,7 @@ static int check_src_dst()
 /* This function prepares client side connection resources for an RDMA connection */
 static int client_prepare_connection(struct sockaddr_in *s_addr)
 {
-	struct rdma_cm_event *cm_event = NULL;
+	struct rdma_conn_attr attr;
 	int ret = -1;
 	
 	// Cria um canal de eventos (é retornado uma struct rdma_event_channel)
@@ -52,70 +71,13 @@ static int client_prepare_connection(struct sockaddr_in *s_addr)
 	}
 
 	debug("Canal de eventos criado: %p \n", cm_event_channel);
-	
-	// Cria o rdma id, usado para identificar a conexão RDMA
-	ret = rdma_create_id(cm_event_channel, &cm_client_id, 
-			NULL,
-			RDMA_PS_TCP);
 
+	/* Creates the id and resolves the address and the route to the server,
+	 * the id is then bound to the local device that reaches it. */
+	ret = rdma_conn_resolve(cm_event_channel, (struct sockaddr*) s_addr, 2000,
+			&conn.cm_id);
 	if (ret) 
-	{
-		rdma_error("Erro ao criar RDMA_ID: %d \n", -errno); 
-		return -errno;
-	}
-
-	/* Resolve destination and optional source addresses from IP addresses  to
-	 * an RDMA address.  If successful, the specified rdma_cm_id will be bound
-	 * to a local device. */
-	ret = rdma_resolve_addr(cm_client_id, NULL, (struct sockaddr*) s_addr, 2000);
-	if (ret) {
-		rdma_error("Failed to resolve address, errno: %d \n", -errno);
-		return -errno;
-	}
-
-	debug("waiting for cm event: RDMA_CM_EVENT_ADDR_RESOLVED\n");
-	/*
-		O cliente começa a comunicação com o servidor, seta seu próprio canal de eventos
-		e aguarda a resposta do server (que vai vim no canal de eventos a informacao
-		que ele enviou alguma coisa), e passa tbm, o tipo esperado (RDMA_CM_EVENT_ADDR_RESOLVED)
-	*/
-	ret  = process_rdma_cm_event(cm_event_channel, 
-			RDMA_CM_EVENT_ADDR_RESOLVED,
-			&cm_event);
-
-	if (ret) {
-		rdma_error("Failed to receive a valid event, ret = %d \n", ret);
 		return ret;
-	}
-	// Da um ack no evento significa dar um free e 
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret) {
-		rdma_error("Failed to acknowledge the CM event, errno: %d\n", -errno);
-		return -errno;
-	}
-	debug("RDMA address is resolved \n");
-
-	// Estabelece uma rota RDMA (pesquisar), antes do rmda_connect
-	ret = rdma_resolve_route(cm_client_id, 2000);
-
-	if (ret) {
-		rdma_error("Failed to resolve route, erno: %d \n", -errno);
-	       return -errno;
-	}
-	debug("waiting for cm event: RDMA_CM_EVENT_ROUTE_RESOLVED\n");
-	ret = process_rdma_cm_event(cm_event_channel, 
-			RDMA_CM_EVENT_ROUTE_RESOLVED,
-			&cm_event);
-	if (ret) {
-		rdma_error("Failed to receive a valid event, ret = %d \n", ret);
-		return ret;
-	}
-	/* we ack the event */
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret) {
-		rdma_error("Failed to acknowledge the CM event, errno: %d \n", -errno);
-		return -errno;
-	}
 	printf("Trying to connect to server at : %s port: %d \n", 
 			inet_ntoa(s_addr->sin_addr),
 			ntohs(s_addr->sin_port));
@@ -125,75 +87,30 @@ static int client_prepare_connection(struct sockaddr_in *s_addr)
 	 */
 	// ibv_alloc_pd aloca um espaco de memoria para PD
 	// equvilante ao espaco de memoria que cada processo recebe o OS
-	pd = ibv_alloc_pd(cm_client_id->verbs);
+	pd = ibv_alloc_pd(conn.cm_id->verbs);
 
 	if (!pd) {
 		rdma_error("Failed to alloc pd, errno: %d \n", -errno);
 		return -errno;
 	}
 	debug("pd allocated at %p \n", pd);
-	/* Now we need a completion channel, were the I/O completion 
-	 * notifications are sent. Remember, this is different from connection 
-	 * management (CM) event notifications. 
-	 * A completion channel is also tied to an RDMA device, hence we will 
-	 * use cm_client_id->verbs. 
-	 */
-	// Cria uma Completion Event Channel
-	// Uma CQ vai avisar quando tiver uma WR pronta armazenada na
-	// Completion Queue
-	io_completion_channel = ibv_create_comp_channel(cm_client_id->verbs);
-	if (!io_completion_channel) {
-		rdma_error("Failed to create IO completion event channel, errno: %d\n",
-			       -errno);
-	return -errno;
-	}
-	debug("completion event channel created at : %p \n", io_completion_channel);
-	/* Now we create a completion queue (CQ) where actual I/O 
-	 * completion metadata is placed. The metadata is packed into a structure 
-	 * called struct ibv_wc (wc = work completion). ibv_wc has detailed 
-	 * information about the work completion. An I/O request in RDMA world 
-	 * is called "work" ;) 
-	 */
-	client_cq = ibv_create_cq(cm_client_id->verbs /* which device*/, 
-			CQ_CAPACITY /* maximum capacity*/, 
-			NULL /* user context, not used here */,
-			io_completion_channel /* which IO completion channel */, 
-			0 /* signaling vector, not used here*/);
-	if (!client_cq) {
-		rdma_error("Failed to create CQ, errno: %d \n", -errno);
-		return -errno;
-	}
-	debug("CQ created at %p with %d elements \n", client_cq, client_cq->cqe);
-	// Arma o mecanismo que notifica quando tem QE (queue entry) novo
-	ret = ibv_req_notify_cq(client_cq, 0);
-	if (ret) {
-		rdma_error("Failed to request notifications, errno: %d\n", -errno);
-		return -errno;
-	}
-
-       /* Now the last step, set up the queue pair (send, recv) queues and their capacity.
-         * The capacity here is define statically but this can be probed from the 
-	 * device. We just use a small number as defined in rdma_common.h */
-       bzero(&qp_init_attr, sizeof qp_init_attr);
-       qp_init_attr.cap.max_recv_sge = MAX_SGE; /* Maximum SGE per receive posting */
-	   qp_init_attr.cap.max_recv_wr = MAX_WR; /* Maximum receive posting capacity */
-	   qp_init_attr.cap.max_send_sge = MAX_SGE; /* Maximum SGE per send posting */
-       qp_init_attr.cap.max_send_wr = MAX_WR; /* Maximum send posting capacity */
-       qp_init_attr.qp_type = IBV_QPT_RC; /* QP type, RC = Reliable connection */
-       /* We use same completion queue, but one can use different queues */
-       qp_init_attr.recv_cq = client_cq; /* Where should I notify for receive completion operations */
-       qp_init_attr.send_cq = client_cq; /* Where should I notify for send completion operations */
-       /*Lets create a QP */
-		// Cria um Queue Pair (é equivalente a socket na comunicação tradicional)
-	   	ret = rdma_create_qp(cm_client_id /* which connection id */,
-		       pd /* which protection domain*/,
-		       &qp_init_attr /* Initial attributes */);
-	if (ret) {
-		rdma_error("Failed to create QP, errno: %d \n", -errno);
-	       return -errno;
+	rdma_mr_cache_init(&mr_cache, pd, RDMA_MR_CACHE_DEFAULT_BUDGET);
+	/* The connection gets a completion channel, a CQ on it and the QP, with
+	 * the queues probed from the device. With -r every request and every
+	 * response may be in flight at once, and the chat messages go inline. */
+	bzero(&attr, sizeof(attr));
+	attr.wr = rpc_calls ? RDMA_RPC_DEFAULT_DEPTH + 1 : DEFAULT_QUEUE_DEPTH;
+	attr.max_inline = CHAT_INLINE_WANTED;
+	attr.poll_mode = poll_mode;
+	attr.spin_usec = spin_usec;
+	ret = rdma_conn_init(&conn, conn.cm_id, pd, &attr);
+	if (ret)
+		return ret;
+	if (rpc_calls && conn.caps.send_wr < RDMA_RPC_DEFAULT_DEPTH + 1) {
+		rdma_error("The device only takes %u work requests per queue \n",
+				conn.caps.send_wr);
+		return -EINVAL;
 	}
-	client_qp = cm_client_id->qp;
-	debug("QP created at %p \n", client_qp);
 	return 0;
 }
 
@@ -209,20 +126,10 @@ static int client_pre_post_recv_buffer()
 		rdma_error("Failed to setup the server metadata mr , -ENOMEM\n");
 		return -ENOMEM;
 	}
-	server_recv_sge.addr = (uint64_t) server_metadata_mr->addr;
-	server_recv_sge.length = (uint32_t) server_metadata_mr->length;
-	server_recv_sge.lkey = (uint32_t) server_metadata_mr->lkey;
-	/* now we link it to the request */
-	bzero(&server_recv_wr, sizeof(server_recv_wr));
-	server_recv_wr.sg_list = &server_recv_sge;
-	server_recv_wr.num_sge = 1;
-	ret = ibv_post_recv(client_qp /* which QP */,
-		      &server_recv_wr /* receive work request*/,
-		      &bad_server_recv_wr /* error WRs */);
-	if (ret) {
-		rdma_error("Failed to pre-post the receive buffer, errno: %d \n", ret);
+	ret = rdma_conn_recv(&conn, &server_recv_op, server_metadata_mr,
+			&server_metadata_attr, sizeof(server_metadata_attr));
+	if (ret)
 		return ret;
-	}
 	debug("Receive buffer pre-posting is successful \n");
 	return 0;
 }
@@ -231,31 +138,15 @@ static int client_pre_post_recv_buffer()
 static int client_connect_to_server() 
 {
 	struct rdma_conn_param conn_param;
-	struct rdma_cm_event *cm_event = NULL;
 	int ret = -1;
 	bzero(&conn_param, sizeof(conn_param));
-	conn_param.initiator_depth = 3;
-	conn_param.responder_resources = 3;
+	/* the READ depths are left to the connection, as many as the device allows */
 	conn_param.retry_count = 3; // if fail, then how many times to retry
-	ret = rdma_connect(cm_client_id, &conn_param);
-	if (ret) {
-		rdma_error("Failed to connect to remote host , errno: %d\n", -errno);
-		return -errno;
-	}
-	debug("waiting for cm event: RDMA_CM_EVENT_ESTABLISHED\n");
-	ret = process_rdma_cm_event(cm_event_channel, 
-			RDMA_CM_EVENT_ESTABLISHED,
-			&cm_event);
-	if (ret) {
-		rdma_error("Failed to get cm event, ret = %d \n", ret);
-	       return ret;
-	}
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret) {
-		rdma_error("Failed to acknowledge cm event, errno: %d\n", 
-			       -errno);
-		return -errno;
-	}
+	/* ring writes may reach the server before it posted the receives, keep retrying */
+	conn_param.rnr_retry_count = 7;
+	ret = rdma_conn_connect(&conn, cm_event_channel, &conn_param);
+	if (ret)
+		return ret;
 	printf("The client is connected successfully \n");
 	return 0;
 }
@@ -268,9 +159,24 @@ static int client_connect_to_server()
 static int client_xchange_metadata_with_server()
 {
 	/* SLOW DATA PATH*/
-	struct ibv_wc wc[2];
 	int ret = -1;
-	client_src_mr = rdma_buffer_register(pd,
+	if (ring_capacity) {
+		/* The server allocates a ring of the advertised length and writes 
+		 * the credits back to the advertised address */
+		ret = rdma_ring_sender_alloc(&ring, pd, ring_capacity, 
+				&client_metadata_attr);
+		if (ret) {
+			rdma_error("Failed to allocate the ring, ret = %d \n", ret);
+			return ret;
+		}
+		goto register_metadata;
+	}
+	if (rpc_calls) {
+		/* The server only needs a buffer, the requests bring their data */
+		client_metadata_attr.length = RDMA_RPC_DEFAULT_MSG_SIZE;
+		goto register_metadata;
+	}
+	client_src_mr = rdma_mr_cache_get(&mr_cache,
 			src,
 			strlen(src),
 			(IBV_ACCESS_LOCAL_WRITE|
@@ -285,6 +191,7 @@ static int client_xchange_metadata_with_server()
 	client_metadata_attr.address = (uint64_t) client_src_mr->addr; 
 	client_metadata_attr.length = client_src_mr->length; 
 	client_metadata_attr.stag.local_stag = client_src_mr->lkey;
+register_metadata:
 	/* now we register the metadata memory */
 	client_metadata_mr = rdma_buffer_register(pd,
 			&client_metadata_attr,
@@ -294,39 +201,112 @@ static int client_xchange_metadata_with_server()
 		rdma_error("Failed to register the client metadata buffer, ret = %d \n", ret);
 		return ret;
 	}
-	/* now we fill up SGE */
-	client_send_sge.addr = (uint64_t) client_metadata_mr->addr;
-	client_send_sge.length = (uint32_t) client_metadata_mr->length;
-	client_send_sge.lkey = client_metadata_mr->lkey;
-	/* now we link to the send work request */
-	bzero(&client_send_wr, sizeof(client_send_wr));
-	client_send_wr.sg_list = &client_send_sge;
-	client_send_wr.num_sge = 1;
-	client_send_wr.opcode = IBV_WR_SEND;
-	client_send_wr.send_flags = IBV_SEND_SIGNALED;
 	/* Now we post it */
 	printf("I am posting data!\n");
-	ret = ibv_post_send(client_qp, 
-		    &client_send_wr,
-	    &bad_client_send_wr);
+	ret = rdma_conn_send(&conn, &client_send_op, client_metadata_mr,
+			&client_metadata_attr, sizeof(client_metadata_attr));
 	if (ret) {
-		rdma_error("Failed to send client metadata, errno: %d \n", 
-				-errno);
-		return -errno;
+		rdma_error("Failed to send client metadata, ret = %d \n", ret);
+		return ret;
 	}
 	/* at this point we are expecting 2 work completion. One for our 
 	* send and one for recv that we will get from the server for 
 	* its buffer information */
 	printf("Waiting for work completions\n");
-	ret = process_work_completion_events(io_completion_channel, 
-			wc, 2);
-	if(ret != 2) {
+	ret = rdma_conn_wait(&conn, &client_send_op);
+	if (!ret)
+		ret = rdma_conn_wait(&conn, &server_recv_op);
+	if (ret) {
 		rdma_error("We failed to get 2 work completions , ret = %d \n",
 				ret);
 		return ret;
 	}
 	debug("Server sent us its buffer location and credentials, showing \n");
 	show_rdma_buffer_attr(&server_metadata_attr);
+	if (ring_capacity)
+		return rdma_ring_sender_start(&ring, conn.qp, conn.cq, 
+				&server_metadata_attr,
+				conn.caps.send_wr < RDMA_RING_RECV_DEPTH ? conn.caps.send_wr : RDMA_RING_RECV_DEPTH);
+	return 0;
+}
+
+/* Streams stdin to the server through the ring, one record per line. An 
+ * empty record tells the server that the stream is over.
+ */
+static int client_stream_ring()
+{
+	char *line = NULL;
+	size_t line_capacity = 0;
+	ssize_t length;
+	int ret = 0;
+	while (!ret && (length = getline(&line, &line_capacity, stdin)) > 0)
+		ret = rdma_ring_write(&ring, line, length);
+	free(line);
+	if (!ret)
+		ret = rdma_ring_write(&ring, NULL, 0);
+	if (!ret)
+		ret = rdma_ring_drain(&ring);
+	if (ret) {
+		rdma_error("Failed to stream to the server, ret = %d \n", ret);
+		return ret;
+	}
+	debug("Stream of %lu bytes is complete \n", ring.tail);
+	return 0;
+}
+
+/* Completion of an echo request, counts it */
+static void client_rpc_done(void *arg, int status, const void *resp,
+		uint32_t resp_length)
+{
+	uint64_t *done = arg;
+	if (status || resp_length != RPC_BENCH_SIZE)
+		rdma_error("Echo request failed, status %d, %u bytes back \n",
+				status, resp_length);
+	(*done)++;
+}
+
+/* Makes rpc_calls echo requests with as many of them in flight as the RPC
+ * depth allows, and reports the rate */
+static int client_rpc_bench()
+{
+	char payload[RPC_BENCH_SIZE];
+	struct timespec start, end;
+	uint64_t issued = 0, done = 0;
+	double elapsed;
+	int ret;
+	ret = rdma_rpc_init(&rpc, pd, conn.qp, &conn.poller, RDMA_RPC_DEFAULT_DEPTH,
+			RDMA_RPC_DEFAULT_MSG_SIZE, conn.max_inline, 0);
+	if (ret) {
+		rdma_error("Failed to setup the RPC endpoint, ret = %d \n", ret);
+		return ret;
+	}
+	memset(payload, 'r', sizeof(payload));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (done < rpc_calls) {
+		/* fill the window, the requests go out together on the next poll */
+		while (issued < rpc_calls) {
+			ret = rdma_rpc_call(&rpc, RDMA_RPC_ECHO, payload, sizeof(payload),
+					client_rpc_done, &done, NULL);
+			if (ret == -EAGAIN)
+				break;
+			if (ret) {
+				rdma_error("Failed to issue an RPC, ret = %d \n", ret);
+				return ret;
+			}
+			issued++;
+		}
+		ret = rdma_rpc_wait(&rpc);
+		if (ret < 0) {
+			rdma_error("Failed to wait for the RPC responses, ret = %d \n", ret);
+			return ret;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("RPC: %lu echo requests of %d bytes in %.3f s, %.3f Mops, %d in flight, %lu doorbells \n",
+			done, RPC_BENCH_SIZE, elapsed,
+			elapsed > 0 ? done / elapsed / 1e6 : 0.0,
+			RDMA_RPC_DEFAULT_DEPTH, rpc.batch.posts);
 	return 0;
 }
 
@@ -337,12 +317,11 @@ static int client_xchange_metadata_with_server()
  */ 
 static int client_remote_memory_ops() 
 {
-	struct ibv_wc wc;
 	int ret = -1;
 	/* Creating a memory region that is associated with the Protection Domain
 		rdma_buffer_register encapsulates the ibv_reg_mr function
 	*/
-	client_dst_mr = rdma_buffer_register(pd,
+	client_dst_mr = rdma_mr_cache_get(&mr_cache,
 			dst,
 			strlen(src),
 			(IBV_ACCESS_LOCAL_WRITE | 
@@ -352,69 +331,43 @@ static int client_remote_memory_ops()
 		rdma_error("We failed to create the destination buffer, -ENOMEM\n");
 		return -ENOMEM;
 	}
-	/* Step 1: is to copy the local buffer into the remote buffer. We will 
-	 * reuse the previous variables. */
-	/* now we fill up SGE */
-	client_send_sge.addr = (uint64_t) client_src_mr->addr;
-	client_send_sge.length = (uint32_t) client_src_mr->length;
-	client_send_sge.lkey = client_src_mr->lkey;
-	/* now we link to the send work request */
-	bzero(&client_send_wr, sizeof(client_send_wr));
-	client_send_wr.sg_list = &client_send_sge;
-	client_send_wr.num_sge = 1;
-	client_send_wr.opcode = IBV_WR_RDMA_WRITE;
-	client_send_wr.send_flags = IBV_SEND_SIGNALED;
-	/* we have to tell server side info for RDMA */
-	client_send_wr.wr.rdma.rkey = server_metadata_attr.stag.remote_stag;
-	client_send_wr.wr.rdma.remote_addr = server_metadata_attr.address;
-	/* Now we post it */
-	ret = ibv_post_send(client_qp, 
-		       &client_send_wr,
-	       &bad_client_send_wr);
+	/* Step 1: is to copy the local buffer into the remote buffer, step 2 to 
+	 * read it back into the destination. Both are queued on the connection 
+	 * and go out with one doorbell. The QP executes them in order, so the 
+	 * READ sees the WRITE. */
+	ret = rdma_conn_write(&conn, &write_op, client_src_mr, client_src_mr->addr,
+			client_src_mr->length, server_metadata_attr.address,
+			server_metadata_attr.stag.remote_stag);
 	if (ret) {
-		rdma_error("Failed to write client src buffer, errno: %d \n", 
-				-errno);
-		return -errno;
+		rdma_error("Failed to queue the write of the client src buffer \n");
+		return ret;
 	}
-	/* at this point we are expecting 1 work completion for the write */
-	ret = process_work_completion_events(io_completion_channel, 
-			&wc, 1);
-	if(ret != 1) {
-		rdma_error("We failed to get 1 work completions , ret = %d \n",
-				ret);
+	ret = rdma_conn_read(&conn, &read_op, client_dst_mr, client_dst_mr->addr,
+			client_dst_mr->length, server_metadata_attr.address,
+			server_metadata_attr.stag.remote_stag);
+	if (ret) {
+		rdma_error("Failed to queue the read of the client dst buffer \n");
 		return ret;
 	}
-	debug("Client side WRITE is complete \n");
-	/* Now we prepare a READ using same variables but for destination */
-	client_send_sge.addr = (uint64_t) client_dst_mr->addr;
-	client_send_sge.length = (uint32_t) client_dst_mr->length;
-	client_send_sge.lkey = client_dst_mr->lkey;
-	/* now we link to the send work request */
-	bzero(&client_send_wr, sizeof(client_send_wr));
-	client_send_wr.sg_list = &client_send_sge;
-	client_send_wr.num_sge = 1;
-	client_send_wr.opcode = IBV_WR_RDMA_READ;
-	client_send_wr.send_flags = IBV_SEND_SIGNALED;
-	/* we have to tell server side info for RDMA */
-	client_send_wr.wr.rdma.rkey = server_metadata_attr.stag.remote_stag;
-	client_send_wr.wr.rdma.remote_addr = server_metadata_attr.address;
-	/* Now we post it */
-	ret = ibv_post_send(client_qp, 
-		       &client_send_wr,
-	       &bad_client_send_wr);
+	/* Now we post both */
+	ret = rdma_conn_flush(&conn);
 	if (ret) {
-		rdma_error("Failed to read client dst buffer from the master, errno: %d \n", 
-				-errno);
-		return -errno;
+		rdma_error("Failed to post the write and read, errno: %d \n", 
+				ret);
+		return ret;
 	}
-	/* at this point we are expecting 1 work completion for the write */
-	ret = process_work_completion_events(io_completion_channel, 
-			&wc, 1);
-	if(ret != 1) {
-		rdma_error("We failed to get 1 work completions , ret = %d \n",
+	/* the write completes first, waiting for the read reaps both */
+	ret = rdma_conn_wait(&conn, &read_op);
+	if (ret) {
+		rdma_error("We failed to get 2 work completions , ret = %d \n",
 				ret);
 		return ret;
 	}
+	if (!rdma_op_done(&write_op) || write_op.status != IBV_WC_SUCCESS) {
+		rdma_error("The read completed before the write \n");
+		return -EIO;
+	}
+	debug("Client side WRITE is complete \n");
 	debug("Client side READ is complete \n");
 	return 0;
 }
@@ -424,53 +377,32 @@ static int client_remote_memory_ops()
  */
 static int client_disconnect_and_clean()
 {
-	struct rdma_cm_event *cm_event = NULL;
 	int ret = -1;
-	/* active disconnect from the client side */
-	ret = rdma_disconnect(cm_client_id);
-	if (ret) {
-		rdma_error("Failed to disconnect, errno: %d \n", -errno);
-		//continuing anyways
-	}
-	ret = process_rdma_cm_event(cm_event_channel, 
-			RDMA_CM_EVENT_DISCONNECTED,
-			&cm_event);
-	if (ret) {
-		rdma_error("Failed to get RDMA_CM_EVENT_DISCONNECTED event, ret = %d\n",
-				ret);
-		//continuing anyways 
-	}
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret) {
-		rdma_error("Failed to acknowledge cm event, errno: %d\n", 
-			       -errno);
-		//continuing anyways
-	}
-	/* Destroy QP */
-	rdma_destroy_qp(cm_client_id);
+	/* active disconnect from the client side, waits for the server */
+	rdma_conn_disconnect(&conn, cm_event_channel);
+	/* Destroy QP, CQ and completion channel */
+	rdma_conn_destroy(&conn);
 	/* Destroy client cm id */
-	ret = rdma_destroy_id(cm_client_id);
+	ret = rdma_destroy_id(conn.cm_id);
 	if (ret) {
 		rdma_error("Failed to destroy client id cleanly, %d \n", -errno);
 		// we continue anyways;
 	}
-	/* Destroy CQ */
-	ret = ibv_destroy_cq(client_cq);
-	if (ret) {
-		rdma_error("Failed to destroy completion queue cleanly, %d \n", -errno);
-		// we continue anyways;
-	}
-	/* Destroy completion channel */
-	ret = ibv_destroy_comp_channel(io_completion_channel);
-	if (ret) {
-		rdma_error("Failed to destroy completion channel cleanly, %d \n", -errno);
-		// we continue anyways;
-	}
 	/* Destroy memory buffers */
 	rdma_buffer_deregister(server_metadata_mr);
 	rdma_buffer_deregister(client_metadata_mr);	
-	rdma_buffer_deregister(client_src_mr);	
-	rdma_buffer_deregister(client_dst_mr);	
+	if (ring_capacity) {
+		rdma_ring_destroy(&ring);
+	} else if (rpc_calls) {
+		rdma_rpc_destroy(&rpc);
+	} else {
+		rdma_mr_cache_put(&mr_cache, client_src_mr);
+		rdma_mr_cache_put(&mr_cache, client_dst_mr);
+	}
+	if (chat_mr)
+		rdma_mr_cache_put(&mr_cache, chat_mr);
+	rdma_mr_cache_stats(&mr_cache);
+	rdma_mr_cache_destroy(&mr_cache);
 	/* We free the buffers */
 	free(src);
 	free(dst);
@@ -485,58 +417,77 @@ static int client_disconnect_and_clean()
 	return 0;
 }
 
+/* Sends every line of stdin to the server until EOF. Lines that fit in the 
+ * inline data of the QP are copied into the WQE by ibv_post_send(), so they 
+ * need no registered memory and the NIC does not have to DMA them; longer 
+ * ones are copied into chat_buf. */
 int test_chat()
 {
-	/*
-		Information needed to send message
-		Memory region
-
-		ibv_post_send(qp, &send_wr, &bad_send_wr)
-		qp -> client_qp
-		ibv_send_wr client_send_wr, *bad_client_send_wr 
-		ibv_recv_wr server_recv_wr, *bad_server_recv_wr 
-		static struct ibv_sge client_send_sge, server_recv_sge;
-	*/
-	while(1)
-	{
-		//Prepare and send WR on the QP. 
-		struct ibv_send_wr send_wr, *bad_send_wr = NULL;
-		struct ibv_sge send_sge;
-		send_sge.addr = 	(uint64_t) client_src_mr->addr; /* addr */
-		send_sge.length = 	client_src_mr->length; /* length */
-		send_sge.lkey = 	client_src_mr->lkey; /* STag */
-		/* wr */
-		send_wr.sg_list = &send_sge;
-		send_wr.num_sge = 1; /* number of SGEs */
-		debug("Sending wr\n")
-		int ret = ibv_post_send(client_qp, &client_send_wr, &bad_client_send_wr);
+	char line[DEFAULT_BUFF_SIZE];
+	struct rdma_op send_op;
+	struct timespec start, end;
+	uint64_t messages[2] = { 0, 0 }, usec[2] = { 0, 0 };
+	uint32_t length;
+	int ret, inl;
+	bzero(&send_op, sizeof(send_op));
+	while (fgets(line, sizeof(line), stdin)) {
+		length = strlen(line);
+		inl = length <= conn.max_inline;
+		/* DMA path, the message must be in registered memory */
+		if (!inl && !chat_mr) {
+			chat_mr = rdma_mr_cache_get(&mr_cache, chat_buf, 
+					sizeof(chat_buf), IBV_ACCESS_LOCAL_WRITE);
+			if (!chat_mr) {
+				rdma_error("Failed to register the chat buffer, -ENOMEM\n");
+				return -ENOMEM;
+			}
+		}
+		if (!inl)
+			memcpy(chat_buf, line, length);
+		debug("Sending %u bytes %s \n", length, inl ? "inline" : "with DMA");
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		/* the connection sends inline what fits, the mr is not looked at then */
+		ret = rdma_conn_send(&conn, &send_op, chat_mr, inl ? line : chat_buf,
+				length);
 		if (ret) {
-			rdma_error("Failed to send the message!\n");
+			rdma_error("Failed to send the message, ret = %d \n", ret);
+			return ret;
 		}
-		//******************************************** */
-		/*
-		static struct ibv_comp_channel *io_completion_channel = NULL;
-		static struct ibv_cq *client_cq = NULL;
-		*/
-		//Wait for completion of WR we just posted
-		struct ibv_wc wc;
-		debug("Waiting for response\n");
-		ret = ibv_get_cq_event(io_completion_channel, &client_cq, NULL);
-		ret = ibv_req_notify_cq(client_cq, 0);
-		ret = ibv_poll_cq(client_cq, 1, &wc); /* poll for 1 WC */
-		if (wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND) 
-		{
-			/* ack the event */
-			ibv_ack_cq_events(client_cq, 1); /* 1 event */
-		}	
-	
-	}
-
+		/* Wait for completion of WR we just posted */
+		ret = rdma_conn_wait(&conn, &send_op);
+		if (ret) {
+			rdma_error("We failed to get 1 work completions , ret = %d \n",
+					ret);
+			return ret;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		messages[inl]++;
+		usec[inl] += (end.tv_sec - start.tv_sec) * 1000000UL + 
+			(end.tv_nsec - start.tv_nsec) / 1000;
+	}
+	printf("Chat: %lu inline messages (avg %.1f usec), %lu with DMA (avg %.1f usec), max_inline_data %u \n",
+			messages[1], messages[1] ? (double) usec[1] / messages[1] : 0.0,
+			messages[0], messages[0] ? (double) usec[0] / messages[0] : 0.0,
+			conn.max_inline);
+	return 0;
 }
+
 void usage() {
 	printf("Usage:\n");
-	printf("rdma_client: [-a <server_addr>] [-p <server_port>] -s string (required)\n");
+	printf("rdma_client: [-a <server_addr>] [-p <server_port>] [-P <poll_mode>] -s string (required)\n");
+	printf("rdma_client: [-a <server_addr>] [-p <server_port>] [-P <poll_mode>] -R <ring_bytes>\n");
+	printf("rdma_client: [-a <server_addr>] [-p <server_port>] [-P <poll_mode>] -r <calls>\n");
 	printf("(default IP is 127.0.0.1 and port is %d)\n", DEFAULT_RDMA_PORT);
+	printf("-s copies string to the server and back, then sends it every line of stdin,\n");
+	printf("   inline when the line fits in the max_inline_data of the QP\n");
+	printf("-R streams stdin to the server line by line through a ring buffer\n");
+	printf("   channel of ring_bytes (e.g. %d), the server must run with -R\n", 
+			RDMA_RING_DEFAULT_CAPACITY);
+	printf("-r makes that many echo RPCs, %d in flight, the server must run with -r\n",
+			RDMA_RPC_DEFAULT_DEPTH);
+	printf("-P is how to wait for completions: blocking (default), busy, \n");
+	printf("   or adaptive[:spin_usec] (spins %d usec before blocking)\n", 
+			DEFAULT_SPIN_USEC);
 	exit(1);
 }
 
@@ -549,7 +500,7 @@ int main(int argc, char **argv) {
 	/* buffers are NULL */
 	src = dst = NULL; 
 	/* Parse Command Line Arguments */
-	while ((option = getopt(argc, argv, "s:a:p:")) != -1) {
+	while ((option = getopt(argc, argv, "s:a:p:R:r:P:")) != -1) {
 		switch (option) {
 			case 's':
 				printf("Passed string is : %s , with count %u \n", 
@@ -581,6 +532,20 @@ int main(int argc, char **argv) {
 				/* passed port to listen on */
 				server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0)); 
 				break;
+			case 'R':
+				ring_capacity = strtoul(optarg, NULL, 0);
+				if (!ring_capacity)
+					usage();
+				break;
+			case 'r':
+				rpc_calls = strtoull(optarg, NULL, 0);
+				if (!rpc_calls)
+					usage();
+				break;
+			case 'P':
+				if (rdma_poll_mode_parse(optarg, &poll_mode, &spin_usec))
+					usage();
+				break;
 			default:
 				usage();
 				break;
@@ -590,7 +555,9 @@ int main(int argc, char **argv) {
 	  /* no port provided, use the default port */
 	  server_sockaddr.sin_port = htons(DEFAULT_RDMA_PORT);
 	  }
-	if (src == NULL) {
+	if (ring_capacity && rpc_calls)
+		usage();
+	if (src == NULL && !ring_capacity && !rpc_calls) {
 		printf("Please provide a string to copy \n");
 		usage();
        	}
@@ -614,6 +581,22 @@ int main(int argc, char **argv) {
 		rdma_error("Failed to setup client connection , ret = %d \n", ret);
 		return ret;
 	}
+	if (ring_capacity) {
+		ret = client_stream_ring();
+		if (ret) {
+			rdma_error("Failed to stream through the ring, ret = %d \n", ret);
+			return ret;
+		}
+		return client_disconnect_and_clean();
+	}
+	if (rpc_calls) {
+		ret = client_rpc_bench();
+		if (ret) {
+			rdma_error("Failed to make the RPCs, ret = %d \n", ret);
+			return ret;
+		}
+		return client_disconnect_and_clean();
+	}
 	ret = client_remote_memory_ops();
 	if (ret) {
 		rdma_error("Failed to finish remote memory ops, ret = %d \n", ret);
@@ -625,18 +608,12 @@ int main(int argc, char **argv) {
 		printf("...\nSUCCESS, source and destination buffers match \n");
 	}
 	/* It`s now assumed that the channel is working*/
-	int abc;
-	while(1)
+	ret = test_chat();
+	if (ret)
 	{
-		abc = scanf("%d", &abc);
-		ret = test_chat();
-		if (ret)
-		{
-			printf("something wrong!\n");
-		}
+		printf("something wrong!\n");
 	}
 
-
 	ret = client_disconnect_and_clean();
 	if (ret) {
 		rdma_error("Failed to cleanly disconnect and clean up resources \n");
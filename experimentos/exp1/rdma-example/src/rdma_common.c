@@ -5,8 +5,22 @@
  *          atrivedi@apache.org 
  */
 
+#include <time.h>
+#include <strings.h>
+#include <sys/mman.h>
+
 #include "rdma_common.h"
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
 void show_rdma_cmid(struct rdma_cm_id *id)
 {
 	if(!id){
@@ -37,23 +51,123 @@ void show_rdma_buffer_attr(struct rdma_buffer_attr *attr){
 	printf("---------------------------------------------------------\n");
 }
 
+/* Page size rdma_buffer_alloc() asks for, and the buffers it put on huge pages */
+static enum rdma_huge_pages huge_pages = RDMA_HUGE_NONE;
+struct huge_buffer {
+	void *addr;
+	size_t mapped;
+	struct huge_buffer *next;
+};
+static struct huge_buffer *huge_buffers = NULL;
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void rdma_buffer_set_huge_pages(enum rdma_huge_pages huge)
+{
+	huge_pages = huge;
+}
+
+int rdma_huge_pages_parse(const char *arg, enum rdma_huge_pages *huge)
+{
+	if (!strcmp(arg, "none"))
+		*huge = RDMA_HUGE_NONE;
+	else if (!strcasecmp(arg, "2m"))
+		*huge = RDMA_HUGE_2MB;
+	else if (!strcasecmp(arg, "1g"))
+		*huge = RDMA_HUGE_1GB;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+void *rdma_huge_alloc(size_t length, 
+		enum rdma_huge_pages huge, 
+		size_t *mapped)
+{
+	size_t page = huge == RDMA_HUGE_1GB ? (1UL << 30) : (2UL << 20);
+	size_t thp = 2UL << 20, small = sysconf(_SC_PAGESIZE), size, i;
+	char *buf, *aligned;
+	/* hugetlbfs pages, MAP_POPULATE faults them all in */
+	size = (length + page - 1) & ~(page - 1);
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE |
+			(huge == RDMA_HUGE_1GB ? MAP_HUGE_1GB : MAP_HUGE_2MB), -1, 0);
+	if (buf == MAP_FAILED) {
+		debug("No %s hugetlbfs pages, errno: %d, using transparent huge pages \n",
+				huge == RDMA_HUGE_1GB ? "1 GB" : "2 MB", -errno);
+		/* map one more huge page to cut a 2 MB aligned range out of it, 
+		 * otherwise the first and last pages could not be huge */
+		size = (length + thp - 1) & ~(thp - 1);
+		buf = mmap(NULL, size + thp, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buf == MAP_FAILED) {
+			rdma_error("Failed to map %zu bytes, errno: %d \n", size, -errno);
+			return NULL;
+		}
+		aligned = (char *) (((uintptr_t) buf + thp - 1) & ~(thp - 1));
+		if (aligned != buf)
+			munmap(buf, aligned - buf);
+		if (aligned + size != buf + size + thp)
+			munmap(aligned + size, buf + thp - aligned);
+		buf = aligned;
+		if (madvise(buf, size, MADV_HUGEPAGE))
+			debug("Transparent huge pages are not available, errno: %d \n", -errno);
+		/* fault it in now, with THP one touch gets the whole huge page */
+		for (i = 0; i < size; i += small)
+			buf[i] = 0;
+	}
+	/* the registration pins the pages anyway, locking them up front keeps 
+	 * the kernel from reclaiming or moving them in between */
+	if (mlock(buf, size))
+		debug("Failed to mlock %zu bytes, errno: %d \n", size, -errno);
+	*mapped = size;
+	return buf;
+}
+
+void rdma_huge_free(void *addr, size_t mapped)
+{
+	munmap(addr, mapped);
+}
+
 struct ibv_mr* rdma_buffer_alloc(struct ibv_pd *pd, uint32_t size,
     enum ibv_access_flags permission) 
 {
 	struct ibv_mr *mr = NULL;
+	struct huge_buffer *huge = NULL;
+	void *buf = NULL;
 	if (!pd) {
 		rdma_error("Protection domain is NULL \n");
 		return NULL;
 	}
-	void *buf = calloc(1, size);
+	if (huge_pages != RDMA_HUGE_NONE && size >= RDMA_HUGE_MIN_LENGTH) {
+		huge = calloc(1, sizeof(*huge));
+		if (huge)
+			buf = huge->addr = rdma_huge_alloc(size, huge_pages, &huge->mapped);
+		/* regular pages still work, only slower */
+		if (!buf) {
+			free(huge);
+			huge = NULL;
+		}
+	}
+	if (!buf)
+		buf = calloc(1, size);
 	if (!buf) {
 		rdma_error("failed to allocate buffer, -ENOMEM\n");
 		return NULL;
 	}
-	debug("Buffer allocated: %p , len: %u \n", buf, size);
+	debug("Buffer allocated: %p , len: %u%s \n", buf, size,
+			huge ? " on huge pages" : "");
 	mr = rdma_buffer_register(pd, buf, size, permission);
-	if(!mr){
+	if (!mr && huge) {
+		rdma_huge_free(buf, huge->mapped);
+		free(huge);
+	} else if (!mr) {
 		free(buf);
+	} else if (huge) {
+		/* rdma_buffer_free() has to know how to give it back */
+		pthread_mutex_lock(&huge_lock);
+		huge->next = huge_buffers;
+		huge_buffers = huge;
+		pthread_mutex_unlock(&huge_lock);
 	}
 	return mr;
 }
@@ -87,9 +201,24 @@ void rdma_buffer_free(struct ibv_mr *mr)
 		return ;
 	}
 	void *to_free = mr->addr;
+	struct huge_buffer **link, *huge = NULL;
 	rdma_buffer_deregister(mr);
+	pthread_mutex_lock(&huge_lock);
+	for (link = &huge_buffers; *link; link = &(*link)->next) {
+		if ((*link)->addr == to_free) {
+			huge = *link;
+			*link = huge->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&huge_lock);
 	debug("Buffer %p free'ed\n", to_free);
-	free(to_free);
+	if (huge) {
+		rdma_huge_free(to_free, huge->mapped);
+		free(huge);
+	} else {
+		free(to_free);
+	}
 }
 
 void rdma_buffer_deregister(struct ibv_mr *mr) 
@@ -193,6 +322,288 @@ int process_work_completion_events (struct ibv_comp_channel *comp_channel,
        return total_wc; 
 }
 
+void rdma_poller_init(struct rdma_poller *poller, 
+		struct ibv_comp_channel *comp_channel, 
+		struct ibv_cq *cq, 
+		enum rdma_poll_mode mode, 
+		uint32_t spin_usec)
+{
+	bzero(poller, sizeof(*poller));
+	poller->mode = mode;
+	poller->comp_channel = comp_channel;
+	poller->cq = cq;
+	poller->spin_usec = spin_usec;
+}
+
+int rdma_poll_mode_parse(const char *arg, 
+		enum rdma_poll_mode *mode, 
+		uint32_t *spin_usec)
+{
+	if (!strcmp(arg, "blocking")) {
+		*mode = RDMA_POLL_BLOCKING;
+	} else if (!strcmp(arg, "busy")) {
+		*mode = RDMA_POLL_BUSY;
+	} else if (!strncmp(arg, "adaptive", 8)) {
+		*mode = RDMA_POLL_ADAPTIVE;
+		if (arg[8] == ':')
+			*spin_usec = strtoul(arg + 9, NULL, 0);
+		else if (arg[8] != '\0')
+			return -EINVAL;
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static uint64_t now_usec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int rdma_poller_spin(struct rdma_poller *poller, int progress)
+{
+	uint64_t now;
+	if (poller->mode == RDMA_POLL_BUSY || !poller->comp_channel)
+		return 1;
+	if (poller->mode == RDMA_POLL_BLOCKING)
+		return 0;
+	if (progress) {
+		poller->spin_start = 0;
+		return 1;
+	}
+	now = now_usec();
+	if (!poller->spin_start)
+		poller->spin_start = now;
+	return now - poller->spin_start < poller->spin_usec;
+}
+
+int rdma_poller_idle(struct rdma_poller *poller)
+{
+	struct ibv_cq *cq_ptr = NULL;
+	void *context = NULL;
+	int ret;
+	if (rdma_poller_spin(poller, 0))
+		return 0;
+	/* The CQ is armed since the last event, so anything that completed after 
+	 * our last poll has raised (or will raise) a notification. The event may 
+	 * also be a stale one for completions we already reaped while spinning, 
+	 * the caller then simply finds the CQ empty and comes back here. 
+	 */
+	ret = ibv_get_cq_event(poller->comp_channel, &cq_ptr, &context);
+	if (ret) {
+		rdma_error("Failed to get next CQ event due to %d \n", -errno);
+		return -errno;
+	}
+	ibv_ack_cq_events(cq_ptr, 1);
+	ret = ibv_req_notify_cq(cq_ptr, 0);
+	if (ret) {
+		rdma_error("Failed to request further notifications %d \n", -errno);
+		return -errno;
+	}
+	poller->spin_start = 0;
+	poller->sleeps++;
+	return 0;
+}
+
+int rdma_poller_wait(struct rdma_poller *poller, 
+		struct ibv_wc *wc, 
+		int max_wc)
+{
+	int ret, i, total_wc = 0;
+	if (poller->mode == RDMA_POLL_BLOCKING)
+		return process_work_completion_events(poller->comp_channel, 
+				wc, max_wc);
+	while (total_wc < max_wc) {
+		ret = ibv_poll_cq(poller->cq, max_wc - total_wc, wc + total_wc);
+		if (ret < 0) {
+			rdma_error("Failed to poll cq for wc due to %d \n", ret);
+			return ret;
+		}
+		if (ret > 0) {
+			total_wc += ret;
+			poller->spin_start = 0;
+			continue;
+		}
+		ret = rdma_poller_idle(poller);
+		if (ret)
+			return ret;
+	}
+	debug("%d WC are completed \n", total_wc);
+	for (i = 0 ; i < total_wc ; i++) {
+		if (wc[i].status != IBV_WC_SUCCESS) {
+			rdma_error("Work completion (WC) has error status: %s at index %d", 
+					ibv_wc_status_str(wc[i].status), i);
+			return -(wc[i].status);
+		}
+	}
+	return total_wc;
+}
+
+
+int rdma_queue_caps_probe(struct ibv_context *verbs, 
+		uint8_t port_num, 
+		uint32_t wr, 
+		uint32_t sge, 
+		struct rdma_queue_caps *caps)
+{
+	struct ibv_device_attr dev_attr;
+	struct ibv_port_attr port_attr;
+	int ret;
+	ret = ibv_query_device(verbs, &dev_attr);
+	if (ret) {
+		rdma_error("Failed to query the device, errno: %d \n", -ret);
+		return -ret;
+	}
+	/* ids that are not bound to a port yet report 0 */
+	ret = ibv_query_port(verbs, port_num ? port_num : 1, &port_attr);
+	if (ret) {
+		rdma_error("Failed to query port %u, errno: %d \n", port_num, -ret);
+		return -ret;
+	}
+	if (port_attr.state != IBV_PORT_ACTIVE)
+		rdma_error("Port %u is not active, state: %s \n", port_num,
+				ibv_port_state_str(port_attr.state));
+	bzero(caps, sizeof(*caps));
+	/* both queues share the CQ, it must hold all their work completions */
+	if (wr > (uint32_t) dev_attr.max_qp_wr)
+		wr = dev_attr.max_qp_wr;
+	if (2 * wr > (uint32_t) dev_attr.max_cqe)
+		wr = dev_attr.max_cqe / 2;
+	if (sge > (uint32_t) dev_attr.max_sge)
+		sge = dev_attr.max_sge;
+	caps->send_wr = caps->recv_wr = wr;
+	caps->send_sge = caps->recv_sge = sge;
+	caps->cq_entries = 2 * wr;
+	caps->initiator_depth = dev_attr.max_qp_init_rd_atom > UINT8_MAX ?
+		UINT8_MAX : dev_attr.max_qp_init_rd_atom;
+	caps->responder_resources = dev_attr.max_qp_rd_atom > UINT8_MAX ?
+		UINT8_MAX : dev_attr.max_qp_rd_atom;
+	caps->active_mtu = port_attr.active_mtu;
+	debug("Queues of %u WRs with %u SGEs, CQ of %u, %u/%u READs, MTU %d \n",
+			wr, sge, caps->cq_entries, caps->initiator_depth,
+			caps->responder_resources, 128 << caps->active_mtu);
+	return 0;
+}
+
+void rdma_queue_caps_qp_attr(const struct rdma_queue_caps *caps, 
+		struct ibv_qp_init_attr *attr)
+{
+	attr->cap.max_send_wr = caps->send_wr;
+	attr->cap.max_recv_wr = caps->recv_wr;
+	attr->cap.max_send_sge = caps->send_sge;
+	attr->cap.max_recv_sge = caps->recv_sge;
+}
+
+int rdma_create_qp_inline(struct rdma_cm_id *id, 
+		struct ibv_pd *pd, 
+		struct ibv_qp_init_attr *attr, 
+		uint32_t max_inline)
+{
+	int ret;
+	while (1) {
+		attr->cap.max_inline_data = max_inline;
+		ret = rdma_create_qp(id, pd, attr);
+		if (!ret)
+			break;
+		/* devices refuse what they cannot inline, anything else is fatal */
+		if ((errno != EINVAL && errno != ENOMEM) || !max_inline) {
+			rdma_error("Failed to create QP, errno: %d \n", -errno);
+			return -errno;
+		}
+		max_inline /= 2;
+	}
+	/* the provider reports what it really gives, which may be more */
+	debug("QP created with %u bytes of inline data \n", 
+			attr->cap.max_inline_data);
+	return 0;
+}
+
+void rdma_post_batch_init(struct rdma_post_batch *batch, 
+		struct ibv_qp *qp, 
+		uint32_t signal_every)
+{
+	bzero(batch, sizeof(*batch));
+	batch->qp = qp;
+	batch->signal_every = signal_every;
+}
+
+int64_t rdma_post_batch_add(struct rdma_post_batch *batch, 
+		const struct ibv_send_wr *wr)
+{
+	struct ibv_send_wr *queued;
+	int ret;
+	if (wr->num_sge > RDMA_BATCH_MAX_SGE) {
+		rdma_error("A batched request has at most %d SGEs \n", 
+				RDMA_BATCH_MAX_SGE);
+		return -EINVAL;
+	}
+	if (batch->count == RDMA_BATCH_MAX_WR) {
+		ret = rdma_post_batch_flush(batch);
+		if (ret)
+			return ret;
+	}
+	queued = &batch->wr[batch->count];
+	*queued = *wr;
+	memcpy(batch->sge[batch->count], wr->sg_list, 
+			wr->num_sge * sizeof(struct ibv_sge));
+	queued->sg_list = batch->sge[batch->count];
+	queued->wr_id = batch->queued;
+	queued->send_flags &= ~IBV_SEND_SIGNALED;
+	if (batch->signal_every && (batch->queued + 1) % batch->signal_every == 0)
+		queued->send_flags |= IBV_SEND_SIGNALED;
+	queued->next = NULL;
+	if (batch->count)
+		batch->wr[batch->count - 1].next = queued;
+	batch->count++;
+	return batch->queued++;
+}
+
+int rdma_post_batch_flush(struct rdma_post_batch *batch)
+{
+	struct ibv_send_wr *bad_wr = NULL;
+	uint32_t i, posted;
+	int ret;
+	if (!batch->count)
+		return 0;
+	batch->wr[batch->count - 1].send_flags |= IBV_SEND_SIGNALED;
+	ret = ibv_post_send(batch->qp, batch->wr, &bad_wr);
+	/* what was before bad_wr is on the QP, keep the rest queued */
+	posted = ret ? (bad_wr ? bad_wr - batch->wr : 0) : batch->count;
+	for (i = 0; i < posted; i++)
+		if (batch->wr[i].send_flags & IBV_SEND_SIGNALED)
+			batch->signaled++;
+	if (posted)
+		batch->posts++;
+	if (ret) {
+		rdma_error("Failed to post a batch of %u requests, errno: %d \n", 
+				batch->count, ret);
+		batch->count -= posted;
+		for (i = 0; i < batch->count; i++) {
+			batch->wr[i] = batch->wr[posted + i];
+			memcpy(batch->sge[i], batch->sge[posted + i], 
+					sizeof(batch->sge[i]));
+			batch->wr[i].sg_list = batch->sge[i];
+			batch->wr[i].next = i + 1 < batch->count ? 
+				&batch->wr[i + 1] : NULL;
+		}
+		return -ret;
+	}
+	batch->count = 0;
+	return 0;
+}
+
+uint64_t rdma_post_batch_complete(struct rdma_post_batch *batch, 
+		struct ibv_wc *wc)
+{
+	uint64_t done;
+	if (wc->wr_id < batch->completed)
+		return 0;
+	done = wc->wr_id + 1 - batch->completed;
+	batch->completed = wc->wr_id + 1;
+	return done;
+}
 
 /* Code acknowledgment: rping.c from librdmacm/examples */
 int get_addr(char *dst, struct sockaddr *addr)
@@ -209,3 +620,215 @@ int get_addr(char *dst, struct sockaddr *addr)
 	return ret;
 }
 
+
+/* What rdma_mr_cache_get() hands out: a copy of the cached MR narrowed to the
+ * buffer that was asked for, and the entry it comes from */
+struct mr_cache_ref {
+	struct ibv_mr mr;
+	struct rdma_mr_cache_entry *entry;
+};
+
+static void mr_cache_unlink(struct rdma_mr_cache *cache, 
+		struct rdma_mr_cache_entry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache->head = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache->tail = entry->prev;
+	entry->prev = entry->next = NULL;
+}
+
+static void mr_cache_push_front(struct rdma_mr_cache *cache, 
+		struct rdma_mr_cache_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if (cache->head)
+		cache->head->prev = entry;
+	else
+		cache->tail = entry;
+	cache->head = entry;
+}
+
+static void mr_cache_free_entry(struct rdma_mr_cache *cache, 
+		struct rdma_mr_cache_entry *entry)
+{
+	cache->pinned -= entry->end - entry->start;
+	rdma_buffer_deregister(entry->mr);
+	free(entry);
+}
+
+/* Takes an entry out of the cache, now if it is unused or with its last put */
+static void mr_cache_drop(struct rdma_mr_cache *cache, 
+		struct rdma_mr_cache_entry *entry)
+{
+	mr_cache_unlink(cache, entry);
+	if (entry->refs)
+		entry->stale = 1;
+	else
+		mr_cache_free_entry(cache, entry);
+}
+
+/* Evicts unused entries, least recently used first, until length more bytes 
+ * fit in the budget. Entries in use stay, the budget may be exceeded for them. */
+static void mr_cache_evict(struct rdma_mr_cache *cache, uint64_t length)
+{
+	struct rdma_mr_cache_entry *entry = cache->tail, *prev;
+	while (entry && cache->pinned + length > cache->budget) {
+		prev = entry->prev;
+		if (!entry->refs) {
+			mr_cache_unlink(cache, entry);
+			mr_cache_free_entry(cache, entry);
+			cache->evictions++;
+		}
+		entry = prev;
+	}
+}
+
+void rdma_mr_cache_init(struct rdma_mr_cache *cache, 
+		struct ibv_pd *pd, 
+		uint64_t budget)
+{
+	bzero(cache, sizeof(*cache));
+	cache->pd = pd;
+	cache->budget = budget;
+	pthread_mutex_init(&cache->lock, NULL);
+}
+
+struct ibv_mr *rdma_mr_cache_get(struct rdma_mr_cache *cache, 
+		void *addr, 
+		uint32_t length, 
+		enum ibv_access_flags permission)
+{
+	struct rdma_mr_cache_entry *entry, *next;
+	struct mr_cache_ref *ref;
+	uint64_t start = (uint64_t) addr, end = start + length;
+	int merged;
+	ref = calloc(1, sizeof(*ref));
+	if (!ref) {
+		rdma_error("Failed to allocate the MR reference, -ENOMEM\n");
+		return NULL;
+	}
+	pthread_mutex_lock(&cache->lock);
+	for (entry = cache->head; entry; entry = entry->next) {
+		if (entry->start <= start && end <= entry->end &&
+				(entry->access & permission) == permission)
+			break;
+	}
+	if (entry) {
+		cache->hits++;
+		mr_cache_unlink(cache, entry);
+		mr_cache_push_front(cache, entry);
+		goto found;
+	}
+	cache->misses++;
+	/* Overlapping registrations with the same permissions are replaced by one
+	 * that covers them all, so that neighbouring buffers end up sharing one
+	 * entry instead of pinning the pages they share twice. Growing the range
+	 * may reach more entries, hence the rescan. */
+	do {
+		merged = 0;
+		for (entry = cache->head; entry; entry = next) {
+			next = entry->next;
+			if (entry->access != permission || entry->end <= start || 
+					end <= entry->start)
+				continue;
+			/* rdma_buffer_register() takes 32 bit lengths */
+			if ((entry->end > end ? entry->end : end) - 
+					(entry->start < start ? entry->start : start) > UINT32_MAX)
+				continue;
+			if (entry->start < start)
+				start = entry->start;
+			if (entry->end > end)
+				end = entry->end;
+			mr_cache_drop(cache, entry);
+			merged = 1;
+		}
+	} while (merged);
+	mr_cache_evict(cache, end - start);
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		rdma_error("Failed to allocate the cache entry, -ENOMEM\n");
+		goto fail;
+	}
+	entry->mr = rdma_buffer_register(cache->pd, (void *) start, end - start,
+			permission);
+	if (!entry->mr) {
+		free(entry);
+		goto fail;
+	}
+	entry->start = start;
+	entry->end = end;
+	entry->access = permission;
+	cache->pinned += end - start;
+	mr_cache_push_front(cache, entry);
+found:
+	entry->refs++;
+	pthread_mutex_unlock(&cache->lock);
+	ref->mr = *entry->mr;
+	ref->mr.addr = addr;
+	ref->mr.length = length;
+	ref->entry = entry;
+	return &ref->mr;
+fail:
+	pthread_mutex_unlock(&cache->lock);
+	free(ref);
+	return NULL;
+}
+
+void rdma_mr_cache_put(struct rdma_mr_cache *cache, struct ibv_mr *mr)
+{
+	struct mr_cache_ref *ref = (struct mr_cache_ref *) mr;
+	struct rdma_mr_cache_entry *entry;
+	if (!mr) {
+		rdma_error("Passed memory region is NULL, ignoring\n");
+		return;
+	}
+	entry = ref->entry;
+	pthread_mutex_lock(&cache->lock);
+	entry->refs--;
+	if (!entry->refs && entry->stale)
+		mr_cache_free_entry(cache, entry);
+	else if (!entry->refs)
+		mr_cache_evict(cache, 0);
+	pthread_mutex_unlock(&cache->lock);
+	free(ref);
+}
+
+void rdma_mr_cache_invalidate(struct rdma_mr_cache *cache, 
+		void *addr, 
+		uint64_t length)
+{
+	struct rdma_mr_cache_entry *entry, *next;
+	uint64_t start = (uint64_t) addr, end = start + length;
+	pthread_mutex_lock(&cache->lock);
+	for (entry = cache->head; entry; entry = next) {
+		next = entry->next;
+		if (entry->start < end && start < entry->end)
+			mr_cache_drop(cache, entry);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void rdma_mr_cache_stats(struct rdma_mr_cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	printf("MR cache: %lu hits, %lu misses, %lu evictions, %lu bytes registered \n",
+			cache->hits, cache->misses, cache->evictions, cache->pinned);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void rdma_mr_cache_destroy(struct rdma_mr_cache *cache)
+{
+	while (cache->head) {
+		if (cache->head->refs)
+			rdma_error("MR cache entry %p is still in use \n", cache->head);
+		cache->head->refs = 0;
+		mr_cache_drop(cache, cache->head);
+	}
+	pthread_mutex_destroy(&cache->lock);
+}
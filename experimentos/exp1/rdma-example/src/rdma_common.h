@@ -17,6 +17,7 @@
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include <netdb.h>
 #include <netinet/in.h>	
@@ -26,15 +27,19 @@
 #include <rdma/rdma_cma.h>
 #include <infiniband/verbs.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* Error Macro*/
 #define rdma_error(msg, args...) do {\
-	fprintf(stderr, "%s : %d : ERROR : "msg, __FILE__, __LINE__, ## args);\
+	fprintf(stderr, "%s : %d : ERROR : " msg, __FILE__, __LINE__, ## args);\
 }while(0);
 
 #ifndef ACN_RDMA_DEBUG 
 /* Debug Macro */
 #define debug(msg, args...) do {\
-    printf("DEBUG: "msg, ## args);\
+    printf("DEBUG: " msg, ## args);\
 }while(0);
 
 #else 
@@ -43,12 +48,11 @@
 
 #endif /* ACN_RDMA_DEBUG */
 
-/* Capacity of the completion queue (CQ) */
-#define CQ_CAPACITY (16)
-/* MAX SGE capacity */
-#define MAX_SGE (2)
-/* MAX work requests */
-#define MAX_WR (8)
+/* Work requests a connection asks for in each direction, the device may give
+ * fewer, see rdma_queue_caps_probe() */
+#define DEFAULT_QUEUE_DEPTH (64)
+/* SGEs per work request a connection asks for */
+#define DEFAULT_MAX_SGE (4)
 /* Default port where the RDMA server is listening */
 #define DEFAULT_RDMA_PORT (20886)
 
@@ -88,6 +92,48 @@ int process_rdma_cm_event(struct rdma_event_channel *echannel,
 		enum rdma_cm_event_type expected_event,
 		struct rdma_cm_event **cm_event);
 
+/* Huge pages rdma_buffer_alloc() can put its buffers on */
+enum rdma_huge_pages {
+	RDMA_HUGE_NONE = 0,
+	RDMA_HUGE_2MB,
+	RDMA_HUGE_1GB,
+};
+
+/* Smaller buffers stay on regular pages, a huge page would be mostly wasted */
+#define RDMA_HUGE_MIN_LENGTH (2UL << 20)
+
+/**
+ * @brief Makes rdma_buffer_alloc() put the buffers of at least 
+ * RDMA_HUGE_MIN_LENGTH bytes on huge pages, see rdma_huge_alloc(). 
+ * @param huge: page size to use, RDMA_HUGE_NONE to go back to calloc()
+ */
+void rdma_buffer_set_huge_pages(enum rdma_huge_pages huge);
+
+/**
+ * @brief Parses a huge page size given on the command line: "none", "2m" or 
+ * "1g". Returns 0 or -EINVAL.
+ */
+int rdma_huge_pages_parse(const char *arg, enum rdma_huge_pages *huge);
+
+/**
+ * @brief Allocates zeroed memory on huge pages. It comes from the hugetlbfs 
+ * pool (MAP_HUGETLB) if pages of that size are reserved, otherwise from 
+ * transparent huge pages, 2 MB aligned. Either way every page is faulted in 
+ * and mlock()'ed before returning, so the registration and the first transfer 
+ * do not pay for it. Returns NULL on error.
+ * @param length: length of the buffer 
+ * @param huge: page size to ask hugetlbfs for
+ * @param mapped: where to store the length actually mapped, for rdma_huge_free()
+ */
+void *rdma_huge_alloc(size_t length, 
+		enum rdma_huge_pages huge, 
+		size_t *mapped);
+
+/* Frees memory of rdma_huge_alloc() 
+ * @mapped: the length it returned 
+ */
+void rdma_huge_free(void *addr, size_t mapped);
+
 /** @brief Allocates an RDMA buffer of size 'length' with permission permission. This 
  * function will also register the memory and returns a memory region (MR) 
  * identifier or NULL on error. 
@@ -134,7 +180,283 @@ int process_work_completion_events(struct ibv_comp_channel *comp_channel,
 		struct ibv_wc *wc, 
 		int max_wc);
 
+/* How a connection waits for its work completions */
+enum rdma_poll_mode {
+	/* sleep on the completion channel, one interrupt and syscall per wait */
+	RDMA_POLL_BLOCKING = 0,
+	/* spin on ibv_poll_cq, never sleeps, burns a core */
+	RDMA_POLL_BUSY,
+	/* spin for a bounded time, then sleep on the completion channel */
+	RDMA_POLL_ADAPTIVE,
+};
+
+/* Default time the adaptive mode spins on an empty CQ before sleeping */
+#define DEFAULT_SPIN_USEC (50)
+
+/* Per connection completion poller */
+struct rdma_poller {
+	enum rdma_poll_mode mode;
+	struct ibv_comp_channel *comp_channel;
+	struct ibv_cq *cq;
+	/* adaptive mode: how long to spin before sleeping */
+	uint32_t spin_usec;
+	/* when the current run of empty polls started, 0 if there is none */
+	uint64_t spin_start;
+	/* how many times we slept on the completion channel */
+	uint64_t sleeps;
+};
+
+/**
+ * @brief Initializes a poller. The CQ must have been created on comp_channel
+ * and armed with ibv_req_notify_cq(), as process_work_completion_events() expects.
+ * @param poller: poller to initialize
+ * @param comp_channel: completion channel of cq
+ * @param cq: completion queue to poll
+ * @param mode: how to wait for work completions
+ * @param spin_usec: adaptive mode spin budget in microseconds
+ */
+void rdma_poller_init(struct rdma_poller *poller, 
+		struct ibv_comp_channel *comp_channel, 
+		struct ibv_cq *cq, 
+		enum rdma_poll_mode mode, 
+		uint32_t spin_usec);
+
+/**
+ * @brief Parses a poll mode given on the command line: "blocking", "busy", 
+ * "adaptive" or "adaptive:<spin_usec>". Returns 0 or -EINVAL.
+ * @param arg: string to parse 
+ * @param mode: where to store the mode 
+ * @param spin_usec: where to store the spin budget, untouched if not given
+ */
+int rdma_poll_mode_parse(const char *arg, 
+		enum rdma_poll_mode *mode, 
+		uint32_t *spin_usec);
+
+/**
+ * @brief Tells whether a connection should poll its CQ again right away 
+ * rather than wait for the next notification of the completion channel. 
+ * @param poller: poller of the connection 
+ * @param progress: whether the last poll found work completions
+ */
+int rdma_poller_spin(struct rdma_poller *poller, int progress);
+
+/**
+ * @brief Called after a poll of the CQ found nothing. Depending on the mode it 
+ * returns right away so the caller polls again, or it sleeps on the completion 
+ * channel until the CQ is notified. Callers that found work completions must 
+ * reset poller->spin_start. Returns 0 or a negative errno.
+ * @param poller: poller of the connection
+ */
+int rdma_poller_idle(struct rdma_poller *poller);
+
+/**  
+ * @brief Same as process_work_completion_events() but waits the way the poller 
+ * of the connection is configured to.
+ * @param poller: poller of the connection 
+ * @param wc: Array where to hold the work completion elements 
+ * @param max_wc: Number of expected work completion (WC) elements. wc must be 
+ *          atleast this size.
+ */
+int rdma_poller_wait(struct rdma_poller *poller, 
+		struct ibv_wc *wc, 
+		int max_wc);
+
+/* Queue sizes of a connection, what it asked for clamped to what the device
+ * and port take */
+struct rdma_queue_caps {
+	/* room for every send and receive work request at once */
+	uint32_t cq_entries;
+	uint32_t send_wr, recv_wr;
+	uint32_t send_sge, recv_sge;
+	/* READs and atomics in flight, issued by us and served for the peer */
+	uint8_t initiator_depth, responder_resources;
+	enum ibv_mtu active_mtu;
+};
+
+/**
+ * @brief Sizes the queues of a connection with ibv_query_device() and
+ * ibv_query_port(): wr work requests in each direction, with sge SGEs each,
+ * as far as the device takes them, a CQ that holds all of them, and as many
+ * outstanding READs as the device allows. Returns 0 or a negative errno.
+ * @param verbs: device of the connection
+ * @param port_num: port of the connection, cm_id->port_num
+ * @param wr: work requests the workload wants in flight in each direction
+ * @param sge: SGEs per work request the workload wants
+ * @param caps: where to store the sizes
+ */
+int rdma_queue_caps_probe(struct ibv_context *verbs, 
+		uint8_t port_num, 
+		uint32_t wr, 
+		uint32_t sge, 
+		struct rdma_queue_caps *caps);
+
+/* Sets the queue capacities of attr to those of caps */
+void rdma_queue_caps_qp_attr(const struct rdma_queue_caps *caps, 
+		struct ibv_qp_init_attr *attr);
+
+/**
+ * @brief Same as rdma_create_qp() but asks for max_inline bytes of inline data,
+ * and for half as much each time the device refuses. On success 
+ * attr->cap.max_inline_data is what the QP really takes, sends up to that many
+ * bytes can go with IBV_SEND_INLINE. Returns 0 or a negative errno.
+ * @param id: connection id the QP is created for
+ * @param pd: protection domain of the QP
+ * @param attr: QP attributes, cap.max_inline_data is overwritten
+ * @param max_inline: largest inline payload to ask for
+ */
+int rdma_create_qp_inline(struct rdma_cm_id *id, 
+		struct ibv_pd *pd, 
+		struct ibv_qp_init_attr *attr, 
+		uint32_t max_inline);
+
+/* Send work requests queued before a batch is posted on its own */
+#define RDMA_BATCH_MAX_WR (64)
+/* Scatter/gather elements copied with every queued work request */
+#define RDMA_BATCH_MAX_SGE (4)
+
+/* Send work requests posted with one ibv_post_send(), so one doorbell, and
+ * signaled only every signal_every-th time. Requests are numbered in the order
+ * they are queued and that number is their wr_id. As a QP completes its sends
+ * in order, the completion of a signaled request also completes every
+ * unsignaled one before it. The last request of every post is signaled, so
+ * none of them waits for a later one to be known complete. */
+struct rdma_post_batch {
+	struct ibv_qp *qp;
+	uint32_t signal_every;
+	/* queued and not posted yet */
+	uint32_t count;
+	struct ibv_send_wr wr[RDMA_BATCH_MAX_WR];
+	struct ibv_sge sge[RDMA_BATCH_MAX_WR][RDMA_BATCH_MAX_SGE];
+	/* requests queued so far, the next one gets this number */
+	uint64_t queued;
+	/* requests known complete */
+	uint64_t completed;
+	uint64_t posts;
+	uint64_t signaled;
+};
+
+/**
+ * @brief Initializes an empty batch. The send queue of qp must have room for
+ * every request that may be posted and not complete at the same time.
+ * @param batch: batch to initialize
+ * @param qp: QP the requests are posted on
+ * @param signal_every: signal one request out of that many, 1 signals all,
+ *          0 only the last of every post
+ */
+void rdma_post_batch_init(struct rdma_post_batch *batch, 
+		struct ibv_qp *qp, 
+		uint32_t signal_every);
+
+/**
+ * @brief Queues a copy of a send work request, together with its scatter/gather
+ * list. Its wr_id, next and IBV_SEND_SIGNALED are set by the batch. A full batch
+ * is posted first. Returns the number of the request or a negative errno.
+ * @param batch: batch to queue on
+ * @param wr: work request to copy, at most RDMA_BATCH_MAX_SGE SGEs
+ */
+int64_t rdma_post_batch_add(struct rdma_post_batch *batch, 
+		const struct ibv_send_wr *wr);
+
+/* Posts the queued requests with one ibv_post_send(). Returns 0 or a negative
+ * errno, requests after a failed one stay queued. */
+int rdma_post_batch_flush(struct rdma_post_batch *batch);
+
+/**
+ * @brief Accounts a successful work completion of a request of the batch.
+ * Returns how many requests it completes: itself and the unsignaled ones before it.
+ * @param batch: batch the request was queued on
+ * @param wc: its work completion
+ */
+uint64_t rdma_post_batch_complete(struct rdma_post_batch *batch, 
+		struct ibv_wc *wc);
+
+/* Default amount of memory the registration cache keeps pinned */
+#define RDMA_MR_CACHE_DEFAULT_BUDGET (1UL << 30)
+
+/* A registration held by the cache, covers [start, end) */
+struct rdma_mr_cache_entry {
+	struct ibv_mr *mr;
+	uint64_t start;
+	uint64_t end;
+	int access;
+	/* callers holding it, only unused entries can be evicted */
+	uint32_t refs;
+	/* replaced or invalidated while in use, deregistered by the last put */
+	int stale;
+	/* LRU list, most recently used first */
+	struct rdma_mr_cache_entry *prev, *next;
+};
+
+/* Registration cache. Memory registered through it stays registered after
+ * rdma_mr_cache_put(), so registering the same buffers again costs a lookup
+ * instead of an ibv_reg_mr() and the pinning of every page.
+ */
+struct rdma_mr_cache {
+	struct ibv_pd *pd;
+	/* bytes that may stay registered, unused entries are evicted above it */
+	uint64_t budget;
+	uint64_t pinned;
+	struct rdma_mr_cache_entry *head, *tail;
+	pthread_mutex_t lock;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+/**
+ * @brief Initializes an empty registration cache.
+ * @param cache: cache to initialize
+ * @param pd: protection domain of the registrations
+ * @param budget: bytes the cache may keep registered once they are not used
+ */
+void rdma_mr_cache_init(struct rdma_mr_cache *cache, 
+		struct ibv_pd *pd, 
+		uint64_t budget);
+
+/**
+ * @brief Same as rdma_buffer_register() but goes through the cache. A cached
+ * registration that covers the buffer with at least the asked permissions is
+ * reused, otherwise the buffer is registered together with the unused entries
+ * it overlaps. The MR returned describes exactly addr and length, it must be
+ * given back with rdma_mr_cache_put() and never to ibv_dereg_mr().
+ * @param cache: registration cache
+ * @param addr: Buffer address 
+ * @param length: Length of the buffer 
+ * @param permission: OR of IBV_ACCESS_* permissions as defined for the enum ibv_access_flags
+ */
+struct ibv_mr *rdma_mr_cache_get(struct rdma_mr_cache *cache, 
+		void *addr, 
+		uint32_t length, 
+		enum ibv_access_flags permission);
+
+/* Gives back an MR of rdma_mr_cache_get(), the registration stays cached
+ * @mr: MR returned by rdma_mr_cache_get()
+ */
+void rdma_mr_cache_put(struct rdma_mr_cache *cache, struct ibv_mr *mr);
+
+/**
+ * @brief Drops the registrations of a range. Must be called before memory that
+ * went through the cache is freed or unmapped, otherwise a later buffer at the
+ * same address would hit a registration of the old pages.
+ * @param cache: registration cache
+ * @param addr: start of the range
+ * @param length: length of the range
+ */
+void rdma_mr_cache_invalidate(struct rdma_mr_cache *cache, 
+		void *addr, 
+		uint64_t length);
+
+/* prints the hit, miss and eviction counters of the cache */
+void rdma_mr_cache_stats(struct rdma_mr_cache *cache);
+
+/* Deregisters everything, every MR must have been put back */
+void rdma_mr_cache_destroy(struct rdma_mr_cache *cache);
+
 /* prints some details from the cm id */
 void show_rdma_cmid(struct rdma_cm_id *id);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* RDMA_COMMON_H */
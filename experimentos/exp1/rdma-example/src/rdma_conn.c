@@ -0,0 +1,349 @@
+/*
+ * Implementation of the connection objects and of their progress engine.
+ */
+
+#include <strings.h>
+
+#include "rdma_conn.h"
+
+/* Waits for one CM event of the expected type and acknowledges it */
+static int conn_cm_event(struct rdma_event_channel *channel,
+		enum rdma_cm_event_type expected)
+{
+	struct rdma_cm_event *cm_event = NULL;
+	int ret;
+	ret = process_rdma_cm_event(channel, expected, &cm_event);
+	if (ret) {
+		rdma_error("Failed to receive a valid event, ret = %d \n", ret);
+		return ret;
+	}
+	ret = rdma_ack_cm_event(cm_event);
+	if (ret) {
+		rdma_error("Failed to acknowledge the CM event, errno: %d \n", -errno);
+		return -errno;
+	}
+	return 0;
+}
+
+int rdma_conn_resolve(struct rdma_event_channel *channel,
+		struct sockaddr *addr,
+		int timeout_ms,
+		struct rdma_cm_id **id)
+{
+	int ret;
+	ret = rdma_create_id(channel, id, NULL, RDMA_PS_TCP);
+	if (ret) {
+		rdma_error("Failed to create the cm id, errno: %d \n", -errno);
+		return -errno;
+	}
+	/* binds the id to the local device that reaches addr */
+	ret = rdma_resolve_addr(*id, NULL, addr, timeout_ms);
+	if (ret) {
+		rdma_error("Failed to resolve address, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = conn_cm_event(channel, RDMA_CM_EVENT_ADDR_RESOLVED);
+	if (ret)
+		return ret;
+	debug("RDMA address is resolved \n");
+	ret = rdma_resolve_route(*id, timeout_ms);
+	if (ret) {
+		rdma_error("Failed to resolve route, errno: %d \n", -errno);
+		return -errno;
+	}
+	return conn_cm_event(channel, RDMA_CM_EVENT_ROUTE_RESOLVED);
+}
+
+int rdma_conn_init(struct rdma_conn *conn,
+		struct rdma_cm_id *id,
+		struct ibv_pd *pd,
+		const struct rdma_conn_attr *attr)
+{
+	struct ibv_qp_init_attr qp_init_attr;
+	int ret;
+	bzero(conn, sizeof(*conn));
+	conn->cm_id = id;
+	conn->pd = pd;
+	ret = rdma_queue_caps_probe(id->verbs, id->port_num, attr->wr,
+			DEFAULT_MAX_SGE, &conn->caps);
+	if (ret)
+		return ret;
+	conn->comp_channel = attr->comp_channel;
+	if (!conn->comp_channel) {
+		conn->comp_channel = ibv_create_comp_channel(id->verbs);
+		if (!conn->comp_channel) {
+			rdma_error("Failed to create IO completion event channel, errno: %d\n",
+					-errno);
+			return -errno;
+		}
+		conn->own_channel = 1;
+	}
+	/* one CQ for both queues, it holds every work completion at once */
+	conn->cq = ibv_create_cq(id->verbs, conn->caps.cq_entries,
+			attr->cq_context, conn->comp_channel, attr->comp_vector);
+	if (!conn->cq) {
+		rdma_error("Failed to create CQ, errno: %d \n", -errno);
+		return -errno;
+	}
+	debug("CQ created at %p with %d elements \n", conn->cq, conn->cq->cqe);
+	ret = ibv_req_notify_cq(conn->cq, 0);
+	if (ret) {
+		rdma_error("Failed to request notifications, errno: %d\n", -errno);
+		return -errno;
+	}
+	rdma_poller_init(&conn->poller, conn->comp_channel, conn->cq,
+			attr->poll_mode, attr->spin_usec);
+	bzero(&qp_init_attr, sizeof qp_init_attr);
+	rdma_queue_caps_qp_attr(&conn->caps, &qp_init_attr);
+	qp_init_attr.qp_type = IBV_QPT_RC;
+	qp_init_attr.recv_cq = conn->cq;
+	qp_init_attr.send_cq = conn->cq;
+	if (attr->srq) {
+		qp_init_attr.srq = attr->srq;
+		qp_init_attr.cap.max_recv_wr = 0;
+		qp_init_attr.cap.max_recv_sge = 0;
+	}
+	ret = rdma_create_qp_inline(id, pd, &qp_init_attr, attr->max_inline);
+	if (ret)
+		return ret;
+	conn->qp = id->qp;
+	conn->max_inline = qp_init_attr.cap.max_inline_data;
+	debug("QP created at %p \n", conn->qp);
+	return 0;
+}
+
+int rdma_conn_connect(struct rdma_conn *conn,
+		struct rdma_event_channel *channel,
+		struct rdma_conn_param *param)
+{
+	int ret;
+	/* as many READs in flight as the device allows, the server takes less if it must */
+	if (!param->initiator_depth)
+		param->initiator_depth = conn->caps.initiator_depth;
+	if (!param->responder_resources)
+		param->responder_resources = conn->caps.responder_resources;
+	ret = rdma_connect(conn->cm_id, param);
+	if (ret) {
+		rdma_error("Failed to connect to remote host , errno: %d\n", -errno);
+		return -errno;
+	}
+	debug("waiting for cm event: RDMA_CM_EVENT_ESTABLISHED\n");
+	return conn_cm_event(channel, RDMA_CM_EVENT_ESTABLISHED);
+}
+
+/* Sets an op up for a new operation, wr_id of its work request is the op */
+static void op_start(struct rdma_conn *conn, struct rdma_op *op, int recv)
+{
+	op->conn = conn;
+	op->recv = recv;
+	op->done = 0;
+	op->status = IBV_WC_SUCCESS;
+	op->byte_len = 0;
+}
+
+/* Queues one signaled send work request for the next doorbell */
+static int conn_queue(struct rdma_conn *conn, struct rdma_op *op,
+		enum ibv_wr_opcode opcode, struct ibv_mr *mr, void *addr,
+		uint32_t length, uint64_t remote_addr, uint32_t rkey)
+{
+	struct ibv_send_wr *wr;
+	struct ibv_sge *sge;
+	int ret, inl;
+	inl = opcode == IBV_WR_SEND && length <= conn->max_inline;
+	if (!mr && !inl) {
+		rdma_error("A request of %u bytes that is not inline needs an MR \n",
+				length);
+		return -EINVAL;
+	}
+	/* queued ones count too, a doorbell must never hit a full send queue */
+	if (conn->sends >= conn->caps.send_wr)
+		return -EAGAIN;
+	if (conn->queued == RDMA_CONN_MAX_QUEUED) {
+		ret = rdma_conn_flush(conn);
+		if (ret)
+			return ret;
+	}
+	op_start(conn, op, 0);
+	wr = &conn->send_wr[conn->queued];
+	sge = &conn->send_sge[conn->queued];
+	sge->addr = (uint64_t) addr;
+	sge->length = length;
+	/* the lkey is not looked at for inline data, it is copied at post time */
+	sge->lkey = inl ? 0 : mr->lkey;
+	bzero(wr, sizeof(*wr));
+	wr->wr_id = (uintptr_t) op;
+	wr->sg_list = sge;
+	wr->num_sge = 1;
+	wr->opcode = opcode;
+	wr->send_flags = IBV_SEND_SIGNALED | (inl ? IBV_SEND_INLINE : 0);
+	wr->wr.rdma.remote_addr = remote_addr;
+	wr->wr.rdma.rkey = rkey;
+	if (conn->queued)
+		conn->send_wr[conn->queued - 1].next = wr;
+	conn->queued++;
+	conn->sends++;
+	return 0;
+}
+
+int rdma_conn_write(struct rdma_conn *conn, struct rdma_op *op,
+		struct ibv_mr *mr, void *addr, uint32_t length,
+		uint64_t remote_addr, uint32_t rkey)
+{
+	return conn_queue(conn, op, IBV_WR_RDMA_WRITE, mr, addr, length,
+			remote_addr, rkey);
+}
+
+int rdma_conn_read(struct rdma_conn *conn, struct rdma_op *op,
+		struct ibv_mr *mr, void *addr, uint32_t length,
+		uint64_t remote_addr, uint32_t rkey)
+{
+	return conn_queue(conn, op, IBV_WR_RDMA_READ, mr, addr, length,
+			remote_addr, rkey);
+}
+
+int rdma_conn_send(struct rdma_conn *conn, struct rdma_op *op,
+		struct ibv_mr *mr, void *addr, uint32_t length)
+{
+	return conn_queue(conn, op, IBV_WR_SEND, mr, addr, length, 0, 0);
+}
+
+int rdma_conn_recv(struct rdma_conn *conn, struct rdma_op *op,
+		struct ibv_mr *mr, void *addr, uint32_t length)
+{
+	struct ibv_recv_wr recv_wr, *bad_recv_wr = NULL;
+	struct ibv_sge recv_sge;
+	int ret;
+	if (conn->recvs >= conn->caps.recv_wr)
+		return -EAGAIN;
+	op_start(conn, op, 1);
+	recv_sge.addr = (uint64_t) addr;
+	recv_sge.length = length;
+	recv_sge.lkey = mr->lkey;
+	bzero(&recv_wr, sizeof(recv_wr));
+	recv_wr.wr_id = (uintptr_t) op;
+	recv_wr.sg_list = &recv_sge;
+	recv_wr.num_sge = 1;
+	ret = ibv_post_recv(conn->qp, &recv_wr, &bad_recv_wr);
+	if (ret) {
+		rdma_error("Failed to post a receive, errno: %d \n", ret);
+		return -ret;
+	}
+	conn->recvs++;
+	return 0;
+}
+
+/* Completes an op that never made it to the QP */
+static void op_fail(struct rdma_conn *conn, struct rdma_op *op)
+{
+	struct ibv_wc wc;
+	bzero(&wc, sizeof(wc));
+	wc.wr_id = (uintptr_t) op;
+	wc.status = IBV_WC_GENERAL_ERR;
+	rdma_conn_complete(conn, &wc);
+}
+
+int rdma_conn_flush(struct rdma_conn *conn)
+{
+	struct ibv_send_wr *bad_wr = NULL;
+	uint32_t i, posted;
+	int ret;
+	if (!conn->queued)
+		return 0;
+	ret = ibv_post_send(conn->qp, conn->send_wr, &bad_wr);
+	posted = ret ? (bad_wr ? bad_wr - conn->send_wr : 0) : conn->queued;
+	if (posted)
+		conn->posts++;
+	if (ret) {
+		rdma_error("Failed to post %u requests, errno: %d \n",
+				conn->queued, ret);
+		/* what was before bad_wr is on the QP and completes as usual, the
+		 * rest fails right away so that nobody waits for it */
+		for (i = posted; i < conn->queued; i++)
+			op_fail(conn, (struct rdma_op *) (uintptr_t) conn->send_wr[i].wr_id);
+		conn->queued = 0;
+		return -ret;
+	}
+	conn->queued = 0;
+	return 0;
+}
+
+void rdma_conn_complete(struct rdma_conn *conn, struct ibv_wc *wc)
+{
+	struct rdma_op *op = (struct rdma_op *) (uintptr_t) wc->wr_id;
+	op->status = wc->status;
+	op->opcode = wc->opcode;
+	op->byte_len = wc->byte_len;
+	op->done = 1;
+	if (op->recv)
+		conn->recvs--;
+	else
+		conn->sends--;
+	conn->completed++;
+	if (wc->status != IBV_WC_SUCCESS)
+		rdma_error("Work completion (WC) has error status: %s \n",
+				ibv_wc_status_str(wc->status));
+	if (op->callback)
+		op->callback(op, op->arg);
+}
+
+int rdma_conn_progress(struct rdma_conn *conn)
+{
+	struct ibv_wc wc[RDMA_CONN_POLL_BATCH];
+	int ret, i, completed = 0;
+	ret = rdma_conn_flush(conn);
+	if (ret)
+		return ret;
+	do {
+		ret = ibv_poll_cq(conn->cq, RDMA_CONN_POLL_BATCH, wc);
+		if (ret < 0) {
+			rdma_error("Failed to poll cq for wc due to %d \n", ret);
+			return ret;
+		}
+		/* callbacks may queue new ops, they go out with the next call */
+		for (i = 0; i < ret; i++)
+			rdma_conn_complete(conn, &wc[i]);
+		completed += ret;
+	} while (ret == RDMA_CONN_POLL_BATCH);
+	return completed;
+}
+
+int rdma_conn_wait(struct rdma_conn *conn, struct rdma_op *op)
+{
+	int ret;
+	while (!op->done) {
+		ret = rdma_conn_progress(conn);
+		if (ret < 0)
+			return ret;
+		if (ret > 0) {
+			conn->poller.spin_start = 0;
+			continue;
+		}
+		ret = rdma_poller_idle(&conn->poller);
+		if (ret)
+			return ret;
+	}
+	return op->status == IBV_WC_SUCCESS ? 0 : -(op->status);
+}
+
+void rdma_conn_disconnect(struct rdma_conn *conn,
+		struct rdma_event_channel *channel)
+{
+	/* errors are reported on the way, there is nothing else to do about them */
+	if (rdma_disconnect(conn->cm_id))
+		rdma_error("Failed to disconnect, errno: %d \n", -errno);
+	conn_cm_event(channel, RDMA_CM_EVENT_DISCONNECTED);
+}
+
+void rdma_conn_destroy(struct rdma_conn *conn)
+{
+	if (conn->qp)
+		rdma_destroy_qp(conn->cm_id);
+	if (conn->cq && ibv_destroy_cq(conn->cq))
+		rdma_error("Failed to destroy completion queue cleanly, %d \n", -errno);
+	if (conn->own_channel && ibv_destroy_comp_channel(conn->comp_channel))
+		rdma_error("Failed to destroy completion channel cleanly, %d \n", -errno);
+	conn->qp = NULL;
+	conn->cq = NULL;
+	conn->comp_channel = NULL;
+	conn->own_channel = 0;
+}
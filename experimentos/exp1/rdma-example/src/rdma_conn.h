@@ -0,0 +1,231 @@
+/*
+ * Connection objects with non-blocking operations.
+ *
+ * A struct rdma_conn owns the QP of one cm id, with its CQ, and sizes them
+ * from the device like every connection of the examples does. Operations on
+ * it never wait: rdma_conn_write(), _read(), _send() and _recv() take a
+ * struct rdma_op from the caller, queue or post the work request with the
+ * address of the op as its wr_id and return right away. The op is the handle
+ * of the operation, a future that rdma_conn_progress() completes when its
+ * work completion shows up, so the caller can keep many operations in flight
+ * and do something else meanwhile.
+ *
+ * In flight means up to caps.send_wr sends, WRITEs and READs, queued ones
+ * included, and up to caps.recv_wr receives. Past that an operation fails
+ * with -EAGAIN before it touches the QP, the caller runs the progress engine
+ * and tries again, so a full queue never fails the ops already queued.
+ *
+ * Sends, WRITEs and READs queued between two progress calls go out with one
+ * ibv_post_send(), so they share a doorbell, and every one of them is
+ * signaled since each op needs its own completion. Receives are posted right
+ * away. A CQ shared with something else, an SRQ or another layer, can be
+ * polled by its owner instead, which hands the completions of ops to
+ * rdma_conn_complete().
+ */
+
+#ifndef RDMA_CONN_H
+#define RDMA_CONN_H
+
+#include "rdma_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sends queued before the queue is posted on its own */
+#define RDMA_CONN_MAX_QUEUED (32)
+/* Work completions reaped per ibv_poll_cq call */
+#define RDMA_CONN_POLL_BATCH (16)
+
+struct rdma_conn;
+struct rdma_op;
+
+/* Called by the progress engine once the op is complete, op->status tells how */
+typedef void (*rdma_op_callback)(struct rdma_op *op, void *arg);
+
+/* One operation, owned by the caller and untouched until it is complete */
+struct rdma_op {
+	struct rdma_conn *conn;
+	/* 0 while in flight, 1 once complete */
+	int done;
+	/* IBV_WC_SUCCESS or what went wrong */
+	enum ibv_wc_status status;
+	enum ibv_wc_opcode opcode;
+	/* receives: bytes that arrived */
+	uint32_t byte_len;
+	/* 1 for a receive, set when it starts */
+	int recv;
+	/* NULL to only poll the op */
+	rdma_op_callback callback;
+	void *arg;
+};
+
+/* What a connection asks for, the queues are probed from the device */
+struct rdma_conn_attr {
+	/* work requests the workload wants in flight in each direction */
+	uint32_t wr;
+	/* largest send to go with IBV_SEND_INLINE, 0 never sends inline */
+	uint32_t max_inline;
+	enum rdma_poll_mode poll_mode;
+	uint32_t spin_usec;
+	/* completion channel shared with other connections, NULL for one of its
+	 * own, comp_vector and cq_context go with the CQ created on it */
+	struct ibv_comp_channel *comp_channel;
+	int comp_vector;
+	void *cq_context;
+	/* receives come from this SRQ, NULL for a receive queue of its own */
+	struct ibv_srq *srq;
+};
+
+struct rdma_conn {
+	struct rdma_cm_id *cm_id;
+	struct ibv_pd *pd;
+	struct ibv_qp *qp;
+	struct ibv_cq *cq;
+	struct ibv_comp_channel *comp_channel;
+	/* the completion channel was created for the connection */
+	int own_channel;
+	struct rdma_poller poller;
+	struct rdma_queue_caps caps;
+	/* max_inline_data of the QP */
+	uint32_t max_inline;
+	/* sends queued for the next doorbell */
+	struct ibv_send_wr send_wr[RDMA_CONN_MAX_QUEUED];
+	struct ibv_sge send_sge[RDMA_CONN_MAX_QUEUED];
+	uint32_t queued;
+	/* ops queued or posted and not complete yet, sends count the WRITEs and
+	 * READs too, receives posted outside of the connection are not counted */
+	uint32_t sends, recvs;
+	uint64_t posts, completed;
+};
+
+/**
+ * @brief Creates an id on channel and resolves the address and the route of
+ * addr with it, waiting for both events. Returns 0 or a negative errno.
+ * @param channel: CM event channel of the id
+ * @param addr: address of the server
+ * @param timeout_ms: how long each resolution may take
+ * @param id: where to store the new id
+ */
+int rdma_conn_resolve(struct rdma_event_channel *channel,
+		struct sockaddr *addr,
+		int timeout_ms,
+		struct rdma_cm_id **id);
+
+/**
+ * @brief Creates the CQ and the QP of a connection on id, with the queues the
+ * device takes for attr->wr work requests. Returns 0 or a negative errno, on
+ * error rdma_conn_destroy() frees what was created.
+ * @param conn: connection to initialize
+ * @param id: resolved id of the client, or id of a connect request
+ * @param pd: protection domain of the QP
+ * @param attr: what the connection asks for
+ */
+int rdma_conn_init(struct rdma_conn *conn,
+		struct rdma_cm_id *id,
+		struct ibv_pd *pd,
+		const struct rdma_conn_attr *attr);
+
+/**
+ * @brief Client side: connects and waits for RDMA_CM_EVENT_ESTABLISHED on
+ * channel. Receives the server may send right away must be posted before.
+ * Returns 0 or a negative errno.
+ * @param conn: initialized connection
+ * @param channel: CM event channel of its id
+ * @param param: connection parameters, the READ depths are those of the caps
+ *          when left at 0
+ */
+int rdma_conn_connect(struct rdma_conn *conn,
+		struct rdma_event_channel *channel,
+		struct rdma_conn_param *param);
+
+/**
+ * @brief Queues an RDMA WRITE of local memory to remote memory. It goes out
+ * at the next rdma_conn_flush() or progress call. Returns 0, -EAGAIN when
+ * caps.send_wr sends are in flight already, or another negative errno, the op
+ * is only in flight on 0.
+ * @param conn: the connection
+ * @param op: handle of the operation
+ * @param mr: registration of addr
+ * @param addr: local buffer
+ * @param length: bytes to write
+ * @param remote_addr: where they go on the other end
+ * @param rkey: remote key of remote_addr
+ */
+int rdma_conn_write(struct rdma_conn *conn, struct rdma_op *op,
+		struct ibv_mr *mr, void *addr, uint32_t length,
+		uint64_t remote_addr, uint32_t rkey);
+
+/* Same as rdma_conn_write() but reads remote memory into addr */
+int rdma_conn_read(struct rdma_conn *conn, struct rdma_op *op,
+		struct ibv_mr *mr, void *addr, uint32_t length,
+		uint64_t remote_addr, uint32_t rkey);
+
+/**
+ * @brief Queues a SEND. Messages that fit in the inline data of the QP are
+ * copied at post time, they need no registration and the buffer is free
+ * again as soon as they are posted. Returns 0, -EAGAIN when the send queue is
+ * full, or another negative errno.
+ * @param mr: registration of addr, may be NULL when length fits inline
+ */
+int rdma_conn_send(struct rdma_conn *conn, struct rdma_op *op,
+		struct ibv_mr *mr, void *addr, uint32_t length);
+
+/**
+ * @brief Posts a receive right away, the op completes with the SEND it takes.
+ * Returns 0, -EAGAIN when caps.recv_wr receives are in flight already, or
+ * another negative errno.
+ */
+int rdma_conn_recv(struct rdma_conn *conn, struct rdma_op *op,
+		struct ibv_mr *mr, void *addr, uint32_t length);
+
+/* Posts the queued sends with one ibv_post_send(). Returns 0 or a negative errno. */
+int rdma_conn_flush(struct rdma_conn *conn);
+
+/**
+ * @brief Completes the op a work completion of the connection belongs to, and
+ * runs its callback. For callers that poll the CQ themselves.
+ * @param conn: the connection
+ * @param wc: work completion whose wr_id is a struct rdma_op
+ */
+void rdma_conn_complete(struct rdma_conn *conn, struct ibv_wc *wc);
+
+/**
+ * @brief The progress engine: posts what is queued, then completes the ops
+ * whose work completions the CQ holds, without waiting. Every work completion
+ * of the CQ must belong to an op. Returns the number of ops completed or a
+ * negative errno.
+ */
+int rdma_conn_progress(struct rdma_conn *conn);
+
+/**
+ * @brief Runs the progress engine until op is complete, spinning or sleeping
+ * in between the way the poller of the connection is configured to. Other
+ * ops complete along the way. It sleeps on the completion channel, which
+ * should only carry the CQ of the connection. Returns 0, the negated status
+ * of the op if it failed, or a negative errno.
+ */
+int rdma_conn_wait(struct rdma_conn *conn, struct rdma_op *op);
+
+/* Whether the op is complete, without running the progress engine */
+static inline int rdma_op_done(struct rdma_op *op)
+{
+	return op->done;
+}
+
+/**
+ * @brief Disconnects and waits for RDMA_CM_EVENT_DISCONNECTED on channel,
+ * errors are reported and otherwise ignored.
+ */
+void rdma_conn_disconnect(struct rdma_conn *conn,
+		struct rdma_event_channel *channel);
+
+/* Destroys the QP, the CQ and a completion channel of its own, the id and
+ * the PD belong to the caller */
+void rdma_conn_destroy(struct rdma_conn *conn);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RDMA_CONN_H */
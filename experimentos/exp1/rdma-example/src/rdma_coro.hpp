@@ -0,0 +1,311 @@
+/*
+ * C++20 coroutines over the connection objects of rdma_conn.h.
+ *
+ * co_await conn.write(...), read(...), send(...) and recv(...) suspend the
+ * calling coroutine until the work completion of the operation is in. Each
+ * of them is an rdma_op of the connection whose callback hands the coroutine
+ * back to the scheduler: the wr_id of the work completion is the op, the op
+ * knows the coroutine waiting for it. The scheduler is single threaded, it
+ * resumes the coroutines that are ready, then runs the progress engine of its
+ * connections, so every operation the coroutines start in one round goes out
+ * with one doorbell.
+ *
+ * Operations are posted when they are created, not when they are awaited, so
+ * one coroutine can have several in flight:
+ *
+ *	auto meta = conn.recv(mr, buf, length);
+ *	co_await conn.send(mr2, buf2, length2);
+ *	int received = co_await meta;
+ *
+ * An operation must be awaited before it goes out of scope. When the queues
+ * of the QP are full, rdma_conn_*() say so with -EAGAIN, the operation waits
+ * in the connection and is posted as soon as a completion makes room, so any
+ * number of coroutines can run on a connection whatever the device takes.
+ */
+
+#ifndef RDMA_CORO_HPP
+#define RDMA_CORO_HPP
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <utility>
+#include <vector>
+
+#include "rdma_conn.h"
+
+namespace rdma {
+
+class scheduler;
+class connection;
+
+/* A coroutine the scheduler runs. It starts once spawned and frees itself
+ * when it returns, nobody awaits it */
+class task {
+public:
+	struct promise_type {
+		scheduler *sched = nullptr;
+		task get_return_object()
+		{
+			return task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void();
+		/* errors are return values, like everywhere else */
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	task(task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+	/* a task that was never spawned never ran, drop its frame */
+	~task()
+	{
+		if (handle)
+			handle.destroy();
+	}
+
+private:
+	explicit task(std::coroutine_handle<promise_type> h) : handle(h) {}
+	std::coroutine_handle<promise_type> handle;
+	friend class scheduler;
+};
+
+/* One operation of a connection, what co_await returns is its result: bytes
+ * received for recv(), 0 for the others, or the negated status of the work
+ * completion or a negative errno if it failed */
+class op_awaiter {
+public:
+	enum kind { WRITE, READ, SEND, RECV };
+
+	op_awaiter(connection &conn, kind k, struct ibv_mr *mr, void *addr,
+			uint32_t length, uint64_t remote_addr, uint32_t rkey);
+	/* the op is known to the connection by its address */
+	op_awaiter(const op_awaiter &) = delete;
+	op_awaiter &operator=(const op_awaiter &) = delete;
+
+	bool await_ready() const noexcept { return error || op.done; }
+	void await_suspend(std::coroutine_handle<> h) noexcept { waiter = h; }
+	int await_resume() const noexcept
+	{
+		if (error)
+			return error;
+		if (op.status != IBV_WC_SUCCESS)
+			return -op.status;
+		return k == RECV ? (int) op.byte_len : 0;
+	}
+
+private:
+	/* posts the op, or fails it with a negative errno, false when the QP
+	 * has no room for it */
+	bool post();
+	static void complete(struct rdma_op *op, void *arg);
+
+	connection &conn;
+	kind k;
+	struct ibv_mr *mr;
+	void *addr;
+	uint32_t length;
+	uint64_t remote_addr;
+	uint32_t rkey;
+	struct rdma_op op = {};
+	int error = 0;
+	/* the coroutine to resume, none until it is awaited */
+	std::coroutine_handle<> waiter;
+	friend class connection;
+};
+
+/* Coroutine interface of an initialized struct rdma_conn. Its CQ must only
+ * carry the work completions of its ops once the scheduler drives it */
+class connection {
+public:
+	connection(struct rdma_conn *conn, scheduler &sched);
+
+	op_awaiter write(struct ibv_mr *mr, void *addr, uint32_t length,
+			uint64_t remote_addr, uint32_t rkey)
+	{
+		return op_awaiter(*this, op_awaiter::WRITE, mr, addr, length,
+				remote_addr, rkey);
+	}
+	op_awaiter read(struct ibv_mr *mr, void *addr, uint32_t length,
+			uint64_t remote_addr, uint32_t rkey)
+	{
+		return op_awaiter(*this, op_awaiter::READ, mr, addr, length,
+				remote_addr, rkey);
+	}
+	/* mr may be nullptr when length fits in the inline data of the QP */
+	op_awaiter send(struct ibv_mr *mr, void *addr, uint32_t length)
+	{
+		return op_awaiter(*this, op_awaiter::SEND, mr, addr, length, 0, 0);
+	}
+	op_awaiter recv(struct ibv_mr *mr, void *addr, uint32_t length)
+	{
+		return op_awaiter(*this, op_awaiter::RECV, mr, addr, length, 0, 0);
+	}
+
+	struct rdma_conn *get() const { return conn; }
+	/* operations that had to wait for room in the QP */
+	uint64_t deferred() const { return ndeferred; }
+
+private:
+	void submit(op_awaiter *a);
+	/* posts the waiting operations the QP has room for, in order */
+	void admit();
+
+	struct rdma_conn *conn;
+	scheduler &sched;
+	std::deque<op_awaiter *> waiting;
+	uint64_t ndeferred = 0;
+	friend class op_awaiter;
+	friend class scheduler;
+};
+
+/* Runs the tasks and the progress engine of its connections on the calling
+ * thread */
+class scheduler {
+public:
+	/* the task runs with the next round, spawn() works from a task too */
+	void spawn(task t)
+	{
+		auto h = std::exchange(t.handle, nullptr);
+		h.promise().sched = this;
+		live++;
+		ready.push_back(h);
+	}
+
+	/* Runs until every task returned. When nothing is ready and nothing
+	 * completed it waits the way the poller of the connection says, with
+	 * several connections it keeps polling them in turn. Returns 0 or a
+	 * negative errno. */
+	int run()
+	{
+		int ret, progress;
+		while (live) {
+			while (!ready.empty()) {
+				auto h = ready.front();
+				ready.pop_front();
+				h.resume();
+			}
+			if (!live)
+				break;
+			progress = 0;
+			for (connection *c : conns) {
+				c->admit();
+				ret = rdma_conn_progress(c->conn);
+				if (ret < 0)
+					return ret;
+				progress += ret;
+			}
+			if (progress || !ready.empty()) {
+				for (connection *c : conns)
+					c->conn->poller.spin_start = 0;
+				continue;
+			}
+			if (idle_without_ops()) {
+				rdma_error("%lu tasks wait but no operation is in flight \n",
+						live);
+				return -EDEADLK;
+			}
+			if (conns.size() == 1) {
+				ret = rdma_poller_idle(&conns[0]->conn->poller);
+				if (ret)
+					return ret;
+			}
+		}
+		return 0;
+	}
+
+private:
+	bool idle_without_ops() const
+	{
+		for (connection *c : conns)
+			if (c->conn->sends || c->conn->recvs || !c->waiting.empty())
+				return false;
+		return true;
+	}
+
+	std::vector<connection *> conns;
+	std::deque<std::coroutine_handle<>> ready;
+	uint64_t live = 0;
+	friend class connection;
+	friend class op_awaiter;
+	friend struct task::promise_type;
+};
+
+inline void task::promise_type::return_void()
+{
+	sched->live--;
+}
+
+inline op_awaiter::op_awaiter(connection &conn, kind k, struct ibv_mr *mr,
+		void *addr, uint32_t length, uint64_t remote_addr, uint32_t rkey)
+	: conn(conn), k(k), mr(mr), addr(addr), length(length),
+	  remote_addr(remote_addr), rkey(rkey)
+{
+	op.callback = complete;
+	op.arg = this;
+	conn.submit(this);
+}
+
+inline bool op_awaiter::post()
+{
+	struct rdma_conn *c = conn.conn;
+	switch (k) {
+	case WRITE:
+		error = rdma_conn_write(c, &op, mr, addr, length, remote_addr, rkey);
+		break;
+	case READ:
+		error = rdma_conn_read(c, &op, mr, addr, length, remote_addr, rkey);
+		break;
+	case SEND:
+		error = rdma_conn_send(c, &op, mr, addr, length);
+		break;
+	case RECV:
+		error = rdma_conn_recv(c, &op, mr, addr, length);
+		break;
+	}
+	if (error != -EAGAIN)
+		return true;
+	error = 0;
+	return false;
+}
+
+/* Callback of the op: the work completion of wr_id is in */
+inline void op_awaiter::complete(struct rdma_op *op, void *arg)
+{
+	op_awaiter *a = static_cast<op_awaiter *>(arg);
+	if (a->waiter)
+		a->conn.sched.ready.push_back(a->waiter);
+}
+
+inline connection::connection(struct rdma_conn *conn, scheduler &sched)
+	: conn(conn), sched(sched)
+{
+	sched.conns.push_back(this);
+}
+
+inline void connection::submit(op_awaiter *a)
+{
+	if (waiting.empty() && a->post())
+		return;
+	waiting.push_back(a);
+	ndeferred++;
+}
+
+inline void connection::admit()
+{
+	while (!waiting.empty()) {
+		op_awaiter *a = waiting.front();
+		if (!a->post())
+			return;
+		waiting.pop_front();
+		/* a failed post completes the operation right away */
+		if (a->error && a->waiter)
+			sched.ready.push_back(a->waiter);
+	}
+}
+
+} /* namespace rdma */
+
+#endif /* RDMA_CORO_HPP */
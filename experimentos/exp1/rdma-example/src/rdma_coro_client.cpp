@@ -0,0 +1,231 @@
+/*
+ * Pipelined WRITE/READ check against rdma_server, written with the
+ * coroutines of rdma_coro.hpp.
+ *
+ * The client asks the server for a buffer of depth slots, then runs depth
+ * coroutines at once. Each one owns a slot: it fills it, writes it to the
+ * server, reads it back and checks it, ops / depth times. Every await
+ * suspends one coroutine only, the others keep the queues of the QP full.
+ */
+#include <unistd.h>
+#include <time.h>
+
+#include "rdma_coro.hpp"
+
+/* Defaults of -s, -d and -n */
+#define CORO_SLOT_SIZE (4096)
+#define CORO_DEPTH (256)
+#define CORO_OPS (100000)
+
+static uint32_t slot_size = CORO_SLOT_SIZE, depth = CORO_DEPTH;
+static uint64_t ops = CORO_OPS;
+static enum rdma_poll_mode poll_mode = RDMA_POLL_BLOCKING;
+static uint32_t spin_usec = DEFAULT_SPIN_USEC;
+
+/* Local slots: depth of them to write from, then depth to read into */
+static struct ibv_mr *buffer_mr = NULL;
+static struct rdma_buffer_attr client_metadata_attr, server_metadata_attr;
+static struct ibv_mr *client_metadata_mr = NULL, *server_metadata_mr = NULL;
+/* checks that failed, and whether some coroutine failed altogether */
+static uint64_t mismatches = 0, rounds = 0;
+static int failed = 0;
+
+/* Writes slot index to the server and reads it back, ops / depth times */
+static rdma::task check_slot(rdma::connection &conn, uint32_t index, uint64_t count)
+{
+	char *src = (char *) buffer_mr->addr + (uint64_t) index * slot_size;
+	char *dst = src + (uint64_t) depth * slot_size;
+	uint64_t remote = server_metadata_attr.address + (uint64_t) index * slot_size;
+	uint32_t rkey = server_metadata_attr.stag.remote_stag;
+	int ret;
+	for (uint64_t i = 0; i < count && !failed; i++) {
+		memset(src, 'a' + (index + i) % 26, slot_size);
+		ret = co_await conn.write(buffer_mr, src, slot_size, remote, rkey);
+		if (!ret)
+			ret = co_await conn.read(buffer_mr, dst, slot_size, remote, rkey);
+		if (ret) {
+			rdma_error("Slot %u failed, ret = %d \n", index, ret);
+			failed = 1;
+			co_return;
+		}
+		if (memcmp(src, dst, slot_size))
+			mismatches++;
+		rounds++;
+	}
+}
+
+/* Exchanges the metadata with the server, then starts the checks */
+static rdma::task run_client(rdma::scheduler &sched, rdma::connection &conn)
+{
+	int ret, received;
+	/* posted before our metadata goes out, the server answers right away */
+	auto meta = conn.recv(server_metadata_mr, &server_metadata_attr,
+			sizeof(server_metadata_attr));
+	ret = co_await conn.send(client_metadata_mr, &client_metadata_attr,
+			sizeof(client_metadata_attr));
+	/* awaited even if the send failed, the receive is in flight */
+	received = co_await meta;
+	if (ret < 0 || received < 0) {
+		rdma_error("Failed to exchange the metadata, ret = %d \n",
+				ret < 0 ? ret : received);
+		failed = 1;
+		co_return;
+	}
+	if (server_metadata_attr.length < (uint64_t) slot_size * depth) {
+		rdma_error("The server gave us %u bytes only \n", server_metadata_attr.length);
+		failed = 1;
+		co_return;
+	}
+	show_rdma_buffer_attr(&server_metadata_attr);
+	for (uint32_t i = 0; i < depth; i++)
+		sched.spawn(check_slot(conn, i, ops / depth + (i < ops % depth)));
+}
+
+void usage()
+{
+	printf("Usage:\n");
+	printf("rdma_coro_client: [-a <server_addr>] [-p <server_port>] [-P <poll_mode>]\n");
+	printf("                  [-s <slot_size>] [-d <depth>] [-n <ops>]\n");
+	printf("(default IP is 127.0.0.1 and port is %d)\n", DEFAULT_RDMA_PORT);
+	printf("Runs depth coroutines (default %d) that each write a slot of slot_size\n",
+			CORO_DEPTH);
+	printf("bytes (default %d) to the server and read it back, ops times in total\n",
+			CORO_SLOT_SIZE);
+	printf("(default %d). The server runs without -R, -r or -S.\n", CORO_OPS);
+	printf("-P is how to wait for completions: blocking (default), busy, \n");
+	printf("   or adaptive[:spin_usec] (spins %d usec before blocking)\n",
+			DEFAULT_SPIN_USEC);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in server_sockaddr;
+	struct rdma_event_channel *cm_event_channel = NULL;
+	struct rdma_cm_id *cm_id = NULL;
+	struct ibv_pd *pd = NULL;
+	struct rdma_conn conn;
+	struct rdma_conn_attr attr;
+	struct rdma_conn_param conn_param;
+	struct timespec start, end;
+	double elapsed;
+	int ret, option;
+	bzero(&server_sockaddr, sizeof server_sockaddr);
+	server_sockaddr.sin_family = AF_INET;
+	server_sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	while ((option = getopt(argc, argv, "a:p:P:s:d:n:")) != -1) {
+		switch (option) {
+			case 'a':
+				ret = get_addr(optarg, (struct sockaddr*) &server_sockaddr);
+				if (ret) {
+					rdma_error("Invalid IP \n");
+					return ret;
+				}
+				break;
+			case 'p':
+				server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0));
+				break;
+			case 'P':
+				if (rdma_poll_mode_parse(optarg, &poll_mode, &spin_usec))
+					usage();
+				break;
+			case 's':
+				slot_size = strtoul(optarg, NULL, 0);
+				break;
+			case 'd':
+				depth = strtoul(optarg, NULL, 0);
+				break;
+			case 'n':
+				ops = strtoull(optarg, NULL, 0);
+				break;
+			default:
+				usage();
+				break;
+		}
+	}
+	if (!server_sockaddr.sin_port)
+		server_sockaddr.sin_port = htons(DEFAULT_RDMA_PORT);
+	/* rdma_buffer_alloc() takes 32 bit lengths, and so do the metadata */
+	if (!slot_size || !depth || !ops || (uint64_t) slot_size * depth > UINT32_MAX / 2)
+		usage();
+	cm_event_channel = rdma_create_event_channel();
+	if (!cm_event_channel) {
+		rdma_error("Failed to create the event channel, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = rdma_conn_resolve(cm_event_channel, (struct sockaddr*) &server_sockaddr,
+			2000, &cm_id);
+	if (ret)
+		return ret;
+	pd = ibv_alloc_pd(cm_id->verbs);
+	if (!pd) {
+		rdma_error("Failed to alloc pd, errno: %d \n", -errno);
+		return -errno;
+	}
+	/* the queues take what the device gives, coroutines beyond that wait */
+	bzero(&attr, sizeof(attr));
+	attr.wr = DEFAULT_QUEUE_DEPTH;
+	attr.poll_mode = poll_mode;
+	attr.spin_usec = spin_usec;
+	ret = rdma_conn_init(&conn, cm_id, pd, &attr);
+	if (ret)
+		return ret;
+	buffer_mr = rdma_buffer_alloc(pd, 2 * slot_size * depth,
+			IBV_ACCESS_LOCAL_WRITE);
+	if (!buffer_mr) {
+		rdma_error("Failed to allocate the slots, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	/* the server allocates a buffer of the length we advertise */
+	client_metadata_attr.address = (uint64_t) buffer_mr->addr;
+	client_metadata_attr.length = slot_size * depth;
+	client_metadata_attr.stag.local_stag = buffer_mr->lkey;
+	client_metadata_mr = rdma_buffer_register(pd, &client_metadata_attr,
+			sizeof(client_metadata_attr), IBV_ACCESS_LOCAL_WRITE);
+	server_metadata_mr = rdma_buffer_register(pd, &server_metadata_attr,
+			sizeof(server_metadata_attr), IBV_ACCESS_LOCAL_WRITE);
+	if (!client_metadata_mr || !server_metadata_mr) {
+		rdma_error("Failed to register the buffers, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	bzero(&conn_param, sizeof(conn_param));
+	conn_param.retry_count = 3;
+	conn_param.rnr_retry_count = 7;
+	ret = rdma_conn_connect(&conn, cm_event_channel, &conn_param);
+	if (ret)
+		return ret;
+	printf("The client is connected successfully \n");
+
+	rdma::scheduler sched;
+	rdma::connection coro_conn(&conn, sched);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	sched.spawn(run_client(sched, coro_conn));
+	ret = sched.run();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (ret || failed) {
+		rdma_error("The checks failed, ret = %d \n", ret);
+	} else {
+		printf("Coroutines: %lu WRITE/READ rounds of %u bytes in %.3f s, %.2f MB/s, %u in flight, %lu doorbells, %lu deferred \n",
+				rounds, slot_size, elapsed,
+				elapsed > 0 ? 2.0 * rounds * slot_size / elapsed / 1e6 : 0.0,
+				depth, conn.posts, coro_conn.deferred());
+		if (mismatches) {
+			rdma_error("%lu slots did not match \n", mismatches);
+		} else {
+			printf("...\nSUCCESS, every slot read back what was written \n");
+		}
+	}
+
+	rdma_conn_disconnect(&conn, cm_event_channel);
+	rdma_conn_destroy(&conn);
+	if (rdma_destroy_id(cm_id))
+		rdma_error("Failed to destroy client id cleanly, %d \n", -errno);
+	rdma_buffer_deregister(server_metadata_mr);
+	rdma_buffer_deregister(client_metadata_mr);
+	rdma_buffer_free(buffer_mr);
+	if (ibv_dealloc_pd(pd))
+		rdma_error("Failed to destroy client protection domain cleanly, %d \n", -errno);
+	rdma_destroy_event_channel(cm_event_channel);
+	return ret || failed || mismatches;
+}
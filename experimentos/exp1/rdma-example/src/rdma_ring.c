@@ -0,0 +1,354 @@
+/*
+ * Implementation of the credit based ring buffer channel.
+ */
+
+#include "rdma_ring.h"
+
+/* Records start at 8 byte boundaries */
+#define RING_ALIGN(x) (((x) + 7) & ~7u)
+/* Work completions reaped per ibv_poll_cq call */
+#define RING_POLL_BATCH (16)
+
+static int ring_post_recv(struct rdma_ring *ring)
+{
+	struct ibv_recv_wr recv_wr, *bad_recv_wr = NULL;
+	int ret;
+	/* The data goes to the ring, the receive only carries the immediate */
+	bzero(&recv_wr, sizeof(recv_wr));
+	ret = ibv_post_recv(ring->qp, &recv_wr, &bad_recv_wr);
+	if (ret) {
+		rdma_error("Failed to post a ring receive, errno: %d \n", ret);
+		return -ret;
+	}
+	return 0;
+}
+
+int rdma_ring_deliver(struct rdma_ring *ring, struct ibv_wc *wc)
+{
+	/* the sender moved the tail, the receive goes straight back, or back to
+	 * the pool that reposts it in batches */
+	ring->flushed += ntohl(wc->imm_data);
+	ring->msgs++;
+	if (ring->srq)
+		return rdma_srq_release(ring->srq, wc->wr_id);
+	return ring_post_recv(ring);
+}
+
+/* Reaps whatever is in the CQ without blocking, returns the number of WCs */
+static int ring_reap(struct rdma_ring *ring)
+{
+	struct ibv_wc wc[RING_POLL_BATCH];
+	int i, ret, n;
+	n = ibv_poll_cq(ring->cq, RING_POLL_BATCH, wc);
+	if (n < 0) {
+		rdma_error("Failed to poll cq for wc due to %d \n", n);
+		return n;
+	}
+	for (i = 0; i < n; i++) {
+		if (wc[i].status != IBV_WC_SUCCESS) {
+			rdma_error("Work completion (WC) has error status: %s at index %d",
+					ibv_wc_status_str(wc[i].status), i);
+			return -(wc[i].status);
+		}
+		if (wc[i].opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+			ret = rdma_ring_deliver(ring, &wc[i]);
+			if (ret)
+				return ret;
+		} else {
+			ring->outstanding--;
+		}
+	}
+	return n;
+}
+
+/* Waits for at least one work completion, spinning or sleeping as the poller says */
+static int ring_wait(struct rdma_ring *ring)
+{
+	int ret = ring_reap(ring);
+	if (ret > 0)
+		ring->poller->spin_start = 0;
+	if (ret != 0)
+		return ret < 0 ? ret : 0;
+	return rdma_poller_idle(ring->poller);
+}
+
+/* Receiver side: tells the sender how far we consumed */
+static int ring_send_credit(struct rdma_ring *ring)
+{
+	struct ibv_send_wr send_wr, *bad_send_wr = NULL;
+	struct ibv_sge sge;
+	int ret;
+	/* the credit buffer is the source of the write, do not touch it while in flight */
+	while (ring->outstanding) {
+		ret = ring_reap(ring);
+		if (ret < 0)
+			return ret;
+	}
+	ring->credit->head = ring->head;
+	ring->credit->msgs = ring->msgs;
+	sge.addr = (uint64_t) ring->credit_mr->addr;
+	sge.length = sizeof(struct rdma_ring_credit);
+	sge.lkey = ring->credit_mr->lkey;
+	bzero(&send_wr, sizeof(send_wr));
+	send_wr.sg_list = &sge;
+	send_wr.num_sge = 1;
+	send_wr.opcode = IBV_WR_RDMA_WRITE;
+	send_wr.send_flags = IBV_SEND_SIGNALED;
+	send_wr.wr.rdma.rkey = ring->remote.stag.remote_stag;
+	send_wr.wr.rdma.remote_addr = ring->remote.address;
+	ret = ibv_post_send(ring->qp, &send_wr, &bad_send_wr);
+	if (ret) {
+		rdma_error("Failed to post the ring credit, errno: %d \n", ret);
+		return -ret;
+	}
+	ring->outstanding++;
+	ring->credited_head = ring->head;
+	ring->credited_msgs = ring->msgs;
+	return 0;
+}
+
+int rdma_ring_sender_alloc(struct rdma_ring *ring, struct ibv_pd *pd,
+		uint32_t capacity, struct rdma_buffer_attr *attr)
+{
+	if (capacity < 64 || capacity % 8) {
+		rdma_error("Ring capacity must be a multiple of 8 and at least 64 bytes\n");
+		return -EINVAL;
+	}
+	bzero(ring, sizeof(*ring));
+	ring->capacity = capacity;
+	ring->owns_ring = 1;
+	ring->ring_mr = rdma_buffer_alloc(pd, capacity, IBV_ACCESS_LOCAL_WRITE);
+	if (!ring->ring_mr) {
+		rdma_error("Failed to allocate the local ring, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	ring->credit_mr = rdma_buffer_alloc(pd, sizeof(struct rdma_ring_credit),
+			(IBV_ACCESS_LOCAL_WRITE|
+			 IBV_ACCESS_REMOTE_WRITE));
+	if (!ring->credit_mr) {
+		rdma_error("Failed to allocate the credit word, -ENOMEM\n");
+		rdma_buffer_free(ring->ring_mr);
+		return -ENOMEM;
+	}
+	ring->credit = ring->credit_mr->addr;
+	attr->address = (uint64_t) ring->credit_mr->addr;
+	attr->length = capacity;
+	attr->stag.local_stag = ring->credit_mr->rkey;
+	return 0;
+}
+
+int rdma_ring_sender_start(struct rdma_ring *ring, struct ibv_qp *qp,
+		struct ibv_cq *cq, struct rdma_buffer_attr *remote,
+		uint32_t recv_depth)
+{
+	if (remote->length != ring->capacity) {
+		rdma_error("Remote ring has %u bytes, expected %u \n",
+				remote->length, ring->capacity);
+		return -EINVAL;
+	}
+	ring->qp = qp;
+	ring->cq = cq;
+	ring->remote = *remote;
+	ring->recv_depth = recv_depth;
+	ring->max_outstanding = recv_depth;
+	return 0;
+}
+
+int rdma_ring_receiver_init(struct rdma_ring *ring, struct ibv_pd *pd,
+		struct ibv_qp *qp, struct rdma_poller *poller,
+		struct ibv_mr *ring_mr,
+		struct rdma_buffer_attr *remote, uint32_t recv_depth,
+		struct rdma_srq *srq)
+{
+	uint32_t i;
+	int ret;
+	bzero(ring, sizeof(*ring));
+	ring->qp = qp;
+	ring->poller = poller;
+	ring->cq = poller->cq;
+	ring->ring_mr = ring_mr;
+	ring->remote = *remote;
+	ring->capacity = ring_mr->length;
+	ring->recv_depth = recv_depth;
+	ring->srq = srq;
+	ring->max_outstanding = 1;
+	if (ring->capacity < 64 || ring->capacity % 8) {
+		rdma_error("Ring capacity must be a multiple of 8 and at least 64 bytes\n");
+		return -EINVAL;
+	}
+	ring->credit_mr = rdma_buffer_alloc(pd, sizeof(struct rdma_ring_credit),
+			IBV_ACCESS_LOCAL_WRITE);
+	if (!ring->credit_mr) {
+		rdma_error("Failed to allocate the credit buffer, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	ring->credit = ring->credit_mr->addr;
+	for (i = 0; !srq && i < recv_depth; i++) {
+		ret = ring_post_recv(ring);
+		if (ret)
+			return ret;
+	}
+	debug("Ring receiver of %u bytes with %u receives is ready \n",
+			ring->capacity, recv_depth);
+	return 0;
+}
+
+int rdma_ring_flush(struct rdma_ring *ring)
+{
+	struct ibv_send_wr send_wr, *bad_send_wr = NULL;
+	struct ibv_sge sge;
+	uint32_t offset = ring->flushed % ring->capacity;
+	int ret;
+	if (ring->tail == ring->flushed)
+		return 0;
+	/* every write consumes one of the receiver's receives */
+	while (ring->msgs - ring->credit->msgs >= ring->recv_depth ||
+			ring->outstanding >= ring->max_outstanding) {
+		ret = ring_reap(ring);
+		if (ret < 0)
+			return ret;
+	}
+	/* a flush never crosses the end of the ring, see rdma_ring_write() */
+	if (ring->tail - ring->flushed > ring->capacity - offset) {
+		rdma_error("Flush of %lu bytes at %u crosses the end of the ring \n",
+				ring->tail - ring->flushed, offset);
+		return -EFAULT;
+	}
+	sge.addr = (uint64_t) ring->ring_mr->addr + offset;
+	sge.length = ring->tail - ring->flushed;
+	sge.lkey = ring->ring_mr->lkey;
+	bzero(&send_wr, sizeof(send_wr));
+	send_wr.sg_list = &sge;
+	send_wr.num_sge = 1;
+	send_wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+	send_wr.send_flags = IBV_SEND_SIGNALED;
+	send_wr.imm_data = htonl(sge.length);
+	send_wr.wr.rdma.rkey = ring->remote.stag.remote_stag;
+	send_wr.wr.rdma.remote_addr = ring->remote.address + offset;
+	ret = ibv_post_send(ring->qp, &send_wr, &bad_send_wr);
+	if (ret) {
+		rdma_error("Failed to write to the remote ring, errno: %d \n", ret);
+		return -ret;
+	}
+	ring->msgs++;
+	ring->outstanding++;
+	ring->flushed = ring->tail;
+	return 0;
+}
+
+int rdma_ring_write(struct rdma_ring *ring, const void *data, uint32_t length)
+{
+	struct rdma_ring_hdr *hdr;
+	char *base = ring->ring_mr->addr;
+	uint32_t need = RING_ALIGN(sizeof(struct rdma_ring_hdr) + length);
+	uint32_t pos = ring->tail % ring->capacity;
+	uint32_t pad = ring->capacity - pos < need ? ring->capacity - pos : 0;
+	int ret;
+	if (need > ring->capacity / 2) {
+		rdma_error("Record of %u bytes does not fit in the ring \n", length);
+		return -EINVAL;
+	}
+	/* wait until the receiver consumed enough, padding included */
+	while (ring->tail + pad + need - ring->credit->head > ring->capacity) {
+		ret = ring_reap(ring);
+		if (ret < 0)
+			return ret;
+	}
+	if (pad) {
+		hdr = (struct rdma_ring_hdr *) (base + pos);
+		hdr->length = RDMA_RING_PAD;
+		ring->tail += pad;
+		ret = rdma_ring_flush(ring);
+		if (ret)
+			return ret;
+		pos = 0;
+	}
+	hdr = (struct rdma_ring_hdr *) (base + pos);
+	hdr->length = length;
+	hdr->reserved = 0;
+	memcpy(hdr + 1, data, length);
+	ring->tail += need;
+	/* batch small records into larger writes, but a record that fills the
+	 * ring to its end goes out now, the next one starts over at offset 0 */
+	if (ring->tail % ring->capacity == 0 ||
+			ring->tail - ring->flushed >= ring->capacity / 8)
+		return rdma_ring_flush(ring);
+	return 0;
+}
+
+int rdma_ring_drain(struct rdma_ring *ring)
+{
+	int ret = rdma_ring_flush(ring);
+	while (!ret && ring->outstanding) {
+		ret = ring_reap(ring);
+		if (ret > 0)
+			ret = 0;
+	}
+	return ret;
+}
+
+static int ring_read(struct rdma_ring *ring, void **data, uint32_t *length,
+		int wait)
+{
+	struct rdma_ring_hdr *hdr;
+	char *base = ring->ring_mr->addr;
+	int ret;
+	while (1) {
+		if (ring->head == ring->flushed) {
+			ret = ring_reap(ring);
+			if (ret < 0)
+				return ret;
+		}
+		while (ring->head == ring->flushed) {
+			/* about to wait, the sender may be waiting for us as well */
+			if (ring->head != ring->credited_head ||
+					ring->msgs != ring->credited_msgs) {
+				ret = ring_send_credit(ring);
+				if (ret)
+					return ret;
+			}
+			if (!wait)
+				return -EAGAIN;
+			ret = ring_wait(ring);
+			if (ret)
+				return ret;
+		}
+		hdr = (struct rdma_ring_hdr *) (base + ring->head % ring->capacity);
+		if (hdr->length != RDMA_RING_PAD)
+			break;
+		ring->head += ring->capacity - ring->head % ring->capacity;
+	}
+	*data = hdr + 1;
+	*length = hdr->length;
+	ring->current = RING_ALIGN(sizeof(struct rdma_ring_hdr) + hdr->length);
+	return 0;
+}
+
+int rdma_ring_read(struct rdma_ring *ring, void **data, uint32_t *length)
+{
+	return ring_read(ring, data, length, 1);
+}
+
+int rdma_ring_try_read(struct rdma_ring *ring, void **data, uint32_t *length)
+{
+	return ring_read(ring, data, length, 0);
+}
+
+int rdma_ring_consume(struct rdma_ring *ring)
+{
+	ring->head += ring->current;
+	ring->current = 0;
+	if (ring->head - ring->credited_head >= ring->capacity / 4 ||
+			ring->msgs - ring->credited_msgs >= ring->recv_depth / 2)
+		return ring_send_credit(ring);
+	return 0;
+}
+
+void rdma_ring_destroy(struct rdma_ring *ring)
+{
+	if (ring->owns_ring && ring->ring_mr)
+		rdma_buffer_free(ring->ring_mr);
+	if (ring->credit_mr)
+		rdma_buffer_free(ring->credit_mr);
+	bzero(ring, sizeof(*ring));
+}
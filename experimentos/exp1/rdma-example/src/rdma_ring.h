@@ -0,0 +1,176 @@
+/*
+ * Credit based ring buffer channel on top of an RC queue pair.
+ *
+ * The receiver exposes a circular buffer, the sender appends records at the
+ * tail with RDMA_WRITE_WITH_IMM (the immediate carries how many bytes the tail
+ * moved) and the receiver gives the space back by RDMA writing its consumed
+ * head into a credit word registered by the sender. The sender never writes
+ * over data that was not consumed, and there is no request/response round
+ * trip per record.
+ *
+ * Records are 8 byte aligned and start with a struct rdma_ring_hdr. A record
+ * never wraps around: when it does not fit before the end of the ring, the
+ * sender marks the rest of the ring with RDMA_RING_PAD and starts over at 0.
+ */
+
+#ifndef RDMA_RING_H
+#define RDMA_RING_H
+
+#include "rdma_common.h"
+#include "rdma_srq.h"
+
+/* Length of the padding record that closes the ring before wrapping */
+#define RDMA_RING_PAD (0xffffffffu)
+/* Default capacity of the ring in bytes */
+#define RDMA_RING_DEFAULT_CAPACITY (1 << 20)
+/* Receives the receiver keeps posted, so writes the sender may have in flight */
+#define RDMA_RING_RECV_DEPTH (32)
+
+struct __attribute((packed)) rdma_ring_hdr {
+	uint32_t length;
+	uint32_t reserved;
+};
+
+/* What the receiver writes back into the sender's credit word */
+struct __attribute((packed)) rdma_ring_credit {
+	/* bytes consumed by the receiver */
+	uint64_t head;
+	/* RDMA_WRITE_WITH_IMM reaped by the receiver, its receives are posted again */
+	uint64_t msgs;
+};
+
+struct rdma_ring {
+	struct ibv_qp *qp;
+	struct ibv_cq *cq;
+	/* receiver: how to wait for the sender, the sender always spins because 
+	 * credits land without a completion */
+	struct rdma_poller *poller;
+	/* sender: local copy of the ring, receiver: the ring itself */
+	struct ibv_mr *ring_mr;
+	/* sender: the credit word, receiver: the source of credit writes */
+	struct ibv_mr *credit_mr;
+	volatile struct rdma_ring_credit *credit;
+	/* sender: the remote ring, receiver: the remote credit word */
+	struct rdma_buffer_attr remote;
+	uint32_t capacity;
+	/* receives the receiver keeps posted, bounds the writes in flight */
+	uint32_t recv_depth;
+	/* receiver: when set, receives come from this pool instead of the QP */
+	struct rdma_srq *srq;
+	/* bytes appended / consumed since the start, never wrap */
+	uint64_t tail;
+	uint64_t head;
+	/* sender: bytes written to the remote ring, receiver: bytes announced */
+	uint64_t flushed;
+	/* sender: writes posted, receiver: writes reaped */
+	uint64_t msgs;
+	/* receiver: values last written into the sender's credit word */
+	uint64_t credited_head;
+	uint64_t credited_msgs;
+	/* receiver: size of the record returned by rdma_ring_read() */
+	uint32_t current;
+	/* send work requests not completed yet */
+	uint32_t outstanding;
+	uint32_t max_outstanding;
+	/* the sender allocated ring_mr, the receiver's belongs to the caller */
+	int owns_ring;
+};
+
+/**
+ * @brief Allocates the local side of a sender. The credit word must be
+ * advertised to the receiver, @attr is filled with its location and with the
+ * capacity the sender asks for.
+ * @param ring: ring to initialize
+ * @param pd: protection domain of the connection
+ * @param capacity: size of the ring in bytes, multiple of 8
+ * @param attr: where to store what has to be sent to the receiver
+ */
+int rdma_ring_sender_alloc(struct rdma_ring *ring, struct ibv_pd *pd,
+		uint32_t capacity, struct rdma_buffer_attr *attr);
+
+/**
+ * @brief Starts a sender once the receiver advertised its ring.
+ * @param ring: ring prepared with rdma_ring_sender_alloc()
+ * @param qp: connected queue pair
+ * @param cq: completion queue of the send side of qp
+ * @param remote: location of the remote ring
+ * @param recv_depth: number of receives the receiver keeps posted
+ */
+int rdma_ring_sender_start(struct rdma_ring *ring, struct ibv_qp *qp,
+		struct ibv_cq *cq, struct rdma_buffer_attr *remote,
+		uint32_t recv_depth);
+
+/**
+ * @brief Initializes a receiver on an already registered ring and posts its
+ * receives. If this happens after the ring was advertised, the sender must
+ * connect with an rnr_retry_count that covers the gap.
+ * @param ring: ring to initialize
+ * @param pd: protection domain of the connection
+ * @param qp: connected queue pair
+ * @param poller: poller of the completion queue of qp, decides whether to spin 
+ * or sleep when the ring is empty
+ * @param ring_mr: the ring, registered with IBV_ACCESS_REMOTE_WRITE
+ * @param remote: location of the sender's credit word
+ * @param recv_depth: number of receives to keep posted, or, with an SRQ, the
+ * writes the sender may have in flight
+ * @param srq: shared receive queue of qp, NULL if qp has its own receive queue
+ */
+int rdma_ring_receiver_init(struct rdma_ring *ring, struct ibv_pd *pd,
+		struct ibv_qp *qp, struct rdma_poller *poller,
+		struct ibv_mr *ring_mr,
+		struct rdma_buffer_attr *remote, uint32_t recv_depth,
+		struct rdma_srq *srq);
+
+/**
+ * @brief Receiver side: accounts for a write of the sender whose completion
+ * the caller reaped from the CQ itself, e.g. before the ring was initialized.
+ * Returns 0 or a negative errno.
+ * @param ring: receiver ring
+ * @param wc: successful IBV_WC_RECV_RDMA_WITH_IMM work completion of the ring
+ */
+int rdma_ring_deliver(struct rdma_ring *ring, struct ibv_wc *wc);
+
+/**
+ * @brief Appends a record, waiting for credits if the ring is full. Records
+ * are batched, call rdma_ring_flush() to push them out.
+ * @param ring: sender ring
+ * @param data: record payload
+ * @param length: payload length, at most half of the capacity minus the header
+ */
+int rdma_ring_write(struct rdma_ring *ring, const void *data, uint32_t length);
+
+/**
+ * @brief Writes every appended record to the receiver.
+ */
+int rdma_ring_flush(struct rdma_ring *ring);
+
+/**
+ * @brief Flushes the ring and waits until every write is completed.
+ */
+int rdma_ring_drain(struct rdma_ring *ring);
+
+/**
+ * @brief Waits for the next record. The payload stays valid until
+ * rdma_ring_consume() is called.
+ * @param ring: receiver ring
+ * @param data: where to store the payload address
+ * @param length: where to store the payload length
+ */
+int rdma_ring_read(struct rdma_ring *ring, void **data, uint32_t *length);
+
+/**
+ * @brief Same as rdma_ring_read() but returns -EAGAIN instead of waiting when
+ * no record arrived, for callers that wait on the completion channel themselves.
+ */
+int rdma_ring_try_read(struct rdma_ring *ring, void **data, uint32_t *length);
+
+/**
+ * @brief Releases the record returned by rdma_ring_read(). The space goes
+ * back to the sender in batches.
+ */
+int rdma_ring_consume(struct rdma_ring *ring);
+
+/* Frees what was allocated by rdma_ring_sender_alloc() or rdma_ring_receiver_init() */
+void rdma_ring_destroy(struct rdma_ring *ring);
+
+#endif /* RDMA_RING_H */
@@ -0,0 +1,349 @@
+/*
+ * Implementation of the send/recv RPC layer.
+ */
+
+#include "rdma_rpc.h"
+
+/* Work completions reaped per ibv_poll_cq call */
+#define RPC_POLL_BATCH (32)
+
+static inline void *rpc_recv_buf(struct rdma_rpc *rpc, uint32_t index)
+{
+	return (char *) rpc->recv_mr->addr + (uint64_t) index * rpc->msg_size;
+}
+
+static inline void *rpc_send_buf(struct rdma_rpc *rpc, uint64_t seq)
+{
+	return (char *) rpc->send_mr->addr + (seq % rpc->depth) * rpc->msg_size;
+}
+
+/* Posts the receives in rpc->repost again, all of them with one ibv_post_recv() */
+static int rpc_repost(struct rdma_rpc *rpc)
+{
+	struct ibv_recv_wr *bad_recv_wr = NULL;
+	uint32_t i;
+	int ret;
+	if (!rpc->nrepost)
+		return 0;
+	for (i = 0; i < rpc->nrepost; i++) {
+		rpc->recv_sge[i].addr = (uint64_t) rpc_recv_buf(rpc, rpc->repost[i]);
+		rpc->recv_sge[i].length = rpc->msg_size;
+		rpc->recv_sge[i].lkey = rpc->recv_mr->lkey;
+		rpc->recv_wr[i].wr_id = rpc->repost[i];
+		rpc->recv_wr[i].sg_list = &rpc->recv_sge[i];
+		rpc->recv_wr[i].num_sge = 1;
+		rpc->recv_wr[i].next = i + 1 < rpc->nrepost ? &rpc->recv_wr[i + 1] : NULL;
+	}
+	ret = ibv_post_recv(rpc->qp, rpc->recv_wr, &bad_recv_wr);
+	if (ret) {
+		rdma_error("Failed to post %u RPC receives, errno: %d \n",
+				rpc->nrepost, ret);
+		return -ret;
+	}
+	rpc->nrepost = 0;
+	return 0;
+}
+
+/* Posts the receives handled so far, then the queued sends, in that order so the
+ * other end never gets an answer before we are ready for what follows it */
+static int rpc_push(struct rdma_rpc *rpc)
+{
+	int ret = rpc_repost(rpc);
+	if (ret)
+		return ret;
+	return rdma_post_batch_flush(&rpc->batch);
+}
+
+void rdma_rpc_deliver(struct rdma_rpc *rpc, struct ibv_wc *wc)
+{
+	struct rdma_rpc_msg *msg;
+	/* at most depth receives are posted, so this never wraps */
+	msg = &rpc->pending[(rpc->pending_head + rpc->npending) % rpc->depth];
+	msg->index = wc->wr_id;
+	msg->length = wc->byte_len;
+	rpc->npending++;
+}
+
+/* Reaps whatever is in the CQ without blocking, returns the number of WCs */
+static int rpc_reap(struct rdma_rpc *rpc)
+{
+	struct ibv_wc wc[RPC_POLL_BATCH];
+	int i, n;
+	n = ibv_poll_cq(rpc->cq, RPC_POLL_BATCH, wc);
+	if (n < 0) {
+		rdma_error("Failed to poll cq for wc due to %d \n", n);
+		return n;
+	}
+	for (i = 0; i < n; i++) {
+		if (wc[i].status != IBV_WC_SUCCESS) {
+			rdma_error("Work completion (WC) has error status: %s at index %d",
+					ibv_wc_status_str(wc[i].status), i);
+			return -(wc[i].status);
+		}
+		if (wc[i].opcode == IBV_WC_RECV) {
+			rdma_rpc_deliver(rpc, &wc[i]);
+		} else {
+			rdma_post_batch_complete(&rpc->batch, &wc[i]);
+		}
+	}
+	return n;
+}
+
+/* Waits until the send buffer of the next send is no longer in flight */
+static int rpc_send_room(struct rdma_rpc *rpc)
+{
+	int ret;
+	while (rpc->batch.queued - rpc->batch.completed >= rpc->depth) {
+		ret = rpc_push(rpc);
+		if (ret)
+			return ret;
+		ret = rpc_reap(rpc);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/* Queues the message built in the send buffer of the next send */
+static int rpc_queue_send(struct rdma_rpc *rpc, struct rdma_rpc_hdr *hdr)
+{
+	struct ibv_send_wr send_wr;
+	struct ibv_sge sge;
+	int64_t seq;
+	sge.addr = (uint64_t) hdr;
+	sge.length = sizeof(*hdr) + hdr->length;
+	sge.lkey = rpc->send_mr->lkey;
+	bzero(&send_wr, sizeof(send_wr));
+	send_wr.sg_list = &sge;
+	send_wr.num_sge = 1;
+	send_wr.opcode = IBV_WR_SEND;
+	if (sge.length <= rpc->max_inline)
+		send_wr.send_flags = IBV_SEND_INLINE;
+	seq = rdma_post_batch_add(&rpc->batch, &send_wr);
+	return seq < 0 ? seq : 0;
+}
+
+/* Server: runs the handler of a request and queues its response */
+static int rpc_serve_one(struct rdma_rpc *rpc, struct rdma_rpc_msg *msg)
+{
+	struct rdma_rpc_hdr *req = rpc_recv_buf(rpc, msg->index), *resp;
+	uint32_t resp_length;
+	int ret;
+	if (msg->length < sizeof(*req) ||
+			req->length > msg->length - sizeof(*req)) {
+		rdma_error("Malformed RPC request of %u bytes \n", msg->length);
+		return -EPROTO;
+	}
+	ret = rpc_send_room(rpc);
+	if (ret)
+		return ret;
+	resp = rpc_send_buf(rpc, rpc->batch.queued);
+	resp->id = req->id;
+	resp->method = req->method;
+	resp_length = rpc->msg_size - sizeof(*resp);
+	if (req->method < RDMA_RPC_MAX_METHODS && rpc->handlers[req->method])
+		ret = rpc->handlers[req->method](rpc->handler_args[req->method],
+				req + 1, req->length, resp + 1, &resp_length);
+	else
+		ret = -ENOSYS;
+	if (ret || resp_length > rpc->msg_size - sizeof(*resp))
+		resp_length = 0;
+	resp->status = ret;
+	resp->length = resp_length;
+	rpc->requests++;
+	return rpc_queue_send(rpc, resp);
+}
+
+/* Client: hands a response to the callback of its request */
+static int rpc_complete_one(struct rdma_rpc *rpc, struct rdma_rpc_msg *msg)
+{
+	struct rdma_rpc_hdr *resp = rpc_recv_buf(rpc, msg->index);
+	struct rdma_rpc_call *call;
+	uint32_t index;
+	if (msg->length < sizeof(*resp) ||
+			resp->length > msg->length - sizeof(*resp)) {
+		rdma_error("Malformed RPC response of %u bytes \n", msg->length);
+		return -EPROTO;
+	}
+	index = (uint32_t) resp->id;
+	if (index >= rpc->depth || rpc->calls[index].id != resp->id ||
+			!rpc->calls[index].callback) {
+		rdma_error("RPC response to unknown request %lu \n", resp->id);
+		return -EPROTO;
+	}
+	call = &rpc->calls[index];
+	call->callback(call->arg, resp->status, resp + 1, resp->length);
+	/* the slot stays taken until the receive is posted again */
+	call->callback = NULL;
+	rpc->done_calls[rpc->ndone++] = index;
+	rpc->responses++;
+	return 0;
+}
+
+int rdma_rpc_init(struct rdma_rpc *rpc, struct ibv_pd *pd,
+		struct ibv_qp *qp, struct rdma_poller *poller,
+		uint32_t depth, uint32_t msg_size, uint32_t max_inline,
+		int server)
+{
+	uint32_t i;
+	int ret;
+	bzero(rpc, sizeof(*rpc));
+	if (!depth || msg_size <= sizeof(struct rdma_rpc_hdr)) {
+		rdma_error("RPC needs a depth and messages larger than the header\n");
+		return -EINVAL;
+	}
+	rpc->qp = qp;
+	rpc->poller = poller;
+	rpc->cq = poller->cq;
+	rpc->server = server;
+	rpc->depth = depth;
+	rpc->msg_size = msg_size;
+	rpc->max_inline = max_inline;
+	rdma_post_batch_init(&rpc->batch, qp, RDMA_RPC_SIGNAL_EVERY);
+	rpc->recv_mr = rdma_buffer_alloc(pd, depth * msg_size,
+			IBV_ACCESS_LOCAL_WRITE);
+	rpc->send_mr = rdma_buffer_alloc(pd, depth * msg_size,
+			IBV_ACCESS_LOCAL_WRITE);
+	rpc->pending = calloc(depth, sizeof(*rpc->pending));
+	rpc->repost = calloc(depth, sizeof(*rpc->repost));
+	rpc->recv_wr = calloc(depth, sizeof(*rpc->recv_wr));
+	rpc->recv_sge = calloc(depth, sizeof(*rpc->recv_sge));
+	if (!rpc->recv_mr || !rpc->send_mr || !rpc->pending || !rpc->repost ||
+			!rpc->recv_wr || !rpc->recv_sge) {
+		rdma_error("Failed to allocate the RPC buffers, -ENOMEM\n");
+		rdma_rpc_destroy(rpc);
+		return -ENOMEM;
+	}
+	if (!server) {
+		rpc->calls = calloc(depth, sizeof(*rpc->calls));
+		rpc->free_calls = calloc(depth, sizeof(*rpc->free_calls));
+		rpc->done_calls = calloc(depth, sizeof(*rpc->done_calls));
+		if (!rpc->calls || !rpc->free_calls || !rpc->done_calls) {
+			rdma_error("Failed to allocate the RPC calls, -ENOMEM\n");
+			rdma_rpc_destroy(rpc);
+			return -ENOMEM;
+		}
+		for (i = 0; i < depth; i++)
+			rpc->free_calls[i] = depth - 1 - i;
+		rpc->nfree = depth;
+	}
+	/* the whole ring goes out as one chain */
+	for (i = 0; i < depth; i++)
+		rpc->repost[i] = i;
+	rpc->nrepost = depth;
+	ret = rpc_repost(rpc);
+	if (ret) {
+		rdma_rpc_destroy(rpc);
+		return ret;
+	}
+	debug("RPC %s with %u receives of %u bytes is ready \n",
+			server ? "server" : "client", depth, msg_size);
+	return 0;
+}
+
+void rdma_rpc_register(struct rdma_rpc *rpc, uint16_t method,
+		rdma_rpc_handler handler, void *arg)
+{
+	if (method >= RDMA_RPC_MAX_METHODS) {
+		rdma_error("RPC method %u is out of range \n", method);
+		return;
+	}
+	rpc->handlers[method] = handler;
+	rpc->handler_args[method] = arg;
+}
+
+int rdma_rpc_call(struct rdma_rpc *rpc, uint16_t method,
+		const void *req, uint32_t length,
+		rdma_rpc_callback callback, void *arg, uint64_t *id)
+{
+	struct rdma_rpc_hdr *hdr;
+	struct rdma_rpc_call *call;
+	uint32_t index;
+	int ret;
+	if (length > rpc->msg_size - sizeof(*hdr))
+		return -EMSGSIZE;
+	if (!rpc->nfree)
+		return -EAGAIN;
+	ret = rpc_send_room(rpc);
+	if (ret)
+		return ret;
+	index = rpc->free_calls[--rpc->nfree];
+	call = &rpc->calls[index];
+	call->id = (++rpc->next_id << 32) | index;
+	call->callback = callback;
+	call->arg = arg;
+	hdr = rpc_send_buf(rpc, rpc->batch.queued);
+	hdr->id = call->id;
+	hdr->method = method;
+	hdr->status = 0;
+	hdr->length = length;
+	memcpy(hdr + 1, req, length);
+	ret = rpc_queue_send(rpc, hdr);
+	if (ret) {
+		call->callback = NULL;
+		rpc->free_calls[rpc->nfree++] = index;
+		return ret;
+	}
+	if (id)
+		*id = call->id;
+	return 0;
+}
+
+int rdma_rpc_poll(struct rdma_rpc *rpc)
+{
+	struct rdma_rpc_msg msg;
+	int ret, handled = 0;
+	ret = rdma_post_batch_flush(&rpc->batch);
+	if (ret)
+		return ret;
+	ret = rpc_reap(rpc);
+	if (ret < 0)
+		return ret;
+	while (rpc->npending) {
+		msg = rpc->pending[rpc->pending_head];
+		rpc->pending_head = (rpc->pending_head + 1) % rpc->depth;
+		rpc->npending--;
+		if (rpc->server)
+			ret = rpc_serve_one(rpc, &msg);
+		else
+			ret = rpc_complete_one(rpc, &msg);
+		if (ret)
+			return ret;
+		rpc->repost[rpc->nrepost++] = msg.index;
+		handled++;
+	}
+	/* receives first: responses, or the requests of freed slots, come after */
+	ret = rpc_push(rpc);
+	if (ret)
+		return ret;
+	while (rpc->ndone)
+		rpc->free_calls[rpc->nfree++] = rpc->done_calls[--rpc->ndone];
+	return handled;
+}
+
+int rdma_rpc_wait(struct rdma_rpc *rpc)
+{
+	int ret = rdma_rpc_poll(rpc);
+	if (ret > 0)
+		rpc->poller->spin_start = 0;
+	if (ret != 0)
+		return ret;
+	ret = rdma_poller_idle(rpc->poller);
+	return ret < 0 ? ret : 0;
+}
+
+void rdma_rpc_destroy(struct rdma_rpc *rpc)
+{
+	if (rpc->recv_mr)
+		rdma_buffer_free(rpc->recv_mr);
+	if (rpc->send_mr)
+		rdma_buffer_free(rpc->send_mr);
+	free(rpc->pending);
+	free(rpc->repost);
+	free(rpc->recv_wr);
+	free(rpc->recv_sge);
+	free(rpc->calls);
+	free(rpc->free_calls);
+	free(rpc->done_calls);
+	bzero(rpc, sizeof(*rpc));
+}
@@ -0,0 +1,179 @@
+/*
+ * Request/response RPC layer on top of an RC queue pair.
+ *
+ * Both ends keep a ring of `depth` receive buffers of `msg_size` bytes posted.
+ * A message is a struct rdma_rpc_hdr followed by its payload and goes out with
+ * a SEND, inline when it fits in the inline data of the QP. Every request gets
+ * exactly one response, matched to it by the id in the header, and the client
+ * never has more than `depth` requests outstanding, so neither end runs out of
+ * receives: the receives a poll consumed are posted again, in one chained
+ * ibv_post_recv(), before the responses to them are sent and before their
+ * call slots are given back.
+ *
+ * Sends go through a struct rdma_post_batch: the requests issued between two
+ * polls, and the responses of one poll, share a doorbell and only one out of
+ * RDMA_RPC_SIGNAL_EVERY is signaled.
+ */
+
+#ifndef RDMA_RPC_H
+#define RDMA_RPC_H
+
+#include "rdma_common.h"
+
+/* Default number of requests in flight, and of receives posted per side */
+#define RDMA_RPC_DEFAULT_DEPTH (128)
+/* Default size of a message, header included */
+#define RDMA_RPC_DEFAULT_MSG_SIZE (256)
+#define RDMA_RPC_MAX_METHODS (16)
+/* One send out of that many is signaled */
+#define RDMA_RPC_SIGNAL_EVERY (16)
+
+/* Methods of rdma_server -r */
+#define RDMA_RPC_ECHO (0)
+
+struct __attribute((packed)) rdma_rpc_hdr {
+	/* chosen by the client, echoed in the response */
+	uint64_t id;
+	uint16_t method;
+	/* response: what the handler returned, 0 or a negative errno */
+	int16_t status;
+	/* payload bytes after the header */
+	uint32_t length;
+};
+
+/**
+ * Server side handler of a method. The response is built in place, in the send
+ * buffer it goes out from. Returns 0 or a negative errno for the client.
+ * @arg: argument given to rdma_rpc_register()
+ * @req, @req_length: payload of the request, valid until the handler returns
+ * @resp: where to write the payload of the response
+ * @resp_length: room in resp on entry, length of the response on return
+ */
+typedef int (*rdma_rpc_handler)(void *arg, const void *req, uint32_t req_length,
+		void *resp, uint32_t *resp_length);
+
+/**
+ * Client side completion of a request. The response is only valid until the
+ * callback returns. The callback may issue new requests.
+ * @status: what the handler returned, -ENOSYS for an unknown method
+ */
+typedef void (*rdma_rpc_callback)(void *arg, int status, const void *resp,
+		uint32_t resp_length);
+
+struct rdma_rpc_call {
+	uint64_t id;
+	rdma_rpc_callback callback;
+	void *arg;
+};
+
+/* A receive that completed and was not handled yet */
+struct rdma_rpc_msg {
+	uint32_t index;
+	uint32_t length;
+};
+
+struct rdma_rpc {
+	struct ibv_qp *qp;
+	struct ibv_cq *cq;
+	struct rdma_poller *poller;
+	int server;
+	uint32_t depth;
+	uint32_t msg_size;
+	/* messages up to that size go with IBV_SEND_INLINE */
+	uint32_t max_inline;
+	/* depth receive buffers, and depth send buffers used in turn */
+	struct ibv_mr *recv_mr, *send_mr;
+	struct rdma_post_batch batch;
+	/* completed receives, in order */
+	struct rdma_rpc_msg *pending;
+	uint32_t pending_head, npending;
+	/* handled receives to post again, with the WRs to chain them */
+	uint32_t *repost;
+	uint32_t nrepost;
+	struct ibv_recv_wr *recv_wr;
+	struct ibv_sge *recv_sge;
+	/* client: outstanding requests, indexed by the low 32 bits of their id */
+	struct rdma_rpc_call *calls;
+	uint32_t *free_calls;
+	uint32_t nfree;
+	uint64_t next_id;
+	/* client: calls whose response was handled, freed after the repost */
+	uint32_t *done_calls;
+	uint32_t ndone;
+	/* server */
+	rdma_rpc_handler handlers[RDMA_RPC_MAX_METHODS];
+	void *handler_args[RDMA_RPC_MAX_METHODS];
+	uint64_t requests, responses;
+};
+
+/**
+ * @brief Allocates and registers the buffers of one end and posts its receives.
+ * The QP needs room for depth sends and depth receives, its CQ for 2 * depth
+ * work completions. If this happens after the other end may already send, it
+ * must connect with an rnr_retry_count that covers the gap.
+ * @param rpc: endpoint to initialize
+ * @param pd: protection domain of the connection
+ * @param qp: connected queue pair, its receive queue is used by the endpoint
+ * @param poller: poller of the CQ of qp, used by rdma_rpc_wait()
+ * @param depth: requests in flight, and receives posted on each end
+ * @param msg_size: largest message, header included, same on both ends
+ * @param max_inline: max_inline_data of the QP, 0 never sends inline
+ * @param server: 1 to serve requests, 0 to issue them
+ */
+int rdma_rpc_init(struct rdma_rpc *rpc, struct ibv_pd *pd,
+		struct ibv_qp *qp, struct rdma_poller *poller,
+		uint32_t depth, uint32_t msg_size, uint32_t max_inline,
+		int server);
+
+/* Server: serves method with handler, arg is passed back to it */
+void rdma_rpc_register(struct rdma_rpc *rpc, uint16_t method,
+		rdma_rpc_handler handler, void *arg);
+
+/**
+ * @brief Client: issues a request. It is queued with the others and goes out
+ * at the next rdma_rpc_poll(), or once a batch is full. Returns 0, -EAGAIN when
+ * depth requests are outstanding, or another negative errno.
+ * @param rpc: client endpoint
+ * @param method: method of the server to call
+ * @param req: payload, copied before this returns
+ * @param length: payload length, at most msg_size minus the header
+ * @param callback: called with the response from rdma_rpc_poll()
+ * @param arg: passed to callback
+ * @param id: where to store the id of the request, may be NULL
+ */
+int rdma_rpc_call(struct rdma_rpc *rpc, uint16_t method,
+		const void *req, uint32_t length,
+		rdma_rpc_callback callback, void *arg, uint64_t *id);
+
+/**
+ * @brief Posts what was queued, then handles whatever the CQ holds without
+ * waiting: a server runs the handlers and answers, a client runs the callbacks.
+ * Returns the number of requests or responses handled, or a negative errno.
+ */
+int rdma_rpc_poll(struct rdma_rpc *rpc);
+
+/**
+ * @brief Queues the receive of a message that the caller reaped from the CQ
+ * itself, e.g. before it handed the CQ to the endpoint. It is handled by the
+ * next rdma_rpc_poll().
+ * @param rpc: endpoint whose receive completed
+ * @param wc: successful IBV_WC_RECV work completion of one of its receives
+ */
+void rdma_rpc_deliver(struct rdma_rpc *rpc, struct ibv_wc *wc);
+
+/**
+ * @brief Same as rdma_rpc_poll() but when there is nothing to handle it spins
+ * or sleeps the way the poller of the connection is configured to.
+ */
+int rdma_rpc_wait(struct rdma_rpc *rpc);
+
+/* Client: requests waiting for their response */
+static inline uint32_t rdma_rpc_outstanding(struct rdma_rpc *rpc)
+{
+	return rpc->depth - rpc->nfree;
+}
+
+/* Frees what rdma_rpc_init() allocated, the QP belongs to the caller */
+void rdma_rpc_destroy(struct rdma_rpc *rpc);
+
+#endif /* RDMA_RPC_H */
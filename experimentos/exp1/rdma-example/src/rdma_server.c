@@ -4,129 +4,784 @@
  * Author: Animesh Trivedi 
  *         atrivedi@apache.org 
  *
+ * The server serves many clients at once. Every connection has its own state
+ * object (struct server_conn) and its own CQ, all CQs report to one completion
+ * channel, and a single event loop waits on that channel and on the connection
+ * management (CM) channel, so new clients are accepted while others transfer.
+ *
+ * With -T the connections are spread over worker threads instead, each pinned
+ * to its own core with its own completion channel and completion vector. The
+ * main thread then only handles CM events and gives every new connection to
+ * the worker with the fewest connections.
+ *
  * TODO: Cleanup previously allocated resources in case of an error condition
  */
 
-#include "rdma_common.h"
+/* for pthread_attr_setaffinity_np */
+#define _GNU_SOURCE
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include "rdma_conn.h"
+#include "rdma_ring.h"
+#include "rdma_srq.h"
+#include "rdma_slab.h"
+#include "rdma_rpc.h"
+
+/* Where a connection is in the exchange with its client */
+enum conn_state {
+	/* accepted, waiting for the client metadata */
+	CONN_METADATA = 0,
+	/* the server metadata is on its way */
+	CONN_SENDING_METADATA,
+	/* the client streams records through the ring, see -R */
+	CONN_STREAMING,
+	/* the client sends chat messages, printed as they arrive */
+	CONN_CHAT,
+	/* the client calls the methods of the server, see -r */
+	CONN_RPC,
+	/* nothing left to do but wait for the disconnect */
+	CONN_IDLE,
+};
 
-/* These are the RDMA resources needed to setup an RDMA connection */
+/* Everything the server keeps about one client */
+struct server_conn {
+	/* id, QP and CQ of the client, with the queue sizes the device takes and
+	 * the poller of the CQ, see -P */
+	struct rdma_conn rdma;
+	/* the receive of the client metadata and the send of ours */
+	struct rdma_op metadata_recv, metadata_send;
+	enum conn_state state;
+	/* RDMA memory resources */
+	struct ibv_mr *client_metadata_mr, *server_buffer_mr, *server_metadata_mr;
+	struct rdma_buffer_attr client_metadata_attr, server_metadata_attr;
+	/* whether server_buffer_mr comes from buffer_pool */
+	int buffer_pooled;
+	/* caps.recv_wr receive buffers of DEFAULT_BUFF_SIZE for the chat messages */
+	struct ibv_mr *chat_mr;
+	/* Ring buffer channel the client streams into with -R */
+	struct rdma_ring ring;
+	/* with -S, ring writes that completed before the ring was set up */
+	struct ibv_wc early_writes[RDMA_RING_RECV_DEPTH];
+	uint32_t nearly_writes;
+	/* RPC endpoint the client calls with -r */
+	struct rdma_rpc rpc;
+	uint64_t bytes, records;
+	struct timespec start;
+	/* the worker that owns the connection, see struct server_worker */
+	struct server_worker *worker;
+	/* the CM thread asked the worker to close it */
+	int closing;
+	/* links in the worker list, and in its command queue */
+	struct server_conn *prev, *next, *cmd_next;
+};
+
+/* A worker owns a set of connections, their CQs notify its completion channel.
+ * Only the worker thread touches its connections; the CM thread hands them
+ * over, and asks for them to be closed, through the command queues.
+ */
+struct server_worker {
+	int index;
+	pthread_t thread;
+	struct ibv_comp_channel *comp_channel;
+	/* completion vector of the CQs of the worker, spreads the interrupts */
+	int comp_vector;
+	/* the CM thread writes to it when it queued a command */
+	int event_fd;
+	pthread_mutex_t lock;
+	struct server_conn *add_queue, *close_queue;
+	struct server_conn *conns;
+	/* number of connections, the CM thread picks the smallest */
+	int load;
+	int started, stop;
+};
+
+/* These are the RDMA resources shared by all the connections */
 /* Event channel, where connection management (cm) related events are relayed */
 static struct rdma_event_channel *cm_event_channel = NULL;
-static struct rdma_cm_id *cm_server_id = NULL, *cm_client_id = NULL;
+static struct rdma_cm_id *cm_server_id = NULL;
+/* The device of the first client, all the others must come through it too */
+static struct ibv_context *verbs = NULL;
 static struct ibv_pd *pd = NULL;
-static struct ibv_comp_channel *io_completion_channel = NULL;
-static struct ibv_cq *cq = NULL;
-static struct ibv_qp_init_attr qp_init_attr;
-static struct ibv_qp *client_qp = NULL;
-/* RDMA memory resources */
-static struct ibv_mr *client_metadata_mr = NULL, *server_buffer_mr = NULL, *server_metadata_mr = NULL;
-static struct rdma_buffer_attr client_metadata_attr, server_metadata_attr;
-static struct ibv_recv_wr client_recv_wr, *bad_client_recv_wr = NULL;
-static struct ibv_send_wr server_send_wr, *bad_server_send_wr = NULL;
-static struct ibv_sge client_recv_sge, server_send_sge;
-
-/* When we call this function cm_client_id must be set to a valid identifier.
- * This is where, we prepare client connection before we accept it. This 
- * mainly involve pre-posting a receive buffer to receive client side 
- * RDMA credentials
+/* Worker threads, see -T. Without -T there is one worker, run by the CM thread */
+static struct server_worker *workers = NULL;
+static int num_workers = 1, threaded = 0;
+static void *worker_thread(void *arg);
+static enum rdma_poll_mode poll_mode = RDMA_POLL_BLOCKING;
+static uint32_t spin_usec = DEFAULT_SPIN_USEC;
+static int ring_mode = 0, rpc_mode = 0;
+/* With -S the QPs share one receive queue, srq_depth is the size of its pool */
+static struct rdma_srq srq;
+static uint32_t srq_depth = 0;
+/* Client buffers up to RDMA_SLAB_MAX_SIZE come from pre-registered slabs, so
+ * a new client does not cost a registration */
+static struct rdma_slab_pool buffer_pool;
+/* Exit once that many clients are gone, 0 to serve forever */
+static unsigned long max_clients = 0, served_clients = 0;
+
+/* Creates the completion channel of a worker, and starts its thread with -T */
+static int setup_worker(struct server_worker *worker, struct ibv_context *context)
+{
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	int ret;
+	/* Every connection gets its own CQ, but the CQs of a worker all notify
+	 * this channel, so the worker only has to wait on one file descriptor.
+	 */
+	worker->comp_channel = ibv_create_comp_channel(context);
+	if (!worker->comp_channel) {
+		rdma_error("Failed to create an I/O completion event channel, %d\n",
+				-errno);
+		return -errno;
+	}
+	if (fcntl(worker->comp_channel->fd, F_SETFL,
+				fcntl(worker->comp_channel->fd, F_GETFL) | O_NONBLOCK)) {
+		rdma_error("Failed to make the completion channel non blocking, %d\n",
+				-errno);
+		return -errno;
+	}
+	/* Each completion vector is an interrupt the device can steer to its own
+	 * core, so the workers do not all get woken up on the same one */
+	worker->comp_vector = worker->index % context->num_comp_vectors;
+	debug("Worker %d uses completion channel %p and vector %d \n",
+			worker->index, worker->comp_channel, worker->comp_vector);
+	if (!threaded)
+		return 0;
+	/* pinned from its first instruction on, before it touches its CQs */
+	ret = pthread_attr_init(&attr);
+	if (ret) {
+		rdma_error("Failed to init the attributes of worker %d, errno: %d \n",
+				worker->index, ret);
+		return -ret;
+	}
+	CPU_ZERO(&cpus);
+	CPU_SET(worker->index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+	ret = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	if (ret)
+		rdma_error("Failed to pin worker %d, errno: %d \n", worker->index, ret);
+	ret = pthread_create(&worker->thread, &attr, worker_thread, worker);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		rdma_error("Failed to start worker %d, errno: %d \n", worker->index, ret);
+		return -ret;
+	}
+	worker->started = 1;
+	return 0;
+}
+
+/* Allocates what is shared by all the connections the first time a client
+ * shows up. The PD and the completion channels are tied to an RDMA device, which
+ * we only learn from the first CONNECT_REQUEST when listening on any address.
  */
-static int setup_client_resources()
+static int setup_device_resources(struct ibv_context *context)
 {
-	int ret = -1;
-	if(!cm_client_id){
-		rdma_error("Client id is still NULL \n");
-		return -EINVAL;
+	int i, ret;
+	if (verbs) {
+		if (verbs != context) {
+			rdma_error("Clients must all come through the device %s \n",
+					verbs->device->name);
+			return -EINVAL;
+		}
+		return 0;
 	}
-	/* We have a valid connection identifier, lets start to allocate 
-	 * resources. We need: 
-	 * 1. Protection Domains (PD)
-	 * 2. Memory Buffers 
-	 * 3. Completion Queues (CQ)
-	 * 4. Queue Pair (QP)
-	 * Protection Domain (PD) is similar to a "process abstraction" 
+	/* Protection Domain (PD) is similar to a "process abstraction"
 	 * in the operating system. All resources are tied to a particular PD. 
 	 * And accessing recourses across PD will result in a protection fault.
 	 */
-	pd = ibv_alloc_pd(cm_client_id->verbs 
-			/* verbs defines a verb's provider, 
-			 * i.e an RDMA device where the incoming 
-			 * client connection came */);
+	pd = ibv_alloc_pd(context);
 	if (!pd) {
 		rdma_error("Failed to allocate a protection domain errno: %d\n",
 				-errno);
 		return -errno;
 	}
 	debug("A new protection domain is allocated at %p \n", pd);
-	/* Now we need a completion channel, were the I/O completion 
-	 * notifications are sent. Remember, this is different from connection 
-	 * management (CM) event notifications. 
-	 * A completion channel is also tied to an RDMA device, hence we will 
-	 * use cm_client_id->verbs. 
+	rdma_slab_pool_init(&buffer_pool, pd, (IBV_ACCESS_LOCAL_WRITE|
+				IBV_ACCESS_REMOTE_READ|
+				IBV_ACCESS_REMOTE_WRITE));
+	if (srq_depth) {
+		/* the pool holds the client metadata, ring receives carry no data.
+		 * It is refilled when a quarter of the buffers is left. */
+		ret = rdma_srq_create(&srq, pd, srq_depth,
+				sizeof(struct rdma_buffer_attr), srq_depth / 4);
+		if (ret) {
+			rdma_error("Failed to create the shared receive queue, ret = %d \n",
+					ret);
+			return ret;
+		}
+		/* the limit events arrive on the async fd, read by the event loop */
+		if (fcntl(context->async_fd, F_SETFL,
+					fcntl(context->async_fd, F_GETFL) | O_NONBLOCK)) {
+			rdma_error("Failed to make the async event fd non blocking, %d\n",
+					-errno);
+			return -errno;
+		}
+	}
+	for (i = 0; i < num_workers; i++) {
+		ret = setup_worker(&workers[i], context);
+		if (ret)
+			return ret;
+	}
+	verbs = context;
+	return 0;
+}
+
+/* Frees a connection, its cm id included. Only its worker may call it, and not
+ * while a CM event of the connection is not acknowledged yet. */
+static void destroy_conn(struct server_conn *conn)
+{
+	if (conn->ring.credit_mr)
+		rdma_ring_destroy(&conn->ring);
+	if (conn->rpc.recv_mr) {
+		debug("Served %lu RPC requests \n", conn->rpc.requests);
+		rdma_rpc_destroy(&conn->rpc);
+	}
+	rdma_conn_destroy(&conn->rdma);
+	if (conn->server_buffer_mr && conn->buffer_pooled)
+		rdma_slab_free(&buffer_pool, conn->server_buffer_mr);
+	else if (conn->server_buffer_mr)
+		rdma_buffer_free(conn->server_buffer_mr);
+	if (conn->server_metadata_mr)
+		rdma_buffer_deregister(conn->server_metadata_mr);
+	if (conn->chat_mr)
+		rdma_buffer_free(conn->chat_mr);
+	if (conn->client_metadata_mr)
+		rdma_buffer_deregister(conn->client_metadata_mr);
+	if (rdma_destroy_id(conn->rdma.cm_id))
+		rdma_error("Failed to destroy client id cleanly, %d \n", -errno);
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		conn->worker->conns = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	__atomic_sub_fetch(&conn->worker->load, 1, __ATOMIC_RELAXED);
+	free(conn);
+}
+
+/* Queues a command for a worker, conn->cmd_next links the queue */
+static void worker_command(struct server_worker *worker,
+		struct server_conn **queue, struct server_conn *conn)
+{
+	uint64_t one = 1;
+	pthread_mutex_lock(&worker->lock);
+	conn->cmd_next = *queue;
+	*queue = conn;
+	pthread_mutex_unlock(&worker->lock);
+	if (write(worker->event_fd, &one, sizeof(one)) != sizeof(one))
+		rdma_error("Failed to wake worker %d up, errno: %d \n",
+				worker->index, -errno);
+}
+
+/* The worker with the fewest connections gets the next one */
+static struct server_worker *least_loaded_worker()
+{
+	struct server_worker *worker = &workers[0];
+	int i;
+	for (i = 1; i < num_workers; i++)
+		if (__atomic_load_n(&workers[i].load, __ATOMIC_RELAXED) <
+				__atomic_load_n(&worker->load, __ATOMIC_RELAXED))
+			worker = &workers[i];
+	return worker;
+}
+
+/* A connection that failed is disconnected, its resources go away with the
+ * RDMA_CM_EVENT_DISCONNECTED that follows */
+static void fail_conn(struct server_conn *conn, int ret)
+{
+	rdma_error("Connection failed, ret = %d, disconnecting \n", ret);
+	conn->state = CONN_IDLE;
+	rdma_disconnect(conn->rdma.cm_id);
+}
+
+/* Pre-posts the receive buffer for the client metadata */
+static int post_metadata_recv(struct server_conn *conn)
+{
+	int ret;
+	/* we prepare the receive buffer in which we will receive the client metadata*/
+	conn->client_metadata_mr = rdma_buffer_register(pd /* which protection domain */,
+			&conn->client_metadata_attr /* what memory */,
+			sizeof(conn->client_metadata_attr) /* what length */,
+			(IBV_ACCESS_LOCAL_WRITE) /* access permissions */);
+	if(!conn->client_metadata_mr){
+		rdma_error("Failed to register client attr buffer\n");
+		//we assume ENOMEM
+		return -ENOMEM;
+	}
+	/* We pre-post this receive buffer on the QP, process_conn() sees the
+	 * op complete once the metadata of the client is in */
+	ret = rdma_conn_recv(&conn->rdma, &conn->metadata_recv, conn->client_metadata_mr,
+			&conn->client_metadata_attr, sizeof(conn->client_metadata_attr));
+	if (ret)
+		return ret;
+	debug("Receive buffer pre-posting is successful \n");
+	return 0;
+}
+
+/* Sets up the resources of a new connection, before it is accepted */
+static int setup_client_resources(struct server_conn *conn)
+{
+	struct rdma_conn_attr attr;
+	/* with -r every request and every response may be in flight at once */
+	uint32_t max_wr = rpc_mode ? RDMA_RPC_DEFAULT_DEPTH + 1 : DEFAULT_QUEUE_DEPTH;
+	int ret = -1;
+	bzero(&attr, sizeof(attr));
+	attr.wr = max_wr;
+	/* the RPC responses go inline when they fit */
+	attr.max_inline = rpc_mode ? RDMA_RPC_DEFAULT_MSG_SIZE : 0;
+	attr.poll_mode = poll_mode;
+	attr.spin_usec = spin_usec;
+	/* The CQ notifies the channel of the worker, on its vector, and its
+	 * context is the connection, so a notification on the shared channel
+	 * tells us right away which client has work completions.
 	 */
-	io_completion_channel = ibv_create_comp_channel(cm_client_id->verbs);
-	if (!io_completion_channel) {
-		rdma_error("Failed to create an I/O completion event channel, %d\n",
-				-errno);
+	attr.comp_channel = conn->worker->comp_channel;
+	attr.comp_vector = conn->worker->comp_vector;
+	attr.cq_context = conn;
+	/* With -S the receives come from the shared pool, the QP has none */
+	attr.srq = srq_depth ? srq.srq : NULL;
+	ret = rdma_conn_init(&conn->rdma, conn->rdma.cm_id, pd, &attr);
+	if (ret) {
+		rdma_error("Failed to setup the connection, ret = %d \n", ret);
+		return ret;
+	}
+	/* the client sizes the RPC and the ring for these, it cannot do with less */
+	if (conn->rdma.caps.recv_wr < (rpc_mode ? max_wr : RDMA_RING_RECV_DEPTH)) {
+		rdma_error("The device only takes %u work requests per queue \n",
+				conn->rdma.caps.recv_wr);
+		return -EINVAL;
+	}
+	debug("Client QP created at %p\n", conn->rdma.qp);
+	if (srq_depth)
+		return 0;
+	return post_metadata_recv(conn);
+}
+
+/* Handles RDMA_CM_EVENT_CONNECT_REQUEST: sets up a new connection, hands it to
+ * a worker and accepts the client. On error the client is rejected, and the
+ * connection, if there is one, is left in id->context to be closed once the
+ * event is acknowledged. req is what the client asked for in rdma_connect(). */
+static int accept_client_connection(struct rdma_cm_id *cm_client_id,
+		struct rdma_conn_param *req)
+{
+	struct rdma_conn_param conn_param;
+	struct server_conn *conn = NULL;
+	int ret = -1;
+	ret = setup_device_resources(cm_client_id->verbs);
+	if (ret)
+		goto reject;
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		rdma_error("Failed to allocate the connection, -ENOMEM\n");
+		ret = -ENOMEM;
+		goto reject;
+	}
+	conn->rdma.cm_id = cm_client_id;
+	/* CM events of this client find their connection through the id */
+	cm_client_id->context = conn;
+	/* The CQ of the connection reports to the channel of its worker */
+	conn->worker = least_loaded_worker();
+	__atomic_add_fetch(&conn->worker->load, 1, __ATOMIC_RELAXED);
+	debug("The new connection goes to worker %d \n", conn->worker->index);
+	ret = setup_client_resources(conn);
+	if (ret)
+		goto reject;
+	/* The worker adopts it before the client can send anything */
+	worker_command(conn->worker, &conn->worker->add_queue, conn);
+	/* Now we accept the connection. Recall we have not accepted the connection
+	 * yet because we have to do lots of resource pre-allocation */
+	memset(&conn_param, 0, sizeof(conn_param));
+	/* this tell how many outstanding requests can we handle, as many READs
+	 * as the device serves but no more than the client issues */
+	conn_param.responder_resources = req->initiator_depth < conn->rdma.caps.responder_resources ?
+		req->initiator_depth : conn->rdma.caps.responder_resources;
+	/* This tell how many outstanding requests we expect other side to handle */
+	conn_param.initiator_depth = req->responder_resources < conn->rdma.caps.initiator_depth ?
+		req->responder_resources : conn->rdma.caps.initiator_depth;
+	ret = rdma_accept(cm_client_id, &conn_param);
+	if (ret) {
+		rdma_error("Failed to accept the connection, errno: %d \n", -errno);
 		return -errno;
 	}
-	debug("An I/O completion event channel is created at %p \n", 
-			io_completion_channel);
-	/* Now we create a completion queue (CQ) where actual I/O 
-	 * completion metadata is placed. The metadata is packed into a structure 
-	 * called struct ibv_wc (wc = work completion). ibv_wc has detailed 
-	 * information about the work completion. An I/O request in RDMA world 
-	 * is called "work" ;) 
+	return 0;
+reject:
+	rdma_reject(cm_client_id, NULL, 0);
+	if (conn) {
+		/* the worker still has to adopt it, only to close it */
+		conn->state = CONN_IDLE;
+		worker_command(conn->worker, &conn->worker->add_queue, conn);
+	}
+	return ret;
+}
+
+/* The client metadata arrived: allocates the buffer it asked for and sends
+ * its location back */
+static int send_server_metadata_to_client(struct server_conn *conn)
+{
+	int ret = -1;
+	/* if all good, then we should have client's buffer information, lets see */
+	printf("Client side buffer information is received...\n");
+	show_rdma_buffer_attr(&conn->client_metadata_attr);
+	printf("The client has requested buffer length of : %u bytes \n",
+			conn->client_metadata_attr.length);
+	/* We need to setup requested memory buffer. This is where the client will
+	* do RDMA READs and WRITEs. Small ones are taken from the pool, it is
+	* registered with the same permissions as below. */
+	conn->buffer_pooled = conn->client_metadata_attr.length <= RDMA_SLAB_MAX_SIZE;
+	if (conn->buffer_pooled)
+		conn->server_buffer_mr = rdma_slab_alloc(&buffer_pool,
+				conn->client_metadata_attr.length);
+	else
+		conn->server_buffer_mr = rdma_buffer_alloc(pd /* which protection domain */,
+				conn->client_metadata_attr.length /* what size to allocate */,
+				(IBV_ACCESS_LOCAL_WRITE|
+				 IBV_ACCESS_REMOTE_READ|
+				 IBV_ACCESS_REMOTE_WRITE) /* access permissions */);
+	if(!conn->server_buffer_mr){
+		rdma_error("Server failed to create a buffer \n");
+		/* we assume that it is due to out of memory error */
+		return -ENOMEM;
+	}
+	/* This buffer is used to transmit information about the above
+	 * buffer to the client. So this contains the metadata about the server
+	 * buffer. Hence this is called metadata buffer. Since this is already
+	 * on allocated, we just register it.
+	 * We need to prepare a send I/O operation that will tell the
+	 * client the address of the server buffer.
 	 */
-	cq = ibv_create_cq(cm_client_id->verbs /* which device*/, 
-			CQ_CAPACITY /* maximum capacity*/, 
-			NULL /* user context, not used here */,
-			io_completion_channel /* which IO completion channel */, 
-			0 /* signaling vector, not used here*/);
-	if (!cq) {
-		rdma_error("Failed to create a completion queue (cq), errno: %d\n",
-				-errno);
-		return -errno;
+	conn->server_metadata_attr.address = (uint64_t) conn->server_buffer_mr->addr;
+	conn->server_metadata_attr.length = (uint32_t) conn->server_buffer_mr->length;
+	conn->server_metadata_attr.stag.local_stag = (uint32_t) conn->server_buffer_mr->rkey;
+	conn->server_metadata_mr = rdma_buffer_register(pd /* which protection domain*/,
+			&conn->server_metadata_attr /* which memory to register */,
+			sizeof(conn->server_metadata_attr) /* what is the size of memory */,
+			IBV_ACCESS_LOCAL_WRITE /* what access permission */);
+	if(!conn->server_metadata_mr){
+		rdma_error("Server failed to create to hold server metadata \n");
+		/* we assume that this is due to out of memory error */
+		return -ENOMEM;
+	}
+	/* With -r the client calls right after it gets the metadata, so the
+	 * RPC receives must be posted before it goes out */
+	if (rpc_mode) {
+		ret = rdma_rpc_init(&conn->rpc, pd, conn->rdma.qp, &conn->rdma.poller,
+				RDMA_RPC_DEFAULT_DEPTH, RDMA_RPC_DEFAULT_MSG_SIZE,
+				conn->rdma.max_inline, 1);
+		if (ret) {
+			rdma_error("Failed to setup the RPC endpoint, ret = %d \n", ret);
+			return ret;
+		}
 	}
-	debug("Completion queue (CQ) is created at %p with %d elements \n", 
-			cq, cq->cqe);
-	/* Ask for the event for all activities in the completion queue*/
-	ret = ibv_req_notify_cq(cq /* on which CQ */, 
-			0 /* 0 = all event type, no filter*/);
+	/* We need to transmit this buffer. The send is queued on the connection
+	 * and goes out with the flush, process_conn() sees the op complete */
+	ret = rdma_conn_send(&conn->rdma, &conn->metadata_send, conn->server_metadata_mr,
+			&conn->server_metadata_attr, sizeof(conn->server_metadata_attr));
+	if (!ret)
+		ret = rdma_conn_flush(&conn->rdma);
 	if (ret) {
-		rdma_error("Failed to request notifications on CQ errno: %d \n",
-				-errno);
+		rdma_error("Posting of server metdata failed, ret = %d \n", ret);
+		return ret;
+	}
+	conn->state = CONN_SENDING_METADATA;
+	return 0;
+}
+
+/* Posts chat receive buffer index again */
+static int post_chat_recv(struct server_conn *conn, uint64_t index)
+{
+	struct ibv_recv_wr recv_wr, *bad_recv_wr = NULL;
+	struct ibv_sge recv_sge;
+	int ret;
+	recv_sge.addr = (uint64_t) conn->chat_mr->addr + index * DEFAULT_BUFF_SIZE;
+	recv_sge.length = DEFAULT_BUFF_SIZE;
+	recv_sge.lkey = conn->chat_mr->lkey;
+	bzero(&recv_wr, sizeof(recv_wr));
+	recv_wr.wr_id = index;
+	recv_wr.sg_list = &recv_sge;
+	recv_wr.num_sge = 1;
+	ret = ibv_post_recv(conn->rdma.qp, &recv_wr, &bad_recv_wr);
+	if (ret) {
+		rdma_error("Failed to post a chat receive, errno: %d \n", ret);
+		return -ret;
+	}
+	return 0;
+}
+
+/* Prints the chat messages the CQ holds, each buffer is posted again once
+ * printed. Returns the number of messages or a negative errno. */
+static int drain_chat(struct server_conn *conn)
+{
+	struct ibv_wc wc;
+	int ret, messages = 0;
+	while ((ret = ibv_poll_cq(conn->rdma.cq, 1, &wc)) > 0) {
+		if (wc.status != IBV_WC_SUCCESS) {
+			rdma_error("Work completion (WC) has error status: %s \n",
+					ibv_wc_status_str(wc.status));
+			return -(wc.status);
+		}
+		if (wc.opcode != IBV_WC_RECV)
+			continue;
+		printf("Client says: %.*s", (int) wc.byte_len,
+				(char *) conn->chat_mr->addr + wc.wr_id * DEFAULT_BUFF_SIZE);
+		fflush(stdout);
+		messages++;
+		ret = post_chat_recv(conn, wc.wr_id);
+		if (ret)
+			return ret;
+	}
+	if (ret < 0) {
+		rdma_error("Failed to poll cq for wc due to %d \n", ret);
+		return ret;
+	}
+	return messages;
+}
+
+/* RDMA_RPC_ECHO: the response is the request */
+static int rpc_echo(void *arg, const void *req, uint32_t req_length,
+		void *resp, uint32_t *resp_length)
+{
+	if (req_length > *resp_length)
+		return -EMSGSIZE;
+	memcpy(resp, req, req_length);
+	*resp_length = req_length;
+	return 0;
+}
+
+/* The metadata exchange is over, the client either works on the server buffer
+ * with one sided operations, chats, calls its methods, or streams through it
+ * as a ring */
+static int start_streaming(struct server_conn *conn)
+{
+	uint64_t i;
+	int ret;
+	debug("Local buffer metadata has been sent to the client \n");
+	if (rpc_mode) {
+		rdma_rpc_register(&conn->rpc, RDMA_RPC_ECHO, rpc_echo, NULL);
+		conn->state = CONN_RPC;
+		return 0;
+	}
+	if (!ring_mode) {
+		/* The client sends what it reads from stdin, small messages inline */
+		conn->chat_mr = rdma_buffer_alloc(pd, conn->rdma.caps.recv_wr * DEFAULT_BUFF_SIZE,
+				IBV_ACCESS_LOCAL_WRITE);
+		if (!conn->chat_mr) {
+			rdma_error("Failed to allocate the chat buffers, -ENOMEM\n");
+			return -ENOMEM;
+		}
+		for (i = 0; i < conn->rdma.caps.recv_wr; i++) {
+			ret = post_chat_recv(conn, i);
+			if (ret)
+				return ret;
+		}
+		conn->state = CONN_CHAT;
+		return 0;
+	}
+	/* The server buffer is the ring, the client metadata is its credit word */
+	ret = rdma_ring_receiver_init(&conn->ring, pd, conn->rdma.qp, &conn->rdma.poller,
+			conn->server_buffer_mr, &conn->client_metadata_attr, RDMA_RING_RECV_DEPTH,
+			srq_depth ? &srq : NULL);
+	if (ret) {
+		rdma_error("Failed to setup the ring, ret = %d \n", ret);
+		return ret;
+	}
+	for (i = 0; i < conn->nearly_writes; i++) {
+		ret = rdma_ring_deliver(&conn->ring, &conn->early_writes[i]);
+		if (ret)
+			return ret;
+	}
+	conn->nearly_writes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &conn->start);
+	conn->state = CONN_STREAMING;
+	return 0;
+}
+
+/* Prints what the client streams through the ring until the ring is empty.
+ * Returns the number of records read or a negative errno. */
+static int drain_ring(struct server_conn *conn)
+{
+	struct timespec end;
+	void *data;
+	uint32_t length;
+	double elapsed;
+	int ret, records = 0;
+	while (conn->state == CONN_STREAMING) {
+		ret = rdma_ring_try_read(&conn->ring, &data, &length);
+		if (ret == -EAGAIN)
+			break;
+		if (ret) {
+			rdma_error("Failed to read from the ring, ret = %d \n", ret);
+			return ret;
+		}
+		records++;
+		if (!length) {
+			/* the empty record closes the stream */
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			elapsed = (end.tv_sec - conn->start.tv_sec) +
+				(end.tv_nsec - conn->start.tv_nsec) / 1e9;
+			fflush(stdout);
+			fprintf(stderr, "Stream of %lu records, %lu bytes in %.3f s (%.2f MB/s) is complete \n",
+					conn->records, conn->bytes, elapsed,
+					elapsed > 0 ? conn->bytes / elapsed / 1e6 : 0.0);
+			conn->state = CONN_IDLE;
+			break;
+		}
+		fwrite(data, 1, length, stdout);
+		conn->bytes += length;
+		conn->records++;
+		ret = rdma_ring_consume(&conn->ring);
+		if (ret) {
+			rdma_error("Failed to return ring credits, ret = %d \n", ret);
+			return ret;
+		}
+	}
+	return records;
+}
+
+/* Moves a connection forward with whatever its CQ holds. The CQ must already be
+ * armed again, so that nothing that completes after this call goes unnoticed.
+ * Returns how much work was done or a negative errno. */
+static int process_conn(struct server_conn *conn)
+{
+	struct ibv_wc wc;
+	int ret, progress = 0;
+	while (conn->state == CONN_METADATA || conn->state == CONN_SENDING_METADATA) {
+		ret = ibv_poll_cq(conn->rdma.cq, 1, &wc);
+		if (ret < 0) {
+			rdma_error("Failed to poll cq for wc due to %d \n", ret);
+			return ret;
+		}
+		if (ret == 0)
+			return progress;
+		progress++;
+		if (wc.status != IBV_WC_SUCCESS) {
+			rdma_error("Work completion (WC) has error status: %s \n",
+					ibv_wc_status_str(wc.status));
+			return -(wc.status);
+		}
+		if (wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM && srq_depth) {
+			/* With -S the pool has receives for the ring before the ring
+			 * is set up, so the first writes of the client may overtake
+			 * the completion of our metadata send. Their data is in the
+			 * ring already, the ring accounts for them once it exists. */
+			if (conn->nearly_writes == RDMA_RING_RECV_DEPTH) {
+				rdma_error("More than %d ring writes before the ring is set up \n",
+						RDMA_RING_RECV_DEPTH);
+				return -EOVERFLOW;
+			}
+			conn->early_writes[conn->nearly_writes++] = wc;
+			ret = 0;
+		} else if (wc.opcode == IBV_WC_RECV && srq_depth) {
+			/* copy the metadata out, the buffer goes back to the pool */
+			memcpy(&conn->client_metadata_attr,
+					rdma_srq_buffer(&srq, wc.wr_id),
+					sizeof(conn->client_metadata_attr));
+			ret = rdma_srq_release(&srq, wc.wr_id);
+			if (!ret)
+				ret = send_server_metadata_to_client(conn);
+		} else if (rpc_mode && wc.opcode == IBV_WC_RECV &&
+				wc.wr_id != (uintptr_t) &conn->metadata_recv) {
+			/* With -r the client calls as soon as it has our metadata, so
+			 * a request may overtake the completion of our send. The RPC
+			 * receives are posted already, the RPC layer serves it once
+			 * the connection gets there. */
+			rdma_rpc_deliver(&conn->rpc, &wc);
+			ret = 0;
+		} else {
+			/* the receive of the client metadata or the send of ours */
+			rdma_conn_complete(&conn->rdma, &wc);
+			ret = 0;
+			if (conn->state == CONN_METADATA && rdma_op_done(&conn->metadata_recv))
+				ret = send_server_metadata_to_client(conn);
+			else if (conn->state == CONN_SENDING_METADATA &&
+					rdma_op_done(&conn->metadata_send))
+				ret = start_streaming(conn);
+		}
+		if (ret)
+			return ret;
+	}
+	if (conn->state == CONN_STREAMING) {
+		ret = drain_ring(conn);
+		if (ret < 0)
+			return ret;
+		progress += ret;
+	}
+	if (conn->state == CONN_CHAT) {
+		ret = drain_chat(conn);
+		if (ret < 0)
+			return ret;
+		progress += ret;
+	}
+	if (conn->state == CONN_RPC) {
+		ret = rdma_rpc_poll(&conn->rpc);
+		if (ret < 0)
+			return ret;
+		progress += ret;
+	}
+	return progress;
+}
+
+/* Handles one CM event of the listening id or of a client */
+static int process_cm_event(struct rdma_cm_event *cm_event)
+{
+	enum rdma_cm_event_type event = cm_event->event;
+	struct rdma_cm_id *id = cm_event->id;
+	struct server_conn *conn = NULL;
+	struct sockaddr_in remote_sockaddr;
+	int ret = 0;
+	debug("A new %s type event is received \n", rdma_event_str(event));
+	switch (event) {
+		case RDMA_CM_EVENT_CONNECT_REQUEST:
+			/* Much like TCP connection, listening returns a new connection
+			 * identifier for newly connected client. */
+			ret = accept_client_connection(id, &cm_event->param.conn);
+			if (ret)
+				conn = id->context;
+			break;
+		case RDMA_CM_EVENT_ESTABLISHED:
+			/* Just FYI: How to extract connection information */
+			memcpy(&remote_sockaddr /* where to save */,
+					rdma_get_peer_addr(id) /* gives you remote sockaddr */,
+					sizeof(struct sockaddr_in) /* max size */);
+			printf("A new connection is accepted from %s \n",
+					inet_ntoa(remote_sockaddr.sin_addr));
+			break;
+		case RDMA_CM_EVENT_DISCONNECTED:
+			printf("A disconnect event is received from the client...\n");
+			served_clients++;
+			/* fall through */
+		case RDMA_CM_EVENT_CONNECT_ERROR:
+		case RDMA_CM_EVENT_UNREACHABLE:
+		case RDMA_CM_EVENT_REJECTED:
+			conn = id->context;
+			break;
+		default:
+			break;
+	}
+	/* The worker frees the connection once it is over. Its rdma_destroy_id
+	 * waits for this event to be acknowledged, so the connection is still
+	 * there to be looked at until then. Only this thread sets closing. */
+	if (conn && conn->closing)
+		conn = NULL;
+	else if (conn)
+		conn->closing = 1;
+	/* Acknowledging the event frees it, the id can only be destroyed after */
+	if (rdma_ack_cm_event(cm_event)) {
+		rdma_error("Failed to acknowledge the cm event %d\n", -errno);
 		return -errno;
 	}
-	/* Now the last step, set up the queue pair (send, recv) queues and their capacity.
-	 * The capacity here is define statically but this can be probed from the 
-	 * device. We just use a small number as defined in rdma_common.h */
-       bzero(&qp_init_attr, sizeof qp_init_attr);
-       qp_init_attr.cap.max_recv_sge = MAX_SGE; /* Maximum SGE per receive posting */
-       qp_init_attr.cap.max_recv_wr = MAX_WR; /* Maximum receive posting capacity */
-       qp_init_attr.cap.max_send_sge = MAX_SGE; /* Maximum SGE per send posting */
-       qp_init_attr.cap.max_send_wr = MAX_WR; /* Maximum send posting capacity */
-       qp_init_attr.qp_type = IBV_QPT_RC; /* QP type, RC = Reliable connection */
-       /* We use same completion queue, but one can use different queues */
-       qp_init_attr.recv_cq = cq; /* Where should I notify for receive completion operations */
-       qp_init_attr.send_cq = cq; /* Where should I notify for send completion operations */
-       /*Lets create a QP */
-       ret = rdma_create_qp(cm_client_id /* which connection id */,
-		       pd /* which protection domain*/,
-		       &qp_init_attr /* Initial attributes */);
-       if (ret) {
-	       rdma_error("Failed to create QP due to errno: %d\n", -errno);
-	       return -errno;
-       }
-       /* Save the reference for handy typing but is not required */
-       client_qp = cm_client_id->qp;
-       debug("Client QP created at %p\n", client_qp);
-       return ret;
+	if (conn)
+		worker_command(conn->worker, &conn->worker->close_queue, conn);
+	else if (ret && event == RDMA_CM_EVENT_CONNECT_REQUEST && !id->context)
+		rdma_destroy_id(id);
+	return ret;
 }
 
 /* Starts an RDMA server by allocating basic connection resources */
 static int start_rdma_server(struct sockaddr_in *server_addr) 
 {
-	struct rdma_cm_event *cm_event = NULL;
 	int ret = -1;
 	/*  Open a channel used to report asynchronous communication event */
 	cm_event_channel = rdma_create_event_channel();
@@ -136,6 +791,13 @@ static int start_rdma_server(struct sockaddr_in *server_addr)
 	}
 	debug("RDMA CM event channel is created successfully at %p \n", 
 			cm_event_channel);
+	/* The event loop waits on the channel with poll(), reading it must not block */
+	if (fcntl(cm_event_channel->fd, F_SETFL,
+				fcntl(cm_event_channel->fd, F_GETFL) | O_NONBLOCK)) {
+		rdma_error("Failed to make the cm event channel non blocking, %d\n",
+				-errno);
+		return -errno;
+	}
 	/* rdma_cm_id is the connection identifier (like socket) which is used 
 	 * to define an RDMA connection. 
 	 */
@@ -155,8 +817,7 @@ static int start_rdma_server(struct sockaddr_in *server_addr)
 	/* Now we start to listen on the passed IP and port. However unlike
 	 * normal TCP listen, this is a non-blocking call. When a new client is 
 	 * connected, a new connection management (CM) event is generated on the 
-	 * RDMA CM event channel from where the listening id was created. Here we
-	 * have only one channel, so it is easy. */
+	 * RDMA CM event channel from where the listening id was created. */
 	ret = rdma_listen(cm_server_id, 8); /* backlog = 8 clients, same as TCP, see man listen*/
 	if (ret) {
 		rdma_error("rdma_listen failed to listen on server address, errno: %d ",
@@ -166,248 +827,203 @@ static int start_rdma_server(struct sockaddr_in *server_addr)
 	printf("Server is listening successfully at: %s , port: %d \n",
 			inet_ntoa(server_addr->sin_addr),
 			ntohs(server_addr->sin_port));
-	/* now, we expect a client to connect and generate a RDMA_CM_EVNET_CONNECT_REQUEST 
-	 * We wait (block) on the connection management event channel for 
-	 * the connect event. 
-	 */
-	ret = process_rdma_cm_event(cm_event_channel, 
-			RDMA_CM_EVENT_CONNECT_REQUEST,
-			&cm_event);
-	if (ret) {
-		rdma_error("Failed to get cm event, ret = %d \n" , ret);
-		return ret;
-	}
-	/* Much like TCP connection, listening returns a new connection identifier 
-	 * for newly connected client. In the case of RDMA, this is stored in id 
-	 * field. For more details: man rdma_get_cm_event 
-	 */
-	cm_client_id = cm_event->id;
-	/* now we acknowledge the event. Acknowledging the event free the resources 
-	 * associated with the event structure. Hence any reference to the event 
-	 * must be made before acknowledgment. Like, we have already saved the 
-	 * client id from "id" field before acknowledging the event. 
-	 */
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret) {
-		rdma_error("Failed to acknowledge the cm event errno: %d \n", -errno);
-		return -errno;
-	}
-	debug("A new RDMA client connection id is stored at %p\n", cm_client_id);
-	return ret;
+	return 0;
 }
 
-/* Pre-posts a receive buffer and accepts an RDMA client connection */
-static int accept_client_connection()
+/* Adopts and closes the connections the CM thread handed to the worker */
+static void worker_commands(struct server_worker *worker)
 {
-	struct rdma_conn_param conn_param;
-	struct rdma_cm_event *cm_event = NULL;
-	struct sockaddr_in remote_sockaddr; 
-	int ret = -1;
-	if(!cm_client_id || !client_qp) {
-		rdma_error("Client resources are not properly setup\n");
-		return -EINVAL;
+	struct server_conn *added, *closed, *conn, *next;
+	uint64_t count;
+	if (read(worker->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		rdma_error("Failed to read the worker event fd, errno: %d \n", -errno);
+	pthread_mutex_lock(&worker->lock);
+	added = worker->add_queue;
+	closed = worker->close_queue;
+	worker->add_queue = worker->close_queue = NULL;
+	pthread_mutex_unlock(&worker->lock);
+	/* adopt first, a connection can be added and closed in the same round */
+	for (conn = added; conn; conn = next) {
+		next = conn->cmd_next;
+		conn->prev = NULL;
+		conn->next = worker->conns;
+		if (worker->conns)
+			worker->conns->prev = conn;
+		worker->conns = conn;
 	}
-	/* we prepare the receive buffer in which we will receive the client metadata*/
-        client_metadata_mr = rdma_buffer_register(pd /* which protection domain */, 
-			&client_metadata_attr /* what memory */,
-			sizeof(client_metadata_attr) /* what length */, 
-		       (IBV_ACCESS_LOCAL_WRITE) /* access permissions */);
-	if(!client_metadata_mr){
-		rdma_error("Failed to register client attr buffer\n");
-		//we assume ENOMEM
-		return -ENOMEM;
+	for (conn = closed; conn; conn = next) {
+		next = conn->cmd_next;
+		destroy_conn(conn);
 	}
-	/* We pre-post this receive buffer on the QP. SGE credentials is where we 
-	 * receive the metadata from the client */
-	client_recv_sge.addr = (uint64_t) client_metadata_mr->addr; // same as &client_buffer_attr
-	client_recv_sge.length = client_metadata_mr->length;
-	client_recv_sge.lkey = client_metadata_mr->lkey;
-	/* Now we link this SGE to the work request (WR) */
-	bzero(&client_recv_wr, sizeof(client_recv_wr));
-	client_recv_wr.sg_list = &client_recv_sge;
-	client_recv_wr.num_sge = 1; // only one SGE
-	ret = ibv_post_recv(client_qp /* which QP */,
-		      &client_recv_wr /* receive work request*/,
-		      &bad_client_recv_wr /* error WRs */);
-	if (ret) {
-		rdma_error("Failed to pre-post the receive buffer, errno: %d \n", ret);
-		return ret;
+}
+
+/* One round of a worker: handles its commands and the CQ notifications of its
+ * connections, then polls the connections that spin. Returns the timeout for
+ * the next wait, 0 when some connection made progress spinning. */
+static int worker_round(struct server_worker *worker)
+{
+	struct server_conn *conn;
+	struct ibv_cq *cq_ptr;
+	void *context;
+	int ret, timeout = -1;
+	worker_commands(worker);
+	while (!ibv_get_cq_event(worker->comp_channel, &cq_ptr, &context)) {
+		ibv_ack_cq_events(cq_ptr, 1);
+		/* Request for more notifications before polling, so that
+		 * nothing that completes in between is missed */
+		if (ibv_req_notify_cq(cq_ptr, 0))
+			rdma_error("Failed to request further notifications %d \n", -errno);
+		conn = context;
+		if (conn->state == CONN_IDLE)
+			continue;
+		ret = process_conn(conn);
+		if (ret < 0)
+			fail_conn(conn, ret);
+		else
+			rdma_poller_spin(&conn->rdma.poller, ret);
 	}
-	debug("Receive buffer pre-posting is successful \n");
-	/* Now we accept the connection. Recall we have not accepted the connection 
-	 * yet because we have to do lots of resource pre-allocation */
-       memset(&conn_param, 0, sizeof(conn_param));
-       /* this tell how many outstanding requests can we handle */
-       conn_param.initiator_depth = 3; /* For this exercise, we put a small number here */
-       /* This tell how many outstanding requests we expect other side to handle */
-       conn_param.responder_resources = 3; /* For this exercise, we put a small number */
-       ret = rdma_accept(cm_client_id, &conn_param);
-       if (ret) {
-	       rdma_error("Failed to accept the connection, errno: %d \n", -errno);
-	       return -errno;
-       }
-       /* We expect an RDMA_CM_EVNET_ESTABLISHED to indicate that the RDMA  
-	* connection has been established and everything is fine on both, server 
-	* as well as the client sides.
-	*/
-        debug("Going to wait for : RDMA_CM_EVENT_ESTABLISHED event \n");
-       ret = process_rdma_cm_event(cm_event_channel, 
-		       RDMA_CM_EVENT_ESTABLISHED,
-		       &cm_event);
-        if (ret) {
-		rdma_error("Failed to get the cm event, errnp: %d \n", -errno);
-		return -errno;
+	/* connections that spin are polled on every round, see -P */
+	for (conn = worker->conns; conn; conn = conn->next) {
+		if (conn->state == CONN_IDLE || !rdma_poller_spin(&conn->rdma.poller, 0))
+			continue;
+		ret = process_conn(conn);
+		if (ret < 0)
+			fail_conn(conn, ret);
+		else if (rdma_poller_spin(&conn->rdma.poller, ret))
+			timeout = 0;
 	}
-	/* We acknowledge the event */
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret) {
-		rdma_error("Failed to acknowledge the cm event %d\n", -errno);
-		return -errno;
+	return timeout;
+}
+
+/* With -T, each worker runs this on its own core until cleanup() stops it */
+static void *worker_thread(void *arg)
+{
+	struct server_worker *worker = arg;
+	struct pollfd fds[2];
+	int timeout = -1;
+	fds[0].fd = worker->comp_channel->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = worker->event_fd;
+	fds[1].events = POLLIN;
+	while (!__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE)) {
+		if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+			rdma_error("Worker %d failed to wait for events, errno: %d \n",
+					worker->index, -errno);
+			break;
+		}
+		timeout = worker_round(worker);
 	}
-	/* Just FYI: How to extract connection information */
-	memcpy(&remote_sockaddr /* where to save */, 
-			rdma_get_peer_addr(cm_client_id) /* gives you remote sockaddr */, 
-			sizeof(struct sockaddr_in) /* max size */);
-	printf("A new connection is accepted from %s \n", 
-			inet_ntoa(remote_sockaddr.sin_addr));
-	return ret;
+	return NULL;
 }
 
-/* This function sends server side buffer metadata to the connected client */
-static int send_server_metadata_to_client() 
+/* Reads the async events of the device, the SRQ limit ones refill the pool */
+static void process_async_events()
 {
-	struct ibv_wc wc;
-	int ret = -1;
-	/* Now, we first wait for the client to start the communication by 
-	* sending the server its metadata info. The server does not use it 
-	* in our example. We will receive a work completion notification for 
-	* our pre-posted receive request.
-	*/
-	ret = process_work_completion_events(io_completion_channel, &wc, 1);
-	if (ret != 1) {
-		rdma_error("Failed to receive , ret = %d \n", ret);
-		return ret;
+	struct ibv_async_event event;
+	int ret;
+	while (!ibv_get_async_event(verbs, &event)) {
+		if (event.event_type == IBV_EVENT_SRQ_LIMIT_REACHED) {
+			ret = rdma_srq_refill(&srq);
+			if (ret)
+				rdma_error("Failed to refill the SRQ, ret = %d \n", ret);
+			debug("SRQ refill %lu, %lu buffers posted again so far \n",
+					srq.refills, srq.reposted);
+		} else {
+			rdma_error("Unexpected async event: %s \n",
+					ibv_event_type_str(event.event_type));
+		}
+		ibv_ack_async_event(&event);
 	}
-	/* if all good, then we should have client's buffer information, lets see */
-	printf("Client side buffer information is received...\n");
-	show_rdma_buffer_attr(&client_metadata_attr);
-	printf("The client has requested buffer length of : %u bytes \n", 
-			client_metadata_attr.length);
-	/* We need to setup requested memory buffer. This is where the client will 
-	* do RDMA READs and WRITEs. */
-    server_buffer_mr = rdma_buffer_alloc(pd /* which protection domain */, 
-		    client_metadata_attr.length /* what size to allocate */, 
-		    (IBV_ACCESS_LOCAL_WRITE|
-		    IBV_ACCESS_REMOTE_READ|
-		    IBV_ACCESS_REMOTE_WRITE) /* access permissions */);
-    if(!server_buffer_mr){
-	    rdma_error("Server failed to create a buffer \n");
-	    /* we assume that it is due to out of memory error */
-	    return -ENOMEM;
-    }
-    /* This buffer is used to transmit information about the above 
-	* buffer to the client. So this contains the metadata about the server 
-	* buffer. Hence this is called metadata buffer. Since this is already 
-	* on allocated, we just register it. 
-        * We need to prepare a send I/O operation that will tell the 
-	* client the address of the server buffer. 
-	*/
-    server_metadata_attr.address = (uint64_t) server_buffer_mr->addr;
-    server_metadata_attr.length = (uint32_t) server_buffer_mr->length;
-    server_metadata_attr.stag.local_stag = (uint32_t) server_buffer_mr->lkey;
-    server_metadata_mr = rdma_buffer_register(pd /* which protection domain*/, 
-		    &server_metadata_attr /* which memory to register */, 
-		    sizeof(server_metadata_attr) /* what is the size of memory */,
-		    IBV_ACCESS_LOCAL_WRITE /* what access permission */);
-    if(!server_metadata_mr){
-	    rdma_error("Server failed to create to hold server metadata \n");
-	    /* we assume that this is due to out of memory error */
-	    return -ENOMEM;
-    }
-    /* We need to transmit this buffer. So we create a send request. 
-	* A send request consists of multiple SGE elements. In our case, we only
-	* have one 
-	*/
-    server_send_sge.addr = (uint64_t) &server_metadata_attr;
-    server_send_sge.length = sizeof(server_metadata_attr);
-    server_send_sge.lkey = server_metadata_mr->lkey;
-    /* now we link this sge to the send request */
-    bzero(&server_send_wr, sizeof(server_send_wr));
-    server_send_wr.sg_list = &server_send_sge;
-    server_send_wr.num_sge = 1; // only 1 SGE element in the array 
-    server_send_wr.opcode = IBV_WR_SEND; // This is a send request 
-    server_send_wr.send_flags = IBV_SEND_SIGNALED; // We want to get notification 
-    /* This is a fast data path operation. Posting an I/O request */
-    ret = ibv_post_send(client_qp /* which QP */, 
-		    &server_send_wr /* Send request that we prepared before */, 
-		    &bad_server_send_wr /* In case of error, this will contain failed requests */);
-    if (ret) {
-	    rdma_error("Posting of server metdata failed, errno: %d \n",
-			    -errno);
-	    return -errno;
-    }
-    /* We check for completion notification */
-    ret = process_work_completion_events(io_completion_channel, &wc, 1);
-    if (ret != 1) {
-	    rdma_error("Failed to send server metadata, ret = %d \n", ret);
-	    return ret;
-    }
-    debug("Local buffer metadata has been sent to the client \n");
-    return 0;
 }
 
-/* This is server side logic. Server passively waits for the client to call 
- * rdma_disconnect() and then it will clean up its resources */
-static int disconnect_and_cleanup()
+/* The event loop: waits for CM events, and without -T also runs the only
+ * worker, which moves the connections forward as their completions arrive */
+static int run_event_loop()
 {
+	struct pollfd fds[4];
 	struct rdma_cm_event *cm_event = NULL;
-	int ret = -1;
-       /* Now we wait for the client to send us disconnect event */
-       debug("Waiting for cm event: RDMA_CM_EVENT_DISCONNECTED\n");
-       ret = process_rdma_cm_event(cm_event_channel, 
-		       RDMA_CM_EVENT_DISCONNECTED, 
-		       &cm_event);
-       if (ret) {
-	       rdma_error("Failed to get disconnect event, ret = %d \n", ret);
-	       return ret;
-       }
-	/* We acknowledge the event */
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret) {
-		rdma_error("Failed to acknowledge the cm event %d\n", -errno);
-		return -errno;
-	}
-	printf("A disconnect event is received from the client...\n");
-	/* We free all the resources */
-	/* Destroy QP */
-	rdma_destroy_qp(cm_client_id);
-	/* Destroy client cm id */
-	ret = rdma_destroy_id(cm_client_id);
-	if (ret) {
-		rdma_error("Failed to destroy client id cleanly, %d \n", -errno);
-		// we continue anyways;
-	}
-	/* Destroy CQ */
-	ret = ibv_destroy_cq(cq);
-	if (ret) {
-		rdma_error("Failed to destroy completion queue cleanly, %d \n", -errno);
-		// we continue anyways;
+	int ret, timeout = -1, nfds;
+	while (!max_clients || served_clients < max_clients) {
+		fds[0].fd = cm_event_channel->fd;
+		fds[0].events = POLLIN;
+		nfds = 1;
+		if (!threaded && workers[0].comp_channel) {
+			fds[1].fd = workers[0].comp_channel->fd;
+			fds[1].events = POLLIN;
+			fds[2].fd = workers[0].event_fd;
+			fds[2].events = POLLIN;
+			nfds = 3;
+		}
+		if (srq_depth && verbs) {
+			fds[nfds].fd = verbs->async_fd;
+			fds[nfds].events = POLLIN;
+			nfds++;
+		}
+		ret = poll(fds, nfds, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			rdma_error("Failed to wait for events, errno: %d \n", -errno);
+			return -errno;
+		}
+		while (!rdma_get_cm_event(cm_event_channel, &cm_event)) {
+			ret = process_cm_event(cm_event);
+			if (ret)
+				rdma_error("Failed to handle a cm event, ret = %d \n", ret);
+		}
+		if (errno != EAGAIN) {
+			rdma_error("Failed to retrieve a cm event, errno %d \n", -errno);
+			return -errno;
+		}
+		if (srq_depth && verbs)
+			process_async_events();
+		if (!threaded && workers[0].comp_channel)
+			timeout = worker_round(&workers[0]);
 	}
-	/* Destroy completion channel */
-	ret = ibv_destroy_comp_channel(io_completion_channel);
-	if (ret) {
-		rdma_error("Failed to destroy completion channel cleanly, %d \n", -errno);
-		// we continue anyways;
+	return 0;
+}
+
+/* Frees the shared resources, and the connections of clients still there */
+static int cleanup()
+{
+	uint64_t one = 1;
+	int i, ret;
+	for (i = 0; i < num_workers; i++) {
+		if (workers[i].started) {
+			__atomic_store_n(&workers[i].stop, 1, __ATOMIC_RELEASE);
+			if (write(workers[i].event_fd, &one, sizeof(one)) != sizeof(one))
+				rdma_error("Failed to wake worker %d up, errno: %d \n", i, -errno);
+			pthread_join(workers[i].thread, NULL);
+		}
+		/* the worker is gone, whatever it was handed is freed here */
+		worker_commands(&workers[i]);
+		while (workers[i].conns)
+			destroy_conn(workers[i].conns);
+		/* Destroy completion channel */
+		if (workers[i].comp_channel) {
+			ret = ibv_destroy_comp_channel(workers[i].comp_channel);
+			if (ret) {
+				rdma_error("Failed to destroy completion channel cleanly, %d \n", -errno);
+				// we continue anyways;
+			}
+		}
+		close(workers[i].event_fd);
+		pthread_mutex_destroy(&workers[i].lock);
 	}
-	/* Destroy memory buffers */
-	rdma_buffer_free(server_buffer_mr);
-	rdma_buffer_deregister(server_metadata_mr);	
-	rdma_buffer_deregister(client_metadata_mr);	
+	free(workers);
+	/* the QPs that used it are gone */
+	if (srq.srq)
+		rdma_srq_destroy(&srq);
+	/* so are the connections and their buffers */
+	if (pd)
+		rdma_slab_pool_destroy(&buffer_pool);
 	/* Destroy protection domain */
-	ret = ibv_dealloc_pd(pd);
-	if (ret) {
-		rdma_error("Failed to destroy client protection domain cleanly, %d \n", -errno);
-		// we continue anyways;
+	if (pd) {
+		ret = ibv_dealloc_pd(pd);
+		if (ret) {
+			rdma_error("Failed to destroy client protection domain cleanly, %d \n", -errno);
+			// we continue anyways;
+		}
 	}
 	/* Destroy rdma server id */
 	ret = rdma_destroy_id(cm_server_id);
@@ -424,43 +1040,37 @@ static int disconnect_and_cleanup()
 void usage() 
 {
 	printf("Usage:\n");
-	printf("rdma_server: [-a <server_addr>] [-p <server_port>]\n");
+	printf("rdma_server: [-a <server_addr>] [-p <server_port>] [-R] [-r] [-P <poll_mode>] [-n <clients>]\n");
+	printf("             [-T <threads>] [-S <srq_depth>] [-H <pages>]\n");
 	printf("(default port is %d)\n", DEFAULT_RDMA_PORT);
+	printf("-R prints what the clients stream through ring buffer channels\n");
+	printf("-r answers the RPC requests of the clients, %d in flight each\n",
+			RDMA_RPC_DEFAULT_DEPTH);
+	printf("-P is how to wait for completions: blocking (default), busy, \n");
+	printf("   or adaptive[:spin_usec] (spins %d usec before blocking)\n", 
+			DEFAULT_SPIN_USEC);
+	printf("-n exits after that many clients disconnected (default: never)\n");
+	printf("-T runs the clients on that many worker threads, pinned to their\n");
+	printf("   own cores (default: 0, everything runs in the main thread)\n");
+	printf("-S makes all the clients share one receive queue with that many\n");
+	printf("   buffers, e.g. %d (default: 0, every client has its own), needs -R\n",
+			RDMA_SRQ_DEFAULT_DEPTH);
+	printf("-H puts client buffers of %lu bytes or more on huge pages:\n",
+			RDMA_HUGE_MIN_LENGTH);
+	printf("   none (default), 2m or 1g\n");
 	exit(1);
 }
 
-int test_chat_server()
-{
-	/*
-	static struct ibv_comp_channel *io_completion_channel = NULL;
-	static struct ibv_cq *cq = NULL;
-	*/	
-	//Wait for wc
-
-	struct ibv_wc wc[1];
-	debug("I AM WAITING FOR AN EVENT!\n");
-	int ret = process_work_completion_events(io_completion_channel, wc, 1);
-	debug("FOUND AN EVENT!");
-	if (wc[0].status == IBV_WC_SUCCESS && wc[0].opcode == IBV_WC_RECV) 
-	{
-		/* ack the event */
-		ibv_ack_cq_events(cq, 1); /* 1 event */
-		debug("I ACK THE EVENT!\n");
-	}
-
-
-	return 0;
-}
-
 int main(int argc, char **argv) 
 {
-	int ret, option;
+	int ret, option, i;
+	enum rdma_huge_pages huge;
 	struct sockaddr_in server_sockaddr;
 	bzero(&server_sockaddr, sizeof server_sockaddr);
 	server_sockaddr.sin_family = AF_INET; /* standard IP NET address */
 	server_sockaddr.sin_addr.s_addr = htonl(INADDR_ANY); /* passed address */
 	/* Parse Command Line Arguments, not the most reliable code */
-	while ((option = getopt(argc, argv, "a:p:")) != -1) {
+	while ((option = getopt(argc, argv, "a:p:RrP:n:T:S:H:")) != -1) {
 		switch (option) {
 			case 'a':
 				/* Remember, this will overwrite the port info */
@@ -474,44 +1084,75 @@ int main(int argc, char **argv)
 				/* passed port to listen on */
 				server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0)); 
 				break;
+			case 'R':
+				ring_mode = 1;
+				break;
+			case 'r':
+				rpc_mode = 1;
+				break;
+			case 'P':
+				if (rdma_poll_mode_parse(optarg, &poll_mode, &spin_usec))
+					usage();
+				break;
+			case 'n':
+				max_clients = strtoul(optarg, NULL, 0);
+				break;
+			case 'T':
+				num_workers = strtol(optarg, NULL, 0);
+				if (num_workers < 0)
+					usage();
+				threaded = num_workers > 0;
+				if (!threaded)
+					num_workers = 1;
+				break;
+			case 'H':
+				if (rdma_huge_pages_parse(optarg, &huge))
+					usage();
+				rdma_buffer_set_huge_pages(huge);
+				break;
+			case 'S':
+				srq_depth = strtoul(optarg, NULL, 0);
+				/* below 4 buffers there is no room for a low watermark */
+				if (srq_depth && srq_depth < 4)
+					usage();
+				break;
 			default:
 				usage();
 				break;
 		}
 	}
+	/* the shared receives only fit metadata and ring writes, the chat and the
+	 * RPCs would send more, and a connection does one thing */
+	if ((rpc_mode && ring_mode) || (srq_depth && !ring_mode))
+		usage();
 	if(!server_sockaddr.sin_port) {
 		/* If still zero, that mean no port info provided */
 		server_sockaddr.sin_port = htons(DEFAULT_RDMA_PORT); /* use default port */
 	 }
-	ret = start_rdma_server(&server_sockaddr);
-	if (ret) {
-		rdma_error("RDMA server failed to start cleanly, ret = %d \n", ret);
-		return ret;
-	}
-	ret = setup_client_resources();
-	if (ret) { 
-		rdma_error("Failed to setup client resources, ret = %d \n", ret);
-		return ret;
+	workers = calloc(num_workers, sizeof(*workers));
+	if (!workers) {
+		rdma_error("Failed to allocate the workers, -ENOMEM\n");
+		return -ENOMEM;
 	}
-	ret = accept_client_connection();
-	if (ret) {
-		rdma_error("Failed to handle client cleanly, ret = %d \n", ret);
-		return ret;
+	for (i = 0; i < num_workers; i++) {
+		workers[i].index = i;
+		pthread_mutex_init(&workers[i].lock, NULL);
+		workers[i].event_fd = eventfd(0, EFD_NONBLOCK);
+		if (workers[i].event_fd < 0) {
+			rdma_error("Failed to create the worker event fd, errno: %d \n",
+					-errno);
+			return -errno;
+		}
 	}
-	ret = send_server_metadata_to_client();
+	ret = start_rdma_server(&server_sockaddr);
 	if (ret) {
-		rdma_error("Failed to send server metadata to the client, ret = %d \n", ret);
+		rdma_error("RDMA server failed to start cleanly, ret = %d \n", ret);
 		return ret;
 	}
-	while(1)
-	{
-		int ret = test_chat_server();
-
-	}
-	ret = disconnect_and_cleanup();
+	ret = run_event_loop();
 	if (ret) { 
-		rdma_error("Failed to clean up resources properly, ret = %d \n", ret);
-		return ret;
+		rdma_error("The event loop failed, ret = %d \n", ret);
 	}
-	return 0;
+	cleanup();
+	return ret;
 }
@@ -0,0 +1,207 @@
+/*
+ * Implementation of the pool of pre-registered buffers.
+ */
+
+#include "rdma_slab.h"
+
+/* Index of the free lists of the calling thread in every pool, -1 until the
+ * thread allocates for the first time, RDMA_SLAB_MAX_THREADS if there are no
+ * lists left for it */
+static __thread int slab_thread = -1;
+static int slab_threads = 0;
+
+static struct rdma_slab_cache *slab_cache(struct rdma_slab_pool *pool)
+{
+	if (slab_thread < 0) {
+		slab_thread = __atomic_fetch_add(&slab_threads, 1, __ATOMIC_RELAXED);
+		if (slab_thread >= RDMA_SLAB_MAX_THREADS)
+			slab_thread = RDMA_SLAB_MAX_THREADS;
+	}
+	if (slab_thread == RDMA_SLAB_MAX_THREADS)
+		return NULL;
+	return &pool->caches[slab_thread];
+}
+
+static uint32_t slab_class(uint32_t length)
+{
+	uint32_t cls = 0;
+	while ((1u << (RDMA_SLAB_MIN_SHIFT + cls)) < length)
+		cls++;
+	return cls;
+}
+
+static struct rdma_slab_buf *slab_buf(struct rdma_slab_pool *pool, uint32_t id)
+{
+	return &pool->slabs[id >> 16]->bufs[id & 0xffff];
+}
+
+/* Pushes the chain first .. last on the shared stack of cls */
+static void slab_push(struct rdma_slab_pool *pool, uint32_t cls,
+		struct rdma_slab_buf *first, struct rdma_slab_buf *last)
+{
+	uint64_t head = __atomic_load_n(&pool->free_head[cls], __ATOMIC_RELAXED);
+	uint64_t new_head;
+	do {
+		__atomic_store_n(&last->next_id, (uint32_t) head, __ATOMIC_RELAXED);
+		new_head = ((head >> 32) + 1) << 32 | (first->id + 1);
+	} while (!__atomic_compare_exchange_n(&pool->free_head[cls], &head,
+				new_head, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Pops a buffer from the shared stack of cls, NULL when it is empty. The tag
+ * makes the CAS fail if the head was popped and pushed back in between. */
+static struct rdma_slab_buf *slab_pop(struct rdma_slab_pool *pool, uint32_t cls)
+{
+	uint64_t head = __atomic_load_n(&pool->free_head[cls], __ATOMIC_ACQUIRE);
+	uint64_t new_head;
+	struct rdma_slab_buf *buf;
+	do {
+		if (!(uint32_t) head)
+			return NULL;
+		buf = slab_buf(pool, (uint32_t) head - 1);
+		new_head = ((head >> 32) + 1) << 32 |
+			__atomic_load_n(&buf->next_id, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&pool->free_head[cls], &head,
+				new_head, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return buf;
+}
+
+/* Registers a new slab of buffers of cls and pushes them on the shared stack */
+static int slab_grow(struct rdma_slab_pool *pool, uint32_t cls)
+{
+	uint32_t size = 1u << (RDMA_SLAB_MIN_SHIFT + cls);
+	uint32_t slab_size = size < RDMA_SLAB_SIZE ? RDMA_SLAB_SIZE : size;
+	uint32_t i, count = slab_size / size;
+	struct rdma_slab *slab;
+	void *base = NULL;
+	int ret = 0;
+	pthread_mutex_lock(&pool->grow_lock);
+	/* someone else may have grown it while we waited */
+	if ((uint32_t) __atomic_load_n(&pool->free_head[cls], __ATOMIC_ACQUIRE))
+		goto out;
+	if (pool->nslabs == RDMA_SLAB_MAX_SLABS) {
+		rdma_error("The slab pool is full, -ENOMEM\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+	slab = calloc(1, sizeof(*slab));
+	if (!slab || posix_memalign(&base, 4096, slab_size) ||
+			!(slab->bufs = calloc(count, sizeof(*slab->bufs)))) {
+		rdma_error("Failed to allocate a slab, -ENOMEM\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	slab->mr = rdma_buffer_register(pool->pd, base, slab_size,
+			pool->permission);
+	if (!slab->mr) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < count; i++) {
+		slab->bufs[i].mr = *slab->mr;
+		slab->bufs[i].mr.addr = (char *) base + i * size;
+		slab->bufs[i].mr.length = size;
+		slab->bufs[i].id = pool->nslabs << 16 | i;
+		slab->bufs[i].cls = cls;
+		slab->bufs[i].next_id = i + 1 < count ? slab->bufs[i].id + 2 : 0;
+	}
+	pool->slabs[pool->nslabs] = slab;
+	__atomic_store_n(&pool->nslabs, pool->nslabs + 1, __ATOMIC_RELEASE);
+	pool->registered += slab_size;
+	slab_push(pool, cls, &slab->bufs[0], &slab->bufs[count - 1]);
+	debug("Slab %u of %u buffers of %u bytes registered \n",
+			pool->nslabs - 1, count, size);
+out:
+	pthread_mutex_unlock(&pool->grow_lock);
+	return ret;
+fail:
+	if (slab)
+		free(slab->bufs);
+	free(slab);
+	free(base);
+	pthread_mutex_unlock(&pool->grow_lock);
+	return ret;
+}
+
+void rdma_slab_pool_init(struct rdma_slab_pool *pool,
+		struct ibv_pd *pd,
+		enum ibv_access_flags permission)
+{
+	bzero(pool, sizeof(*pool));
+	pool->pd = pd;
+	pool->permission = permission;
+	pthread_mutex_init(&pool->grow_lock, NULL);
+}
+
+struct ibv_mr *rdma_slab_alloc(struct rdma_slab_pool *pool, uint32_t length)
+{
+	struct rdma_slab_cache *cache = slab_cache(pool);
+	struct rdma_slab_buf *buf;
+	uint32_t cls;
+	if (length > RDMA_SLAB_MAX_SIZE) {
+		rdma_error("Buffers of the pool are at most %u bytes \n",
+				RDMA_SLAB_MAX_SIZE);
+		return NULL;
+	}
+	cls = slab_class(length);
+	/* refill the free list of the thread with a batch of the shared stack */
+	while (cache && cache->count[cls] < RDMA_SLAB_BATCH) {
+		buf = slab_pop(pool, cls);
+		if (!buf)
+			break;
+		buf->next = cache->head[cls];
+		cache->head[cls] = buf;
+		cache->count[cls]++;
+	}
+	if (cache && cache->head[cls]) {
+		buf = cache->head[cls];
+		cache->head[cls] = buf->next;
+		cache->count[cls]--;
+	} else {
+		while (!(buf = slab_pop(pool, cls)))
+			if (slab_grow(pool, cls))
+				return NULL;
+	}
+	buf->mr.length = length;
+	return &buf->mr;
+}
+
+void rdma_slab_free(struct rdma_slab_pool *pool, struct ibv_mr *mr)
+{
+	struct rdma_slab_buf *buf = (struct rdma_slab_buf *) mr, *last;
+	struct rdma_slab_cache *cache = slab_cache(pool);
+	uint32_t i, cls = buf->cls;
+	if (!cache) {
+		slab_push(pool, cls, buf, buf);
+		return;
+	}
+	buf->next = cache->head[cls];
+	cache->head[cls] = buf;
+	cache->count[cls]++;
+	/* a thread that frees more than it allocates gives the excess back */
+	if (cache->count[cls] >= 2 * RDMA_SLAB_BATCH) {
+		buf = cache->head[cls];
+		for (last = buf, i = 1; i < RDMA_SLAB_BATCH; i++) {
+			__atomic_store_n(&last->next_id, last->next->id + 1,
+					__ATOMIC_RELAXED);
+			last = last->next;
+		}
+		cache->head[cls] = last->next;
+		cache->count[cls] -= RDMA_SLAB_BATCH;
+		slab_push(pool, cls, buf, last);
+	}
+}
+
+void rdma_slab_pool_destroy(struct rdma_slab_pool *pool)
+{
+	uint32_t i;
+	for (i = 0; i < pool->nslabs; i++) {
+		void *base = pool->slabs[i]->mr->addr;
+		rdma_buffer_deregister(pool->slabs[i]->mr);
+		free(base);
+		free(pool->slabs[i]->bufs);
+		free(pool->slabs[i]);
+	}
+	pthread_mutex_destroy(&pool->grow_lock);
+	bzero(pool, sizeof(*pool));
+}
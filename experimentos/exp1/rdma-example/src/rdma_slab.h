@@ -0,0 +1,95 @@
+/*
+ * Pool of pre-registered buffers.
+ *
+ * rdma_buffer_alloc() costs a calloc() and an ibv_reg_mr() for every buffer,
+ * and rdma_buffer_free() an ibv_dereg_mr() and a free(). The pool registers
+ * large slabs once and cuts them in buffers of power of two size classes, so
+ * allocating and freeing a buffer only moves it between free lists.
+ *
+ * Every thread has its own free list per size class, used without locks or
+ * atomics. They are refilled from, and give their excess back to, one shared
+ * lock-free stack per class. Only a new slab takes a lock and system calls.
+ */
+
+#ifndef RDMA_SLAB_H
+#define RDMA_SLAB_H
+
+#include "rdma_common.h"
+
+/* Smallest buffer is 64 bytes, the largest 1 MB */
+#define RDMA_SLAB_MIN_SHIFT (6)
+#define RDMA_SLAB_CLASSES (15)
+#define RDMA_SLAB_MAX_SIZE (1u << (RDMA_SLAB_MIN_SHIFT + RDMA_SLAB_CLASSES - 1))
+/* Size of a registered slab, larger classes get slabs of one buffer */
+#define RDMA_SLAB_SIZE (2u << 20)
+#define RDMA_SLAB_MAX_SLABS (4096)
+/* Threads with their own free lists, the others use the shared stacks */
+#define RDMA_SLAB_MAX_THREADS (64)
+/* Buffers moved at once between a thread and the shared stack */
+#define RDMA_SLAB_BATCH (32)
+
+/* A buffer of the pool. The MR handed out is its own, with the lkey and rkey
+ * of its slab and the address and length of the buffer. */
+struct rdma_slab_buf {
+	struct ibv_mr mr;
+	/* slab index << 16 | buffer index, links the shared stack */
+	uint32_t id;
+	uint32_t next_id;
+	uint32_t cls;
+	/* links the free list of a thread */
+	struct rdma_slab_buf *next;
+};
+
+struct rdma_slab {
+	struct ibv_mr *mr;
+	struct rdma_slab_buf *bufs;
+};
+
+/* Free lists of one thread, only that thread touches them */
+struct rdma_slab_cache {
+	struct rdma_slab_buf *head[RDMA_SLAB_CLASSES];
+	uint32_t count[RDMA_SLAB_CLASSES];
+};
+
+struct rdma_slab_pool {
+	struct ibv_pd *pd;
+	enum ibv_access_flags permission;
+	/* shared stacks: ABA tag << 32 | (id + 1), 0 when empty */
+	uint64_t free_head[RDMA_SLAB_CLASSES];
+	/* slabs never go away before the pool does, so ids stay valid */
+	struct rdma_slab *slabs[RDMA_SLAB_MAX_SLABS];
+	uint32_t nslabs;
+	uint64_t registered;
+	/* taken only to add a slab */
+	pthread_mutex_t grow_lock;
+	struct rdma_slab_cache caches[RDMA_SLAB_MAX_THREADS];
+};
+
+/**
+ * @brief Initializes an empty pool, slabs are registered as they are needed.
+ * @param pool: pool to initialize
+ * @param pd: protection domain of the buffers
+ * @param permission: OR of IBV_ACCESS_* permissions of every buffer
+ */
+void rdma_slab_pool_init(struct rdma_slab_pool *pool,
+		struct ibv_pd *pd,
+		enum ibv_access_flags permission);
+
+/**
+ * @brief Same as rdma_buffer_alloc() but takes the buffer from the pool. The
+ * buffer is not zeroed. Returns NULL if length is above RDMA_SLAB_MAX_SIZE or
+ * a new slab could not be registered.
+ * @param pool: pool to allocate from
+ * @param length: length of the buffer
+ */
+struct ibv_mr *rdma_slab_alloc(struct rdma_slab_pool *pool, uint32_t length);
+
+/* Gives a buffer of rdma_slab_alloc() back, from any thread
+ * @mr: MR returned by rdma_slab_alloc()
+ */
+void rdma_slab_free(struct rdma_slab_pool *pool, struct ibv_mr *mr);
+
+/* Deregisters and frees every slab, no buffer may be in use */
+void rdma_slab_pool_destroy(struct rdma_slab_pool *pool);
+
+#endif /* RDMA_SLAB_H */
@@ -0,0 +1,147 @@
+/*
+ * Implementation of the shared receive queue pool.
+ */
+
+#include "rdma_srq.h"
+
+/* Receives chained in one ibv_post_srq_recv() call */
+#define SRQ_POST_BATCH (32)
+
+/* Posts the free buffers, the lock must be held */
+static int srq_post_free(struct rdma_srq *srq)
+{
+	struct ibv_recv_wr recv_wr[SRQ_POST_BATCH], *bad_recv_wr = NULL;
+	struct ibv_sge sge[SRQ_POST_BATCH];
+	uint32_t i, n, index;
+	int ret;
+	while (srq->nfree) {
+		n = srq->nfree < SRQ_POST_BATCH ? srq->nfree : SRQ_POST_BATCH;
+		for (i = 0; i < n; i++) {
+			index = srq->free[srq->nfree - 1 - i];
+			sge[i].addr = (uint64_t) srq->mr->addr + index * srq->buf_size;
+			sge[i].length = srq->buf_size;
+			sge[i].lkey = srq->mr->lkey;
+			bzero(&recv_wr[i], sizeof(recv_wr[i]));
+			recv_wr[i].wr_id = index;
+			recv_wr[i].sg_list = &sge[i];
+			recv_wr[i].num_sge = 1;
+			recv_wr[i].next = i + 1 < n ? &recv_wr[i + 1] : NULL;
+		}
+		ret = ibv_post_srq_recv(srq->srq, recv_wr, &bad_recv_wr);
+		if (ret) {
+			rdma_error("Failed to post the shared receives, errno: %d \n", ret);
+			/* what was posted before bad_recv_wr leaves the free stack */
+			srq->nfree -= bad_recv_wr ? bad_recv_wr - recv_wr : 0;
+			return -ret;
+		}
+		srq->nfree -= n;
+		srq->reposted += n;
+	}
+	return 0;
+}
+
+/* Asks for IBV_EVENT_SRQ_LIMIT_REACHED once fewer than limit buffers are posted */
+static int srq_arm(struct rdma_srq *srq)
+{
+	struct ibv_srq_attr attr;
+	int ret;
+	bzero(&attr, sizeof(attr));
+	attr.srq_limit = srq->limit;
+	ret = ibv_modify_srq(srq->srq, &attr, IBV_SRQ_LIMIT);
+	if (ret) {
+		rdma_error("Failed to arm the SRQ limit, errno: %d \n", ret);
+		return -ret;
+	}
+	srq->armed = 1;
+	return 0;
+}
+
+int rdma_srq_create(struct rdma_srq *srq, struct ibv_pd *pd, uint32_t depth,
+		uint32_t buf_size, uint32_t limit)
+{
+	struct ibv_srq_init_attr init_attr;
+	uint32_t i;
+	int ret;
+	bzero(srq, sizeof(*srq));
+	if (!depth || !buf_size || !limit || limit >= depth) {
+		rdma_error("The SRQ needs buffers, and a limit between 1 and its depth \n");
+		return -EINVAL;
+	}
+	srq->depth = depth;
+	/* keep the buffers 8 byte aligned */
+	srq->buf_size = (buf_size + 7) & ~7u;
+	srq->limit = limit;
+	pthread_mutex_init(&srq->lock, NULL);
+	bzero(&init_attr, sizeof(init_attr));
+	init_attr.attr.max_wr = depth;
+	init_attr.attr.max_sge = 1;
+	srq->srq = ibv_create_srq(pd, &init_attr);
+	if (!srq->srq) {
+		rdma_error("Failed to create the SRQ, errno: %d \n", -errno);
+		return -errno;
+	}
+	srq->mr = rdma_buffer_alloc(pd, depth * srq->buf_size,
+			IBV_ACCESS_LOCAL_WRITE);
+	srq->free = calloc(depth, sizeof(*srq->free));
+	if (!srq->mr || !srq->free) {
+		rdma_error("Failed to allocate the SRQ buffers, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	for (i = 0; i < depth; i++)
+		srq->free[i] = depth - 1 - i;
+	srq->nfree = depth;
+	ret = srq_post_free(srq);
+	if (ret)
+		return ret;
+	srq->reposted = 0;
+	debug("SRQ %p with %u buffers of %u bytes, limit %u \n", srq->srq,
+			depth, srq->buf_size, limit);
+	return srq_arm(srq);
+}
+
+void *rdma_srq_buffer(struct rdma_srq *srq, uint64_t wr_id)
+{
+	return (char *) srq->mr->addr + wr_id * srq->buf_size;
+}
+
+int rdma_srq_release(struct rdma_srq *srq, uint64_t wr_id)
+{
+	int ret = 0;
+	pthread_mutex_lock(&srq->lock);
+	srq->free[srq->nfree++] = wr_id;
+	/* the last refill found nothing to post, the event will not come */
+	if (!srq->armed && srq->nfree >= srq->limit) {
+		ret = srq_post_free(srq);
+		if (!ret)
+			ret = srq_arm(srq);
+	}
+	pthread_mutex_unlock(&srq->lock);
+	return ret;
+}
+
+int rdma_srq_refill(struct rdma_srq *srq)
+{
+	int ret = 0;
+	pthread_mutex_lock(&srq->lock);
+	/* the event disarms the limit, it has to be set again */
+	srq->armed = 0;
+	if (srq->nfree) {
+		srq->refills++;
+		ret = srq_post_free(srq);
+		if (!ret)
+			ret = srq_arm(srq);
+	}
+	pthread_mutex_unlock(&srq->lock);
+	return ret;
+}
+
+void rdma_srq_destroy(struct rdma_srq *srq)
+{
+	if (srq->srq && ibv_destroy_srq(srq->srq))
+		rdma_error("Failed to destroy the SRQ cleanly, %d \n", -errno);
+	if (srq->mr)
+		rdma_buffer_free(srq->mr);
+	free(srq->free);
+	pthread_mutex_destroy(&srq->lock);
+	bzero(srq, sizeof(*srq));
+}
@@ -0,0 +1,79 @@
+/*
+ * Shared receive queue (SRQ) with a pool of pre-posted receive buffers.
+ *
+ * All the QPs created on the SRQ draw their receives from one pool, so the
+ * receive memory does not grow with the number of connections. Consumers hand
+ * the buffers back with rdma_srq_release() once they copied what they need;
+ * the buffers are not posted again one by one but in batches, when the device
+ * reports with IBV_EVENT_SRQ_LIMIT_REACHED that fewer than the low watermark
+ * are still posted.
+ */
+
+#ifndef RDMA_SRQ_H
+#define RDMA_SRQ_H
+
+#include <pthread.h>
+
+#include "rdma_common.h"
+
+/* Default number of receive buffers of the pool */
+#define RDMA_SRQ_DEFAULT_DEPTH (256)
+
+struct rdma_srq {
+	struct ibv_srq *srq;
+	/* all the receive buffers, back to back, wr_id is the buffer index */
+	struct ibv_mr *mr;
+	uint32_t depth;
+	uint32_t buf_size;
+	/* low watermark, the limit event fires below it */
+	uint32_t limit;
+	/* releases come from any thread, refills from the async event handler */
+	pthread_mutex_t lock;
+	/* stack of the indexes of the buffers that are not posted */
+	uint32_t *free;
+	uint32_t nfree;
+	/* whether the limit event is armed, when it is not the releases refill */
+	int armed;
+	/* how many times the pool was refilled, and with how many buffers */
+	uint64_t refills;
+	uint64_t reposted;
+};
+
+/**
+ * @brief Creates the SRQ, registers its buffers and posts all of them.
+ * @param srq: pool to initialize
+ * @param pd: protection domain of the QPs that will use it
+ * @param depth: number of receive buffers
+ * @param buf_size: size of a receive buffer, what the largest SEND carries
+ * @param limit: low watermark, number of posted buffers under which the pool
+ * is refilled
+ */
+int rdma_srq_create(struct rdma_srq *srq, struct ibv_pd *pd, uint32_t depth,
+		uint32_t buf_size, uint32_t limit);
+
+/**
+ * @brief Returns the buffer a receive completed in.
+ * @param srq: pool
+ * @param wr_id: wr_id of the work completion
+ */
+void *rdma_srq_buffer(struct rdma_srq *srq, uint64_t wr_id);
+
+/**
+ * @brief Gives a buffer back to the pool once its content is not needed any
+ * more. It is posted again with the next refill.
+ * @param srq: pool
+ * @param wr_id: wr_id of the work completion
+ */
+int rdma_srq_release(struct rdma_srq *srq, uint64_t wr_id);
+
+/**
+ * @brief Posts every released buffer with one chained ibv_post_srq_recv() and
+ * arms the limit event again. Call it on IBV_EVENT_SRQ_LIMIT_REACHED.
+ * @param srq: pool
+ */
+int rdma_srq_refill(struct rdma_srq *srq);
+
+/* Destroys the SRQ, the QPs using it must be gone */
+void rdma_srq_destroy(struct rdma_srq *srq);
+
+#endif /* RDMA_SRQ_H */
@@ -1,66 +1,279 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <string.h>
-#include <arpa/inet.h>
-#define SIZE 1024
-
-void send_file(FILE *fp, int sockfd){
-    int n;
-    char data[SIZE] = {0};
-
-    while(fgets(data, SIZE, fp) != NULL) 
-    {
-        if (send(sockfd, data, sizeof(data), 0) == -1) 
-        {
-            perror("Error in sending file.");
-            exit(1);
-        }
-        bzero(data, SIZE);
-    }
-}
-
-int main(){
-    char *ip = "127.0.0.1";
-    int port = 8080;
-    int e;
-
-    int sockfd;
-    struct sockaddr_in server_addr;
-    FILE *fp;
-    char *filename = "../texto.txt";
-
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if(sockfd < 0) 
-    {
-        perror("Error in socket");
-        exit(1);
-    }
-    printf("Server socket created successfully.\n");
-
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = port;
-    server_addr.sin_addr.s_addr = inet_addr(ip);
-
-    e = connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr));
-    if(e == -1) 
-    {
-        perror("Error in socket");
-        exit(1);
-    }
-    printf("Connected to Server.\n");
-
-    fp = fopen(filename, "rb");
-    if (fp == NULL) 
-    {
-        perror("Error in reading file.");
-        exit(1);
-    }
-
-    send_file(fp, sockfd);
-    printf("File data sent successfully.\n");
-
-    printf("Closing the connection.\n");
-    close(sockfd);
-    return 0;
-}
\ No newline at end of file
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+#define DEFAULT_BUF_SIZE (4 << 20)
+
+enum send_mode { MODE_SENDFILE, MODE_ZEROCOPY, MODE_COPY };
+
+double now_seconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpu_seconds(){
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* The kernel can hand the file to the NIC without it ever being copied to user space */
+void send_file_sendfile(int fd, int sockfd, uint64_t size){
+    off_t offset = 0;
+    ssize_t n;
+
+    while((uint64_t) offset < size)
+    {
+        n = sendfile(sockfd, fd, &offset, size - offset);
+        if (n <= 0)
+        {
+            perror("Error in sendfile");
+            exit(1);
+        }
+    }
+}
+
+/* Reaps MSG_ZEROCOPY notifications, returns how many sends they complete */
+uint32_t reap_zerocopy(int sockfd, int wait){
+    struct pollfd pfd = { .fd = sockfd, .events = 0 };
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    uint32_t done = 0;
+
+    if (wait && poll(&pfd, 1, -1) < 0)
+    {
+        perror("Error in poll");
+        exit(1);
+    }
+    while(1)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+            if (errno == EAGAIN)
+                return done;
+            perror("Error in reading the error queue");
+            exit(1);
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            /* notifications cover the range [ee_info, ee_data] of sends */
+            done += serr->ee_data - serr->ee_info + 1;
+        }
+    }
+}
+
+/* The pages of the mapping are pinned and sent from, the buffer can only go
+   away once the kernel reports that it is done with every send */
+void send_file_zerocopy(int fd, int sockfd, uint64_t size, size_t buf_size){
+    char *map;
+    uint64_t offset = 0;
+    uint32_t sent = 0, completed = 0;
+    ssize_t n;
+    int one = 1;
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+    {
+        perror("Error in enabling SO_ZEROCOPY");
+        exit(1);
+    }
+    if (size == 0)
+        return;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("Error in mapping the file");
+        exit(1);
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    while(offset < size)
+    {
+        n = send(sockfd, map + offset,
+            size - offset < buf_size ? size - offset : buf_size, MSG_ZEROCOPY);
+        if (n == -1 && errno == ENOBUFS)
+        {
+            /* too many pinned pages, wait for the kernel to release some */
+            completed += reap_zerocopy(sockfd, 1);
+            continue;
+        }
+        if (n == -1)
+        {
+            perror("Error in sending file.");
+            exit(1);
+        }
+        offset += n;
+        sent++;
+        completed += reap_zerocopy(sockfd, 0);
+    }
+    while(completed < sent)
+        completed += reap_zerocopy(sockfd, 1);
+    munmap(map, size);
+}
+
+/* Plain read + send through a large buffer */
+void send_file_copy(int fd, int sockfd, size_t buf_size){
+    char *data = malloc(buf_size);
+    ssize_t n, m, off;
+
+    if (data == NULL)
+    {
+        perror("Error in allocating the buffer");
+        exit(1);
+    }
+    while((n = read(fd, data, buf_size)) > 0)
+    {
+        for (off = 0; off < n; off += m)
+        {
+            m = send(sockfd, data + off, n - off, 0);
+            if (m == -1)
+            {
+                perror("Error in sending file.");
+                exit(1);
+            }
+        }
+    }
+    if (n < 0)
+    {
+        perror("Error in reading file.");
+        exit(1);
+    }
+    free(data);
+}
+
+void usage(){
+    printf("Usage: tcp_client [-a server_ip] [-p port] [-m sendfile|zerocopy|copy] [-b buffer_bytes] [file]\n");
+    printf("(defaults: 127.0.0.1 8080 sendfile %d ../texto.txt)\n", DEFAULT_BUF_SIZE);
+    exit(1);
+}
+
+int main(int argc, char **argv){
+    char *ip = "127.0.0.1";
+    int port = 8080;
+    int e, opt, fd;
+    enum send_mode mode = MODE_SENDFILE;
+    size_t buf_size = DEFAULT_BUF_SIZE;
+    int sndbuf;
+    uint64_t size, header;
+    double start, cpu, elapsed;
+    struct stat st;
+
+    int sockfd;
+    struct sockaddr_in server_addr;
+    char *filename = "../texto.txt";
+
+    while ((opt = getopt(argc, argv, "a:p:m:b:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': ip = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'b': buf_size = strtoul(optarg, NULL, 0); break;
+            case 'm':
+                if (!strcmp(optarg, "sendfile")) mode = MODE_SENDFILE;
+                else if (!strcmp(optarg, "zerocopy")) mode = MODE_ZEROCOPY;
+                else if (!strcmp(optarg, "copy")) mode = MODE_COPY;
+                else usage();
+                break;
+            default: usage();
+        }
+    }
+    if (optind < argc)
+        filename = argv[optind];
+    if (buf_size == 0)
+        usage();
+
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sockfd < 0)
+    {
+        perror("Error in socket");
+        exit(1);
+    }
+    printf("Server socket created successfully.\n");
+    /* a large socket buffer keeps the pipe full on fast links */
+    sndbuf = buf_size;
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = inet_addr(ip);
+
+    e = connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    if(e == -1)
+    {
+        perror("Error in socket");
+        exit(1);
+    }
+    printf("Connected to Server.\n");
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st))
+    {
+        perror("Error in reading file.");
+        exit(1);
+    }
+    size = st.st_size;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    /* the file size goes first so the server can preallocate the output */
+    header = htobe64(size);
+    if (send(sockfd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        perror("Error in sending the file size");
+        exit(1);
+    }
+
+    start = now_seconds();
+    cpu = cpu_seconds();
+    switch (mode)
+    {
+        case MODE_SENDFILE: send_file_sendfile(fd, sockfd, size); break;
+        case MODE_ZEROCOPY: send_file_zerocopy(fd, sockfd, size, buf_size); break;
+        case MODE_COPY: send_file_copy(fd, sockfd, buf_size); break;
+    }
+    /* wait for the server to close, so the time covers the whole transfer */
+    shutdown(sockfd, SHUT_WR);
+    recv(sockfd, &header, sizeof(header), 0);
+    elapsed = now_seconds() - start;
+    cpu = cpu_seconds() - cpu;
+    printf("File data sent successfully.\n");
+    printf("%lu bytes in %.3f s: %.2f MB/s, %.3f CPU s/GB\n", size, elapsed,
+        size / elapsed / 1e6, size ? cpu / (size / 1e9) : 0.0);
+
+    printf("Closing the connection.\n");
+    close(fd);
+    close(sockfd);
+    return 0;
+}
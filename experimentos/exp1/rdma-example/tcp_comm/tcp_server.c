@@ -1,69 +1,229 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <arpa/inet.h>
-#define SIZE 1024
-
-void write_file(int sockfd){
-    int n;
-    FILE *fp;
-    char *filename = "recv.txt";
-    char buffer[SIZE];
-
-    fp = fopen(filename, "wb");
-    do
-    {
-        n = recv(sockfd, buffer, SIZE, 0);
-        fprintf(fp, "%s", buffer);
-        bzero(buffer, SIZE);
-    } while(n);
-
-}
-
-int main(){
-    char *ip = "127.0.0.1";
-    int port = 8080;
-    int e;
-
-    int sockfd, new_sock;
-    struct sockaddr_in server_addr, new_addr;
-    socklen_t addr_size;
-    char buffer[SIZE];
-
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if(sockfd < 0) 
-    {
-        perror("Error in socket");
-        exit(1);
-    }
-    printf("Server socket created successfully.\n");
-
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = port;
-    server_addr.sin_addr.s_addr = inet_addr(ip);
-
-    e = bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr));
-    if(e < 0) 
-    {
-        perror("Error in bind");
-        exit(1);
-    }
-    printf("Binding successfull.\n");
-
-    if(listen(sockfd, 10) == 0)
-    {
-        printf("Listening....\n");
-    }
-    else
-    {
-        perror("Error in listening");
-        exit(1);
-    }
-
-    addr_size = sizeof(new_addr);
-    new_sock = accept(sockfd, (struct sockaddr*)&new_addr, &addr_size);
-    write_file(new_sock);
-    printf("Data written in the file successfully.\n");
-
-    return 0;
-}
\ No newline at end of file
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define DEFAULT_BUF_SIZE (4 << 20)
+
+enum recv_mode { MODE_SPLICE, MODE_RECV };
+
+double now_seconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpu_seconds(){
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Moves the data socket -> pipe -> file inside the kernel */
+uint64_t write_file_splice(int sockfd, int fd, uint64_t size, size_t buf_size){
+    int pipefd[2];
+    loff_t offset = 0;
+    ssize_t n, m;
+
+    if (pipe(pipefd))
+    {
+        perror("Error in pipe");
+        exit(1);
+    }
+    /* a larger pipe means fewer splice calls, best effort */
+    fcntl(pipefd[1], F_SETPIPE_SZ, buf_size);
+    while((uint64_t) offset < size)
+    {
+        n = splice(sockfd, NULL, pipefd[1], NULL, size - offset,
+            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0)
+        {
+            perror("Error in splice from the socket");
+            exit(1);
+        }
+        if (n == 0)
+            break;
+        while(n > 0)
+        {
+            m = splice(pipefd[0], NULL, fd, &offset, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m <= 0)
+            {
+                perror("Error in splice to the file");
+                exit(1);
+            }
+            n -= m;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return offset;
+}
+
+/* Large recv into a buffer, then pwrite at the right offset */
+uint64_t write_file_recv(int sockfd, int fd, uint64_t size, size_t buf_size){
+    char *buffer = malloc(buf_size);
+    uint64_t offset = 0;
+    ssize_t n;
+
+    if (buffer == NULL)
+    {
+        perror("Error in allocating the buffer");
+        exit(1);
+    }
+    while(offset < size)
+    {
+        n = recv(sockfd, buffer, size - offset < buf_size ? size - offset : buf_size, 0);
+        if (n < 0)
+        {
+            perror("Error in receiving file.");
+            exit(1);
+        }
+        if (n == 0)
+            break;
+        if (pwrite(fd, buffer, n, offset) != n)
+        {
+            perror("Error in writing file.");
+            exit(1);
+        }
+        offset += n;
+    }
+    free(buffer);
+    return offset;
+}
+
+void write_file(int sockfd, char *filename, enum recv_mode mode, size_t buf_size){
+    int fd;
+    uint64_t size, received;
+    double start, cpu, elapsed;
+    int ret;
+
+    if (recv(sockfd, &size, sizeof(size), MSG_WAITALL) != sizeof(size))
+    {
+        perror("Error in receiving the file size");
+        exit(1);
+    }
+    size = be64toh(size);
+
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror("Error in creating the file");
+        exit(1);
+    }
+    /* preallocate so the writes never have to extend the file */
+    if (size && (ret = posix_fallocate(fd, 0, size)))
+    {
+        // posix_fallocate returns the error instead of setting errno
+        fprintf(stderr, "Error in preallocating the file: %s\n", strerror(ret));
+        exit(1);
+    }
+
+    start = now_seconds();
+    cpu = cpu_seconds();
+    if (mode == MODE_SPLICE)
+        received = write_file_splice(sockfd, fd, size, buf_size);
+    else
+        received = write_file_recv(sockfd, fd, size, buf_size);
+    elapsed = now_seconds() - start;
+    cpu = cpu_seconds() - cpu;
+    if (received != size)
+    {
+        fprintf(stderr, "Connection closed after %lu of %lu bytes\n", received, size);
+        exit(1);
+    }
+    printf("%lu bytes in %.3f s: %.2f MB/s, %.3f CPU s/GB\n", size, elapsed,
+        size / elapsed / 1e6, size ? cpu / (size / 1e9) : 0.0);
+    close(fd);
+}
+
+void usage(){
+    printf("Usage: tcp_server [-a ip] [-p port] [-m splice|recv] [-b buffer_bytes] [output_file]\n");
+    printf("(defaults: 127.0.0.1 8080 splice %d recv.txt)\n", DEFAULT_BUF_SIZE);
+    exit(1);
+}
+
+int main(int argc, char **argv){
+    char *ip = "127.0.0.1";
+    int port = 8080;
+    int e, opt;
+    enum recv_mode mode = MODE_SPLICE;
+    size_t buf_size = DEFAULT_BUF_SIZE;
+    char *filename = "recv.txt";
+
+    int sockfd, new_sock, rcvbuf;
+    struct sockaddr_in server_addr, new_addr;
+    socklen_t addr_size;
+
+    while ((opt = getopt(argc, argv, "a:p:m:b:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': ip = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'b': buf_size = strtoul(optarg, NULL, 0); break;
+            case 'm':
+                if (!strcmp(optarg, "splice")) mode = MODE_SPLICE;
+                else if (!strcmp(optarg, "recv")) mode = MODE_RECV;
+                else usage();
+                break;
+            default: usage();
+        }
+    }
+    if (optind < argc)
+        filename = argv[optind];
+    if (buf_size == 0)
+        usage();
+
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sockfd < 0)
+    {
+        perror("Error in socket");
+        exit(1);
+    }
+    printf("Server socket created successfully.\n");
+    // set before listen() so that the window scale of the handshake fits it,
+    // the accepted socket inherits it
+    rcvbuf = buf_size;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = inet_addr(ip);
+
+    e = bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    if(e < 0)
+    {
+        perror("Error in bind");
+        exit(1);
+    }
+    printf("Binding successfull.\n");
+
+    if(listen(sockfd, 10) == 0)
+    {
+        printf("Listening....\n");
+    }
+    else
+    {
+        perror("Error in listening");
+        exit(1);
+    }
+
+    addr_size = sizeof(new_addr);
+    new_sock = accept(sockfd, (struct sockaddr*)&new_addr, &addr_size);
+    write_file(new_sock, filename, mode, buf_size);
+    printf("Data written in the file successfully.\n");
+    close(new_sock);
+
+    return 0;
+}